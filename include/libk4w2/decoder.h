@@ -32,6 +32,53 @@ typedef struct k4w2_decoder_ctx * k4w2_decoder_t;
 #define K4W2_DECODER_DISABLE_CUDA   (1<<6)
 /* Enables OpenGL Interoperability */
 #define K4W2_DECODER_ENABLE_OPENGL  (1<<7)
+/* Shares host memory with the device instead of copying frames from/to it.
+ * This is effective on CPUs and integrated GPUs. The source buffer passed
+ * to k4w2_decoder_request() must be kept until the slot is fetched.
+ * Source buffers are wrapped once and looked up by address afterwards, so
+ * long-lived buffers, e.g. those of k4w2_decoder_get_input_buffer() or
+ * the driver's frame buffers, should be passed. */
+#define K4W2_DECODER_ZERO_COPY      (1<<8)
+/* Runs both depth processing stages in a single kernel launch. */
+#define K4W2_DECODER_FUSED_KERNEL   (1<<9)
+/* Skips computing the IR image; only the depth plane is produced. */
+#define K4W2_DECODER_DISABLE_IR     (1<<10)
+/* How the OpenCL depth decoder evaluates cos/sin of the phase offsets.
+ * By default, each variant is benchmarked on the device when the camera
+ * parameters are set, and the fastest one is used. */
+#define K4W2_DECODER_TRIG_AUTO       (0<<11)
+#define K4W2_DECODER_TRIG_COMPUTE    (1<<11) /* per pixel cos()/sin() */
+#define K4W2_DECODER_TRIG_TABLE      (2<<11) /* precomputed float table */
+#define K4W2_DECODER_TRIG_TABLE_HALF (3<<11) /* precomputed half table */
+#define K4W2_DECODER_TRIG_MASK       (3<<11)
+/* Outputs a per-pixel confidence mask; see K4W2_CONFIDENCE_* */
+#define K4W2_DECODER_ENABLE_CONFIDENCE (1<<13)
+/* How the IR image is made from the amplitudes of the three frequencies */
+#define K4W2_DECODER_IR_AVERAGE (0<<14) /* average of all frequencies (default) */
+#define K4W2_DECODER_IR_FRQ0    (1<<14) /* amplitude of the 1st frequency only */
+#define K4W2_DECODER_IR_FRQ1    (2<<14) /* amplitude of the 2nd frequency only */
+#define K4W2_DECODER_IR_FRQ2    (3<<14) /* amplitude of the 3rd frequency only */
+#define K4W2_DECODER_IR_MASK    (3<<14)
+/* Applies a joint bilateral filter to the a/b values before phase unwrapping */
+#define K4W2_DECODER_BILATERAL_FILTER  (1<<16)
+/* Removes flying pixels on depth edges */
+#define K4W2_DECODER_EDGE_AWARE_FILTER (1<<17)
+/* Smooths depth over time with an exponential moving average. The
+ * average restarts where the depth changes quickly, so moving objects
+ * don't leave trails. Frames must be fetched in the order captured. */
+#define K4W2_DECODER_TEMPORAL_FILTER   (1<<18)
+/* Decodes each color frame with several threads, for lower latency.
+ * The JPEG image is split at restart markers which begin MCU rows; images
+ * without them are decoded by a single thread. With vertically subsampled
+ * chroma (4:2:0), pixels next to the splits may differ slightly from those
+ * decoded by a single thread, as chroma is upsampled within each part. */
+#define K4W2_DECODER_PARALLEL_JPEG     (1<<19)
+/* Makes a thumbnail of K4W2_COLOR_PREVIEW_WIDTH x K4W2_COLOR_PREVIEW_HEIGHT
+ * pixels instead of the full color image. Each pixel is the average of an
+ * 8x8 block, taken from the DC coefficients; only the Huffman codes are
+ * decoded, so the cost is bounded by the size of the JPEG image. Open
+ * another decoder without this flag for frames to be decoded at full size. */
+#define K4W2_DECODER_COLOR_PREVIEW     (1<<20)
 
 k4w2_decoder_t k4w2_decoder_open(unsigned int type, int num_slot);
 int k4w2_decoder_set_params(k4w2_decoder_t ctx,
@@ -46,12 +93,43 @@ void k4w2_decoder_close(k4w2_decoder_t *ctx);
 int k4w2_decoder_get_gl_texture(k4w2_decoder_t ctx, int slot, unsigned int option,
 				unsigned int *texturename);
 
+/* options for k4w2_decoder_map(), k4w2_decoder_get_gl_texture() and
+ * k4w2_decoder_set_pixelformat() */
+#define K4W2_DECODER_PLANE_DEPTH 0
+#define K4W2_DECODER_PLANE_IR    1
+#define K4W2_DECODER_PLANE_CONFIDENCE 2
+
+/* Bits of the confidence mask. The mask is an array of 512*424 bytes
+ * which follows the depth and IR planes in the buffer filled by
+ * k4w2_decoder_fetch(); 0 means the depth value is reliable. */
+#define K4W2_CONFIDENCE_SATURATED        0x01 /* a measurement is saturated */
+#define K4W2_CONFIDENCE_LOW_AMPLITUDE    0x02 /* amplitude is below the thresholds */
+#define K4W2_CONFIDENCE_DEALIAS_REJECTED 0x04 /* phase unwrapping is ambiguous */
+#define K4W2_CONFIDENCE_OUT_OF_RANGE     0x08 /* depth is out of [500, 4500] mm */
+#define K4W2_CONFIDENCE_EDGE             0x10 /* removed by the edge-aware filter */
+#define K4W2_CONFIDENCE_MOTION           0x20 /* the temporal filter was reset by motion */
+
+int k4w2_decoder_map(k4w2_decoder_t ctx, int slot, unsigned int option,
+		     const void **ptr);
+int k4w2_decoder_unmap(k4w2_decoder_t ctx, int slot, unsigned int option);
+int k4w2_decoder_get_input_buffer(k4w2_decoder_t ctx, int slot, void **ptr);
+
 
 #define K4W2_COLORSPACE_RGB     1
 #define K4W2_COLORSPACE_BGR     2
+/* size of the images made by K4W2_DECODER_COLOR_PREVIEW; 1/8 of 1920x1080 */
+#define K4W2_COLOR_PREVIEW_WIDTH  240
+#define K4W2_COLOR_PREVIEW_HEIGHT 135
 int k4w2_decoder_set_colorspace(k4w2_decoder_t ctx, int colorspace);
 int k4w2_decoder_get_colorspace(k4w2_decoder_t ctx);
 
+/* pixel formats of the depth decoder outputs */
+#define K4W2_PIXELFORMAT_FLOAT  0 /* 32-bit float (default) */
+#define K4W2_PIXELFORMAT_UINT16 1 /* 16-bit unsigned int; depth in millimeters */
+#define K4W2_PIXELFORMAT_HALF   2 /* 16-bit float */
+int k4w2_decoder_set_pixelformat(k4w2_decoder_t ctx, unsigned int plane, int format);
+int k4w2_decoder_get_pixelformat(k4w2_decoder_t ctx, unsigned int plane);
+
 
 EXTERN_C_END
 
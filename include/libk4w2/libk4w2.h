@@ -38,11 +38,53 @@ typedef struct k4w2_driver_ctx * k4w2_t;
 
 #define K4W2_DISABLE_COLOR (1<<1)   /**< disable color stream */
 #define K4W2_DISABLE_DEPTH (1<<2)   /**< disable depth stream */
+#define K4W2_PREFETCH_PARAMS (1<<3) /**< read all camera parameters on open */
+#define K4W2_HOLD_BUFFERS   (1<<4)  /**< keep buffers until k4w2_release_buffer() */
+#define K4W2_SALVAGE_DEPTH  (1<<5)  /**< deliver depth frames missing some sub-frames */
 #define K4W2_DISABLE_V4L2   (1<<17) /**< disable v4l2 driver   */
 #define K4W2_DISABLE_LIBUSB (1<<16) /**< disable libusb driver */
 
 k4w2_t k4w2_open(unsigned int deviceid, unsigned int flags);
 
+/**
+ * Options for k4w2_open_ex(). Initialize this with
+ * k4w2_open_options_init(), then change the fields of interest. New
+ * fields are appended; #size tells the library which of them the caller
+ * knows.
+ *
+ * Deeper transfer queues tolerate longer stalls of the event thread
+ * without losing packets, at the cost of memory; a lost depth packet
+ * drops the whole frame. The ring depth bounds how long a buffer passed
+ * to a callback stays valid, and costs about 2 MB (depth) or 1 MB
+ * (color) per frame. Shallow settings suit embedded hosts and
+ * applications which copy frames inside the callback.
+ */
+struct k4w2_open_options {
+    size_t size;             /**< sizeof(struct k4w2_open_options); set by
+				k4w2_open_options_init() */
+    int color_num_xfers;     /**< bulk transfers in flight for color (16) */
+    int color_xfer_size;     /**< bytes per bulk transfer; a multiple of 1024 (0x4000) */
+    int depth_num_xfers;     /**< isochronous transfers in flight for depth (8) */
+    int depth_num_packets;   /**< packets per isochronous transfer (32) */
+    int num_framebuffers[2]; /**< ring depth of color and depth; at least 2 (30, 30) */
+    int num_v4l2_buffers;    /**< buffers per v4l2 stream; at least 2 (8) */
+    int v4l2_userptr;        /**< 1: capture into buffers of the library (see
+				k4w2_set_allocator()) instead of mapping the
+				buffers of the kernel (0) */
+};
+void k4w2_open_options_init(struct k4w2_open_options *options);
+k4w2_t k4w2_open_ex(unsigned int deviceid, unsigned int flags,
+		    const struct k4w2_open_options *options);
+
+/** information of a sensor; see k4w2_enumerate() */
+struct k4w2_device_info {
+    unsigned int deviceid; /**< id for k4w2_open() with the driver */
+    char driver[16];       /**< "v4l2" or "libusb" */
+    char serial[64];       /**< serial number; empty if unknown */
+    char path[64];         /**< USB bus and port path, e.g. "2-1.3" */
+};
+int k4w2_enumerate(struct k4w2_device_info info[], int max_devices);
+
 typedef void (*k4w2_callback_t)(const void *buffer, int length, void *userdata);
 int k4w2_set_color_callback(k4w2_t ctx,
 			    k4w2_callback_t callback,
@@ -50,6 +92,13 @@ int k4w2_set_color_callback(k4w2_t ctx,
 int k4w2_set_depth_callback(k4w2_t ctx,
 			    k4w2_callback_t callback,
 			    void *userdata);
+int k4w2_release_buffer(k4w2_t ctx, const void *buffer);
+int k4w2_export_buffer(k4w2_t ctx, const void *buffer);
+int k4w2_set_depth_buffers(k4w2_t ctx, void *const buffers[],
+			   int num_buffers, int size);
+unsigned int k4w2_get_depth_subframe_mask(const void *buffer);
+int k4w2_get_color_jpeg(const void *buffer, int length,
+			const void **jpeg, int *jpeg_length);
 
 int k4w2_start(k4w2_t ctx);
 int k4w2_stop(k4w2_t ctx);
@@ -63,9 +112,30 @@ int k4w2_read_p0table(k4w2_t ctx,
 		      struct kinect2_p0table *p0table);
 int k4w2_read_version_string(k4w2_t ctx,
 			     char *buf, int length);
+int k4w2_preload_camera_params(k4w2_t ctx, const char *dirname);
 
 int k4w2_set_debug_level(int newlevel);
 
+/* memory allocator for frame buffers, decoders and registration maps */
+#define K4W2_ALLOC_HUGEPAGE (1<<0) /**< back buffers of 1MB or more with 2MB pages */
+#define K4W2_ALLOC_PREFAULT (1<<1) /**< fault in pages on allocation */
+
+/** user-defined allocator; see k4w2_set_allocator() */
+struct k4w2_allocator {
+    /** returns page-aligned memory of size bytes, or NULL */
+    void *(*alloc)(size_t size, unsigned int flags, void *userdata);
+    /** releases memory returned by alloc() */
+    void (*free)(void *ptr, size_t size, void *userdata);
+    void *userdata;
+};
+int k4w2_set_allocator(const struct k4w2_allocator *allocator,
+		       unsigned int flags);
+
+/* threads */
+int k4w2_set_num_event_threads(int num_threads);
+int k4w2_set_thread_affinity(k4w2_t ctx, const int cpus[], int num_cpus);
+int k4w2_set_current_thread_affinity(const int cpus[], int num_cpus);
+
 
 int k4w2_camera_params_load(const char *dirname,
 			    struct kinect2_color_camera_param *color,
@@ -75,6 +145,7 @@ int k4w2_camera_params_save(struct kinect2_color_camera_param *color,
 			    struct kinect2_depth_camera_param *depth,
 			    struct kinect2_p0table *p0table,
 			    const char *dirname);
+int k4w2_set_calibration_cache(const char *dirname);
 
 
 int k4w2_create_lut_table(short lut[], const size_t lut_size);
@@ -0,0 +1,309 @@
+/**
+ * @file   calibration.c
+ * 
+ * @brief  tables derived from camera parameters, shared among decoders
+ *         and registrations
+ *
+ * A table is identified by its name and a hash of the parameters it is
+ * made from. The first user builds it, and the others share the same
+ * read-only copy until the last one releases it.
+ *
+ * Tables can also be cached on disk; see k4w2_set_calibration_cache().
+ * A cache file consists of a header padded to CACHE_HEADER_SIZE bytes,
+ * followed by the table itself, so that it can be mapped directly.
+ */
+
+#include "module.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* increment this when the contents of any table are changed */
+#define CACHE_VERSION     2
+#define CACHE_MAGIC       "K4W2CAL"
+#define CACHE_HEADER_SIZE 4096
+#define CACHE_BYTE_ORDER  0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t key;
+    uint64_t size;
+    char name[32];
+} cache_header;
+
+typedef struct calibration_entry {
+    struct calibration_entry *next;
+    char name[32];
+    uint64_t key;
+    size_t size;
+    int refcount;
+    void *table;	/* allocated by k4w2_alloc(), or mapped */
+    size_t mapped_size;	/* size of the mapped cache file, or 0 */
+} calibration_entry;
+
+static calibration_entry *entries = NULL;
+static MUTEX_T calibration_mutex = MUTEX_INITIALIZER;
+
+static char cache_dir[FILENAME_MAX] = "";
+static int cache_dir_initialized = 0;
+
+/**
+ * Enables the on-disk cache of tables derived from the camera
+ * parameters, such as the tables of the depth decoders and the maps of
+ * registrations. Tables found in #dirname are mapped instead of being
+ * computed; the others are saved there once computed. Files are
+ * validated by the hash of the source parameters, so one directory can
+ * be shared by several sensors.
+ *
+ * By default, the directory given by the environment variable
+ * LIBK4W2_CACHE_DIR is used if set.
+ *
+ * @param dirname  directory, e.g. the one passed to
+ *                 k4w2_camera_params_save(); NULL disables the cache
+ *
+ * @return K4W2_SUCCESS
+ */
+int
+k4w2_set_calibration_cache(const char *dirname)
+{
+    MUTEX_LOCK(&calibration_mutex);
+    snprintf(cache_dir, sizeof(cache_dir), "%s", (dirname)?dirname:"");
+    cache_dir_initialized = 1;
+    MUTEX_UNLOCK(&calibration_mutex);
+    return K4W2_SUCCESS;
+}
+
+/* returns the cache directory, or NULL; calibration_mutex must be locked */
+static const char *
+get_cache_dir(void)
+{
+    if (!cache_dir_initialized) {
+	if (getenv("LIBK4W2_CACHE_DIR"))
+	    snprintf(cache_dir, sizeof(cache_dir), "%s",
+		     getenv("LIBK4W2_CACHE_DIR"));
+	cache_dir_initialized = 1;
+    }
+    return (cache_dir[0])?cache_dir:NULL;
+}
+
+static void
+cache_path(char *path, size_t len, const char *dir, const char *name, uint64_t key)
+{
+    snprintf(path, len, "%s/%s-%016llx.cache", dir, name, (unsigned long long)key);
+}
+
+/* maps the cached table onto e->table */
+static int
+load_cache(const char *dir, calibration_entry *e)
+{
+    char path[FILENAME_MAX];
+    const size_t file_size = CACHE_HEADER_SIZE + e->size;
+    const cache_header *h;
+    struct stat st;
+    void *ptr;
+    int fd;
+
+    cache_path(path, sizeof(path), dir, e->name, e->key);
+    fd = open(path, O_RDONLY);
+    if (-1 == fd)
+	return K4W2_ERROR;
+    if (fstat(fd, &st) || (size_t)st.st_size != file_size) {
+	VERBOSE("%s has wrong size", path);
+	close(fd);
+	return K4W2_ERROR;
+    }
+    ptr = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == ptr) {
+	VERBOSE("mmap(%s) failed; %s", path, strerror(errno));
+	return K4W2_ERROR;
+    }
+
+    h = (const cache_header *)ptr;
+    if (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) ||
+	CACHE_VERSION != h->version || CACHE_BYTE_ORDER != h->byte_order ||
+	e->key != h->key || e->size != h->size ||
+	strncmp(e->name, h->name, sizeof(h->name))) {
+	VERBOSE("%s is not valid", path);
+	munmap(ptr, file_size);
+	return K4W2_ERROR;
+    }
+
+    e->table = (unsigned char *)ptr + CACHE_HEADER_SIZE;
+    e->mapped_size = file_size;
+    VERBOSE("%s was loaded", path);
+    return K4W2_SUCCESS;
+}
+
+/* saves e->table; the file is renamed into place once written */
+static int
+save_cache(const char *dir, const calibration_entry *e)
+{
+    char path[FILENAME_MAX];
+    char tmp[FILENAME_MAX + 16];
+    unsigned char header[CACHE_HEADER_SIZE];
+    cache_header *h = (cache_header *)header;
+    int fd;
+    int r = K4W2_ERROR;
+
+    k4w2_mkdir_p(dir);
+
+    memset(header, 0, sizeof(header));
+    memcpy(h->magic, CACHE_MAGIC, sizeof(h->magic));
+    h->version = CACHE_VERSION;
+    h->byte_order = CACHE_BYTE_ORDER;
+    h->key = e->key;
+    h->size = e->size;
+    snprintf(h->name, sizeof(h->name), "%s", e->name);
+
+    cache_path(path, sizeof(path), dir, e->name, e->key);
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+    if (-1 == fd) {
+	VERBOSE("open(%s) failed; %s", tmp, strerror(errno));
+	return K4W2_ERROR;
+    }
+    if (sizeof(header) == write(fd, header, sizeof(header)) &&
+	(ssize_t)e->size == write(fd, e->table, e->size))
+	r = K4W2_SUCCESS;
+    close(fd);
+
+    if (K4W2_SUCCESS == r && rename(tmp, path)) {
+	VERBOSE("rename(%s) failed; %s", path, strerror(errno));
+	r = K4W2_ERROR;
+    }
+    if (K4W2_SUCCESS != r)
+	unlink(tmp);
+    else
+	VERBOSE("%s was saved", path);
+    return r;
+}
+
+/**
+ * Updates the hash value #h with #len bytes of #data (64-bit FNV-1a).
+ * Start with K4W2_HASH_INIT.
+ *
+ * @return new hash value
+ */
+uint64_t
+k4w2_hash64(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+	h ^= p[i];
+	h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * Returns the table of #name made from the parameters of hash #key.
+ * If no one holds the table, it is allocated and filled by #build.
+ *
+ * @param name      name of the table
+ * @param key       hash of the parameters; see k4w2_hash64()
+ * @param size      size of the table in bytes
+ * @param build     function that fills the table
+ * @param userdata  passed to #build
+ *
+ * @return a read-only table, or NULL. The table must be released by
+ *         k4w2_calibration_release().
+ */
+const void *
+k4w2_calibration_acquire(const char *name, uint64_t key, size_t size,
+			 k4w2_calibration_build_t build, void *userdata)
+{
+    calibration_entry *e;
+    void *table = NULL;
+    const char *dir;
+
+    MUTEX_LOCK(&calibration_mutex);
+
+    for (e = entries; e; e = e->next) {
+	if (e->key == key && e->size == size && 0 == strcmp(e->name, name)) {
+	    ++e->refcount;
+	    table = e->table;
+	    VERBOSE("%s is shared; refcount %d", name, e->refcount);
+	    goto exit;
+	}
+    }
+
+    e = (calibration_entry *)calloc(1, sizeof(*e));
+    if (!e)
+	goto exit;
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->key = key;
+    e->size = size;
+    e->refcount = 1;
+
+    dir = get_cache_dir();
+    if (!dir || K4W2_SUCCESS != load_cache(dir, e)) {
+	e->table = k4w2_alloc(size);
+	if (!e->table) {
+	    free(e);
+	    goto exit;
+	}
+	if (K4W2_SUCCESS != build(e->table, userdata)) {
+	    VERBOSE("failed to build %s", name);
+	    k4w2_free(e->table);
+	    free(e);
+	    goto exit;
+	}
+	if (dir)
+	    save_cache(dir, e);
+    }
+    e->next = entries;
+    entries = e;
+    table = e->table;
+
+exit:
+    MUTEX_UNLOCK(&calibration_mutex);
+    return table;
+}
+
+/**
+ * Releases a table returned by k4w2_calibration_acquire().
+ *
+ * @param table  table, or NULL
+ */
+void
+k4w2_calibration_release(const void *table)
+{
+    calibration_entry **p;
+
+    if (!table)
+	return;
+
+    MUTEX_LOCK(&calibration_mutex);
+    for (p = &entries; *p; p = &(*p)->next) {
+	calibration_entry *e = *p;
+	if (e->table != table)
+	    continue;
+	assert(0 < e->refcount);
+	if (0 == --e->refcount) {
+	    *p = e->next;
+	    if (e->mapped_size)
+		munmap((unsigned char *)e->table - CACHE_HEADER_SIZE,
+		       e->mapped_size);
+	    else
+		k4w2_free(e->table);
+	    free(e);
+	}
+	break;
+    }
+    MUTEX_UNLOCK(&calibration_mutex);
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset:  4
+ * End:
+ */
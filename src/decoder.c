@@ -66,14 +66,28 @@ k4w2_decoder_get_colorspace_default(k4w2_decoder_t decoder)
     return K4W2_NOT_SUPPORTED;
 }
 
+static int
+k4w2_decoder_set_pixelformat_default(k4w2_decoder_t decoder, unsigned int plane, int format)
+{
+    return (K4W2_PIXELFORMAT_FLOAT == format) ? K4W2_SUCCESS : K4W2_NOT_SUPPORTED;
+}
+
+static int
+k4w2_decoder_get_pixelformat_default(k4w2_decoder_t decoder, unsigned int plane)
+{
+    return K4W2_PIXELFORMAT_FLOAT;
+}
+
 k4w2_decoder_t
 allocate_decoder(const k4w2_decoder_ops *ops, int ctx_size)
 {
-    k4w2_decoder_t ctx = (k4w2_decoder_t)malloc(ctx_size);
+    k4w2_decoder_t ctx = (k4w2_decoder_t)k4w2_alloc(ctx_size);
 
     assert((size_t)ctx_size >= sizeof(k4w2_decoder_t));
 
-    memset(ctx, 0, sizeof(ctx_size));
+    if (!ctx)
+	return NULL;
+    memset(ctx, 0, ctx_size);
     ctx->ops = *ops;
 
     assert(ctx->ops.open);
@@ -85,6 +99,8 @@ allocate_decoder(const k4w2_decoder_ops *ops, int ctx_size)
     assert(ctx->ops.close);
     if (!ctx->ops.set_colorspace) ctx->ops.set_colorspace = k4w2_decoder_set_colorspace_default;
     if (!ctx->ops.get_colorspace) ctx->ops.get_colorspace = k4w2_decoder_get_colorspace_default;
+    if (!ctx->ops.set_pixelformat) ctx->ops.set_pixelformat = k4w2_decoder_set_pixelformat_default;
+    if (!ctx->ops.get_pixelformat) ctx->ops.get_pixelformat = k4w2_decoder_get_pixelformat_default;
     return ctx;
 }
 
@@ -105,6 +121,7 @@ k4w2_decoder_open(const unsigned int type, const int num_slot)
 	INITIALIZE_MODULE(k4w2_decoder_depth_cl_init);
 #endif
 	INITIALIZE_MODULE(k4w2_decoder_depth_cpu_init);
+	INITIALIZE_MODULE(k4w2_decoder_color_preview_init);
 #if defined HAVE_NVJPEG
 	INITIALIZE_MODULE(k4w2_decoder_color_nvjpeg_init);
 #endif
@@ -136,7 +153,7 @@ k4w2_decoder_open(const unsigned int type, const int num_slot)
 	    VERBOSE("%s decoder is skipped.", decoder[i].name);
 	}
 
-	free(ctx);
+	k4w2_free(ctx);
 	ctx = NULL;
     }
 
@@ -170,6 +187,32 @@ k4w2_decoder_set_colorspace(k4w2_decoder_t ctx, int colorspace)
     return ctx->ops.set_colorspace(ctx, colorspace);
 }
 
+/** 
+ * Selects the pixel format of an output plane of the depth decoder.
+ * This changes the layout of the buffer filled by k4w2_decoder_fetch();
+ * the IR plane follows the depth plane, and each plane occupies
+ * 512*424 pixels of its own format. Call this before requesting frames.
+ * 
+ * @param ctx 
+ * @param plane   K4W2_DECODER_PLANE_DEPTH or K4W2_DECODER_PLANE_IR
+ * @param format  K4W2_PIXELFORMAT_*
+ * 
+ * @return K4W2_NOT_SUPPORTED if the decoder cannot emit #format
+ */
+int
+k4w2_decoder_set_pixelformat(k4w2_decoder_t ctx, unsigned int plane, int format)
+{
+    CHECK(ctx);
+    return ctx->ops.set_pixelformat(ctx, plane, format);
+}
+
+int
+k4w2_decoder_get_pixelformat(k4w2_decoder_t ctx, unsigned int plane)
+{
+    CHECK(ctx);
+    return ctx->ops.get_pixelformat(ctx, plane);
+}
+
 int
 k4w2_decoder_request(k4w2_decoder_t ctx, int slot, const void *src, int src_length)
 {
@@ -202,6 +245,67 @@ k4w2_decoder_fetch(k4w2_decoder_t ctx, int slot, void *dst, int dst_length)
     return ctx->ops.fetch(ctx, slot, dst, dst_length);
 }
 
+/** 
+ * Maps an output plane of #slot to the host memory. The returned
+ * pointer is valid until k4w2_decoder_unmap() or the next request to
+ * the same slot.
+ * 
+ * @param ctx 
+ * @param slot 
+ * @param option  K4W2_DECODER_PLANE_DEPTH, K4W2_DECODER_PLANE_IR or
+ *                K4W2_DECODER_PLANE_CONFIDENCE
+ * @param ptr     the mapped pointer will be stored here
+ * 
+ * @return K4W2_NOT_SUPPORTED if the decoder cannot map its outputs
+ */
+int
+k4w2_decoder_map(k4w2_decoder_t ctx, int slot, unsigned int option,
+		 const void **ptr)
+{
+    CHECK(ctx);
+    if (ctx->ops.map)
+	return ctx->ops.map(ctx, slot, option, ptr);
+    else
+	return K4W2_NOT_SUPPORTED;
+}
+
+int
+k4w2_decoder_unmap(k4w2_decoder_t ctx, int slot, unsigned int option)
+{
+    CHECK(ctx);
+    if (ctx->ops.unmap)
+	return ctx->ops.unmap(ctx, slot, option);
+    else
+	return K4W2_NOT_SUPPORTED;
+}
+
+/** 
+ * Returns the buffer from which #slot reads its source without copies.
+ * Passing this buffer to k4w2_decoder_request() of the same slot saves
+ * the copy into the decoder; see also k4w2_set_depth_buffers(). The
+ * buffer is valid until the decoder is closed.
+ *
+ * Decoders which read any source in place, such as the CPU decoders,
+ * have no input buffers.
+ * 
+ * @param ctx 
+ * @param slot 
+ * @param ptr     the buffer will be stored here
+ * 
+ * @return K4W2_NOT_SUPPORTED if the decoder has no input buffers
+ */
+int
+k4w2_decoder_get_input_buffer(k4w2_decoder_t ctx, int slot, void **ptr)
+{
+    CHECK(ctx);
+    if (slot < 0 || ctx->num_slot <= slot || !ptr)
+	return K4W2_ERROR;
+    if (ctx->ops.get_input_buffer)
+	return ctx->ops.get_input_buffer(ctx, slot, ptr);
+    else
+	return K4W2_NOT_SUPPORTED;
+}
+
 void
 k4w2_decoder_close(k4w2_decoder_t *ctx)
 {
@@ -209,6 +313,7 @@ k4w2_decoder_close(k4w2_decoder_t *ctx)
 	return;
     if (*ctx) {
 	(*ctx)->ops.close(*ctx);
+	k4w2_free(*ctx);
 	*ctx = 0;
     }
 }
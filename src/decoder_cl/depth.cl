@@ -25,6 +25,76 @@
  * either License.
  */
 
+/*
+ * Outputs are written to OpenGL-shared images when OUTPUT_IMAGE is defined,
+ * otherwise to plain buffers, which can be mapped to the host. Buffers
+ * hold pixels in one of the PIXELFORMAT_* formats; images are always
+ * float.
+ */
+#define PIXELFORMAT_FLOAT  0 /* K4W2_PIXELFORMAT_FLOAT */
+#define PIXELFORMAT_UINT16 1 /* K4W2_PIXELFORMAT_UINT16 */
+#define PIXELFORMAT_HALF   2 /* K4W2_PIXELFORMAT_HALF */
+
+#if defined(OUTPUT_IMAGE)
+#  define OUTPUT_T __write_only image2d_t
+#  define WRITE_OUTPUT(out, fmt, x, y, v) write_imagef((out), (int2)((x),(y)), (v))
+#else
+#  define OUTPUT_T global uchar *
+#  define WRITE_OUTPUT(out, fmt, x, y, v) writeOutput((out), (fmt), (y) * 512 + (x), (v))
+
+void writeOutput(global uchar *out, const int format, const uint i, const float v)
+{
+    if (format == PIXELFORMAT_UINT16) {
+	((global ushort *)out)[i] = convert_ushort_sat_rte(v);
+    } else if (format == PIXELFORMAT_HALF) {
+	vstore_half_rte(v, i, (global half *)out);
+    } else {
+	((global float *)out)[i] = v;
+    }
+}
+#endif
+
+/*
+ * Bits of the confidence mask; must match K4W2_CONFIDENCE_* in decoder.h.
+ * The mask is stored only if OUTPUT_CONFIDENCE is defined.
+ */
+#define CONFIDENCE_SATURATED        0x01
+#define CONFIDENCE_LOW_AMPLITUDE    0x02
+#define CONFIDENCE_DEALIAS_REJECTED 0x04
+#define CONFIDENCE_OUT_OF_RANGE     0x08
+#define CONFIDENCE_EDGE             0x10
+#define CONFIDENCE_MOTION           0x20
+
+#if defined(TEMPORAL_FILTER)
+/*
+ * Updates the running average of pixel i with depth d and returns the
+ * filtered depth. Invalid pixels pass through and clear the state, and
+ * large changes restart the average.
+ */
+float temporalUpdate(global float *state, const uint i, const float d, uchar *flags)
+{
+    const float s = state[i];
+    float out = d;
+
+    if (MIN_DEPTH <= d && d <= MAX_DEPTH) {
+	if (s == 0.0f) {
+	    /* first valid sample */
+	} else if (fabs(d - s) > max(TEMPORAL_RESET_ABS, TEMPORAL_RESET_REL * s)) {
+	    *flags |= CONFIDENCE_MOTION;
+	} else {
+	    out = s + TEMPORAL_ALPHA * (d - s);
+	}
+	state[i] = out;
+    } else {
+	state[i] = 0.0f;
+    }
+    return out;
+}
+#  define TEMPORAL_UPDATE(state, i, d, flags) temporalUpdate((state), (i), (d), (flags))
+#else
+#  define TEMPORAL_UPDATE(state, i, d, flags) (d)
+#endif
+
 /*******************************************************************************
  * Process pixel stage 1
  ******************************************************************************/
@@ -45,28 +115,62 @@ float decodePixelMeasurement(global const ushort *data, global const short *lut1
      return (float)lut11to16[(x < 1 || 510 < x || col_idx > 352) ? 0 : ((data[data_idx0] >> upper_bytes) | (data[data_idx1] << lower_bytes)) & 2047];
 }
 
-float2 processMeasurementTriple(const float ab_multiplier_per_frq, const float p0, const float3 v, int *invalid)
+/*
+ * cos/sin of the phases are either computed from p0_table, or loaded from
+ * tables that the host has precomputed in float or half precision. Each
+ * table has six entries (cos x3, -sin x3) per pixel and frequency.
+ */
+#define TRIG_COMPUTE    0
+#define TRIG_TABLE      1
+#define TRIG_TABLE_HALF 2
+
+void loadTrig(const int trig_mode,
+	      global const float3 *p0_table,
+	      global const float *trig_table,
+	      global const half *trig_table_half,
+	      const uint frq, const uint i,
+	      float3 *p0cos, float3 *p0sin)
 {
-    float3 p0vec = (float3)(p0) + (float3)(PHASE_IN_RAD0, PHASE_IN_RAD1, PHASE_IN_RAD2);
-    float3 p0cos = cos(p0vec);
-    float3 p0sin = sin(-p0vec);
+    const uint offset = (frq * (512 * 424) + i) * 6;
+
+    if (trig_mode == TRIG_TABLE) {
+	*p0cos = vload3(0, trig_table + offset);
+	*p0sin = vload3(1, trig_table + offset);
+    } else if (trig_mode == TRIG_TABLE_HALF) {
+	*p0cos = vload_half3(0, trig_table_half + offset);
+	*p0sin = vload_half3(1, trig_table_half + offset);
+    } else {
+	const float3 p0 = p0_table[i];
+	const float p0f = (frq == 0) ? p0.x : ((frq == 1) ? p0.y : p0.z);
+	float3 p0vec = (float3)(p0f) + (float3)(PHASE_IN_RAD0, PHASE_IN_RAD1, PHASE_IN_RAD2);
+	*p0cos = cos(p0vec);
+	*p0sin = sin(-p0vec);
+    }
+}
 
+float2 processMeasurementTriple(const float ab_multiplier_per_frq,
+				const float3 p0cos, const float3 p0sin,
+				const float3 v, int *invalid)
+{
     *invalid = *invalid && any(isequal(v, (float3)(32767.0f)));
 
     return (float2)(dot(v, p0cos), dot(v, p0sin)) * ab_multiplier_per_frq;
 }
 
-void kernel processPixelStage1(global const short *lut11to16,
-			       global const float *z_table,
-			       global const float3 *p0_table,
-			       global const ushort *data,
-                               global float3 *a_out,
-			       global float3 *b_out,
-			       global float3 *n_out,
-			       __write_only image2d_t ir_out)
+/*
+ * Decodes the nine measurements of pixel i and computes a/b values and
+ * amplitudes of the three frequencies.
+ */
+void decodePixel(global const short *lut11to16,
+		 global const float *z_table,
+		 global const float3 *p0_table,
+		 global const ushort *data,
+		 const int trig_mode,
+		 global const float *trig_table,
+		 global const half *trig_table_half,
+		 const uint i,
+		 float3 *a_out, float3 *b_out, float3 *n_out, int3 *saturated_out)
 {
-    const uint i = get_global_id(0);
-
     const uint x = i % 512;
     const uint y = i / 512;
 
@@ -78,22 +182,25 @@ void kernel processPixelStage1(global const short *lut11to16,
     int saturatedY = valid;
     int saturatedZ = valid;
     int3 invalid_pixel = (int3)((int)(!valid));
-    const float3 p0 = p0_table[i];
+    float3 p0cos, p0sin;
 
     const float3 v0 = (float3)(decodePixelMeasurement(data, lut11to16, 0, x, y_in),
 			       decodePixelMeasurement(data, lut11to16, 1, x, y_in),
 			       decodePixelMeasurement(data, lut11to16, 2, x, y_in));
-    const float2 ab0 = processMeasurementTriple(AB_MULTIPLIER_PER_FRQ0, p0.x, v0, &saturatedX);
+    loadTrig(trig_mode, p0_table, trig_table, trig_table_half, 0, i, &p0cos, &p0sin);
+    const float2 ab0 = processMeasurementTriple(AB_MULTIPLIER_PER_FRQ0, p0cos, p0sin, v0, &saturatedX);
 
     const float3 v1 = (float3)(decodePixelMeasurement(data, lut11to16, 3, x, y_in),
 			       decodePixelMeasurement(data, lut11to16, 4, x, y_in),
 			       decodePixelMeasurement(data, lut11to16, 5, x, y_in));
-    const float2 ab1 = processMeasurementTriple(AB_MULTIPLIER_PER_FRQ1, p0.y, v1, &saturatedY);
+    loadTrig(trig_mode, p0_table, trig_table, trig_table_half, 1, i, &p0cos, &p0sin);
+    const float2 ab1 = processMeasurementTriple(AB_MULTIPLIER_PER_FRQ1, p0cos, p0sin, v1, &saturatedY);
 
     const float3 v2 = (float3)(decodePixelMeasurement(data, lut11to16, 6, x, y_in),
 			       decodePixelMeasurement(data, lut11to16, 7, x, y_in),
 			       decodePixelMeasurement(data, lut11to16, 8, x, y_in));
-    const float2 ab2 = processMeasurementTriple(AB_MULTIPLIER_PER_FRQ2, p0.z, v2, &saturatedZ);
+    loadTrig(trig_mode, p0_table, trig_table, trig_table_half, 2, i, &p0cos, &p0sin);
+    const float2 ab2 = processMeasurementTriple(AB_MULTIPLIER_PER_FRQ2, p0cos, p0sin, v2, &saturatedZ);
 
     float3 a = select((float3)(ab0.x, ab1.x, ab2.x), (float3)(0.0f), invalid_pixel);
     float3 b = select((float3)(ab0.y, ab1.y, ab2.y), (float3)(0.0f), invalid_pixel);
@@ -103,31 +210,77 @@ void kernel processPixelStage1(global const short *lut11to16,
     a = select(a, (float3)(0.0f), saturated);
     b = select(b, (float3)(0.0f), saturated);
 
-    a_out[i] = a;
-    b_out[i] = b;
-    n_out[i] = n;
-    write_imagef(ir_out, (int2)(x,y),
-		 	 min(dot(select(n, (float3)(65535.0f), saturated),
-				  (float3)(0.333333333f  * AB_MULTIPLIER * AB_OUTPUT_MULTIPLIER)), 65535.0f)	)		;
+    *a_out = a;
+    *b_out = b;
+    *n_out = n;
+    *saturated_out = saturated;
 }
 
+/* IR_MODE selects the frequencies averaged; 0 means all, 1-3 one of them */
+#if IR_MODE == 1
+#  define IR_WEIGHTS (float3)(1.0f, 0.0f, 0.0f)
+#elif IR_MODE == 2
+#  define IR_WEIGHTS (float3)(0.0f, 1.0f, 0.0f)
+#elif IR_MODE == 3
+#  define IR_WEIGHTS (float3)(0.0f, 0.0f, 1.0f)
+#else
+#  define IR_WEIGHTS (float3)(0.333333333f)
+#endif
+
+float computeIR(const float3 n, const int3 saturated)
+{
+    return min(dot(select(n, (float3)(65535.0f), saturated),
+		   IR_WEIGHTS * (AB_MULTIPLIER * AB_OUTPUT_MULTIPLIER)), 65535.0f);
+}
 
-/*******************************************************************************
- * Process pixel stage 2
- ******************************************************************************/
-void kernel processPixelStage2(global const float3 *a_in,
-			       global const float3 *b_in,
-			       global const float *x_table,
+void kernel processPixelStage1(global const short *lut11to16,
 			       global const float *z_table,
-			       __write_only image2d_t depth_out)
+			       global const float3 *p0_table,
+			       global const ushort *data,
+                               global float3 *a_out,
+			       global float3 *b_out,
+			       global float3 *n_out,
+			       OUTPUT_T ir_out,
+			       const int trig_mode,
+			       global const float *trig_table,
+			       global const half *trig_table_half,
+			       const int ir_format,
+			       global uchar *confidence)
 {
     const uint i = get_global_id(0);
+
     const uint x = i % 512;
     const uint y = i / 512;
 
-    float3 a = a_in[i];
-    float3 b = b_in[i];
+    float3 a, b, n;
+    int3 saturated;
+    decodePixel(lut11to16, z_table, p0_table, data,
+		trig_mode, trig_table, trig_table_half,
+		i, &a, &b, &n, &saturated);
 
+    a_out[i] = a;
+    b_out[i] = b;
+#if defined(OUTPUT_CONFIDENCE)
+    /* stage 2 adds the other bits */
+    confidence[i] = any(saturated != (int3)(0)) ? CONFIDENCE_SATURATED : 0;
+#endif
+#if !defined(DISABLE_IR)
+    n_out[i] = n;
+    WRITE_OUTPUT(ir_out, ir_format, x, y, computeIR(n, saturated));
+#endif
+}
+
+
+/*******************************************************************************
+ * Process pixel stage 2
+ ******************************************************************************/
+float computeDepth(const float3 a, const float3 b,
+		   global const float *x_table,
+		   global const float *z_table,
+		   const uint i,
+		   uchar *flags,
+		   float *ir_sum_out)
+{
     float3 phase = atan2(b, a);
     phase = select(phase, phase + 2.0f * M_PI_F, isless(phase, (float3)(0.0f)));
     phase = select(phase, (float3)(0.0f), isnan(phase));
@@ -136,8 +289,10 @@ void kernel processPixelStage2(global const float3 *a_in,
     float ir_sum = ir.x + ir.y + ir.z;
     float ir_min = min(ir.x, min(ir.y, ir.z));
     float ir_max = max(ir.x, max(ir.y, ir.z));
+    *ir_sum_out = ir_sum;
 
     float phase_final = 0;
+    uchar f = CONFIDENCE_LOW_AMPLITUDE;
 
     if(ir_min >= INDIVIDUAL_AB_THRESHOLD && ir_sum >= AB_THRESHOLD)
     {
@@ -205,6 +360,7 @@ void kernel processPixelStage2(global const float3 *a_in,
 	float mask3 = MAX_DEALIAS_CONFIDENCE * MAX_DEALIAS_CONFIDENCE >= norm ? 1.0f : 0.0f;
 	t10 *= mask3;
 	phase_final = true/*(modeMask & 2) != 0*/ ? t11 : t10;
+	f = (mask * mask2 == 0.0f) ? CONFIDENCE_DEALIAS_REJECTED : 0;
     }
 
     float zmultiplier = z_table[i];
@@ -224,6 +380,256 @@ void kernel processPixelStage2(global const float3 *a_in,
 
     float d = cond1 ? depth_fit : depth_linear; // r1.y -> later r2.z
 
-    write_imagef(depth_out, (int2)(x,y), d);
+    *flags = f | ((MIN_DEPTH <= d && d <= MAX_DEPTH) ? 0 : CONFIDENCE_OUT_OF_RANGE);
+    return d;
+}
+
+void kernel processPixelStage2(global const float3 *a_in,
+			       global const float3 *b_in,
+			       global const float *x_table,
+			       global const float *z_table,
+			       OUTPUT_T depth_out,
+			       const int depth_format,
+			       global uchar *confidence,
+			       global float *raw_depth_out,
+			       global float *ir_sum_out,
+			       global float *temporal_state)
+{
+    const uint i = get_global_id(0);
+    const uint x = i % 512;
+    const uint y = i / 512;
+
+    uchar flags;
+    float ir_sum;
+    float d = computeDepth(a_in[i], b_in[i], x_table, z_table, i, &flags, &ir_sum);
+
+#if defined(EDGE_AWARE_FILTER)
+    /* filterPixelStage2() writes the final depth */
+    raw_depth_out[i] = d;
+    ir_sum_out[i] = ir_sum;
+#else
+    d = TEMPORAL_UPDATE(temporal_state, i, d, &flags);
+    WRITE_OUTPUT(depth_out, depth_format, x, y, d);
+#endif
+#if defined(OUTPUT_CONFIDENCE)
+    confidence[i] |= flags;
+#endif
+}
+
+
+/*******************************************************************************
+ * Filters, based on the ones of libfreenect2
+ ******************************************************************************/
+#if defined(BILATERAL_FILTER)
+constant float gaussian_kernel[9] = {
+    0.1069973f, 0.1131098f, 0.1069973f,
+    0.1131098f, 0.1195716f, 0.1131098f,
+    0.1069973f, 0.1131098f, 0.1069973f
+};
+
+/*
+ * Joint bilateral filter on a/b values, which runs between stage 1 and
+ * stage 2. The weights depend on the difference of the phase angles, so
+ * edges are preserved. max_edge_test is cleared for pixels on strong
+ * edges, and filterPixelStage2() removes them.
+ */
+void kernel filterPixelStage1(global const float3 *a_in,
+			      global const float3 *b_in,
+			      global float3 *a_out,
+			      global float3 *b_out,
+			      global uchar *max_edge_test)
+{
+    const uint i = get_global_id(0);
+    const uint x = i % 512;
+    const uint y = i / 512;
+
+    const float3 self_a = a_in[i];
+    const float3 self_b = b_in[i];
+
+    if (x < 1 || y < 1 || x > 510 || y > 422) {
+	a_out[i] = self_a;
+	b_out[i] = self_b;
+	max_edge_test[i] = 1;
+	return;
+    }
+
+    const float3 self_norm = sqrt(self_a * self_a + self_b * self_b);
+    const float3 self_normalized_a = self_a / self_norm;
+    const float3 self_normalized_b = self_b / self_norm;
+
+    /* weak pixels are averaged with plain gaussian weights */
+    const int3 weak = isless(self_norm * self_norm, (float3)(JOINT_BILATERAL_THRESHOLD));
+    const float3 threshold = select((float3)(JOINT_BILATERAL_THRESHOLD), (float3)(0.0f), weak);
+    const float3 joint_bilateral_exp = select((float3)(JOINT_BILATERAL_EXP), (float3)(0.0f), weak);
+
+    float3 weight_acc = (float3)(0.0f);
+    float3 weighted_a_acc = (float3)(0.0f);
+    float3 weighted_b_acc = (float3)(0.0f);
+    float3 dist_acc = (float3)(0.0f);
+
+    int j = 0;
+    for (int yi = -1; yi < 2; ++yi) {
+	for (int xi = -1; xi < 2; ++xi, ++j) {
+	    if (yi == 0 && xi == 0) {
+		weight_acc += gaussian_kernel[j];
+		weighted_a_acc += gaussian_kernel[j] * self_a;
+		weighted_b_acc += gaussian_kernel[j] * self_b;
+		continue;
+	    }
+
+	    const uint i_other = (y + yi) * 512 + x + xi;
+	    const float3 other_a = a_in[i_other];
+	    const float3 other_b = b_in[i_other];
+	    const float3 other_norm = sqrt(other_a * other_a + other_b * other_b);
+
+	    const float3 dist = 0.5f * (1.0f - (self_normalized_a * other_a / other_norm +
+						self_normalized_b * other_b / other_norm));
+	    const int3 c = isgreaterequal(other_norm * other_norm, threshold);
+	    const float3 weight = select((float3)(0.0f),
+					 gaussian_kernel[j] * exp(-1.442695f * joint_bilateral_exp * dist),
+					 c);
+
+	    weighted_a_acc += weight * other_a;
+	    weighted_b_acc += weight * other_b;
+	    weight_acc += weight;
+	    dist_acc += select((float3)(0.0f), dist, c);
+	}
+    }
+
+    const int3 c = isless((float3)(0.0f), weight_acc);
+    a_out[i] = select((float3)(0.0f), weighted_a_acc / weight_acc, c);
+    b_out[i] = select((float3)(0.0f), weighted_b_acc / weight_acc, c);
+    max_edge_test[i] = all(isless(dist_acc, (float3)(JOINT_BILATERAL_MAX_EDGE)));
 }
+#endif /* #if defined(BILATERAL_FILTER) */
+
+#if defined(EDGE_AWARE_FILTER)
+/*
+ * Removes flying pixels; a pixel whose depth differs largely from its
+ * neighbours while the variance of their amplitude is high is invalidated.
+ */
+void kernel filterPixelStage2(global const float *raw_depth,
+			      global const float *ir_sums,
+			      global const uchar *max_edge_test,
+			      OUTPUT_T depth_out,
+			      const int depth_format,
+			      global uchar *confidence,
+			      global float *temporal_state)
+{
+    const uint i = get_global_id(0);
+    const uint x = i % 512;
+    const uint y = i / 512;
+
+    const float d = raw_depth[i];
+    float filtered = 0.0f;
+    uchar flags = 0;
+
+    if (d >= MIN_DEPTH && d <= MAX_DEPTH) {
+	if (x < 1 || y < 1 || x > 510 || y > 422) {
+	    filtered = d;
+	} else {
+	    const float ir_sum = ir_sums[i];
+	    float ir_sum_acc = ir_sum;
+	    float squared_ir_sum_acc = ir_sum * ir_sum;
+	    float min_depth = d;
+	    float max_depth = d;
+
+	    for (int yi = -512; yi < 1024; yi += 512) {
+		for (int xi = -1; xi < 2; ++xi) {
+		    if (yi == 0 && xi == 0)
+			continue;
+		    const int i_other = i + yi + xi;
+		    const float d_other = raw_depth[i_other];
+		    const float ir_sum_other = ir_sums[i_other];
+
+		    ir_sum_acc += ir_sum_other;
+		    squared_ir_sum_acc += ir_sum_other * ir_sum_other;
+
+		    if (0.0f < d_other) {
+			min_depth = min(min_depth, d_other);
+			max_depth = max(max_depth, d_other);
+		    }
+		}
+	    }
+
+	    float tmp0 = sqrt(squared_ir_sum_acc * 9.0f - ir_sum_acc * ir_sum_acc) / 9.0f;
+	    const float edge_avg = max(ir_sum_acc / 9.0f, EDGE_AB_AVG_MIN_VALUE);
+	    tmp0 /= edge_avg;
+
+	    const float abs_min_diff = fabs(d - min_depth);
+	    const float abs_max_diff = fabs(d - max_depth);
+	    const float avg_diff = (abs_min_diff + abs_max_diff) * 0.5f;
+	    const float max_abs_diff = max(abs_min_diff, abs_max_diff);
+
+	    const bool flying =
+		0.0f < d &&
+		tmp0 >= EDGE_AB_STD_DEV_THRESHOLD &&
+		EDGE_CLOSE_DELTA_THRESHOLD < abs_min_diff &&
+		EDGE_FAR_DELTA_THRESHOLD < abs_max_diff &&
+		EDGE_MAX_DELTA_THRESHOLD < max_abs_diff &&
+		EDGE_AVG_DELTA_THRESHOLD < avg_diff;
+#if defined(BILATERAL_FILTER)
+	    const bool edge = !max_edge_test[i];
+#else
+	    const bool edge = false;
+#endif
+	    filtered = (flying || edge) ? 0.0f : d;
+	}
+	if (filtered == 0.0f)
+	    flags |= CONFIDENCE_EDGE;
+    }
 
+    filtered = TEMPORAL_UPDATE(temporal_state, i, filtered, &flags);
+    WRITE_OUTPUT(depth_out, depth_format, x, y, filtered);
+#if defined(OUTPUT_CONFIDENCE)
+    confidence[i] |= flags;
+#endif
+}
+#endif /* #if defined(EDGE_AWARE_FILTER) */
+
+
+/*******************************************************************************
+ * Process pixel stage 1 & 2 in a single pass
+ ******************************************************************************/
+/*
+ * This kernel keeps a/b values in registers instead of writing them
+ * to global memory, so it halves the memory traffic of the two-stage
+ * path and saves one kernel launch per frame.
+ */
+void kernel processPixelFused(global const short *lut11to16,
+			      global const float *z_table,
+			      global const float3 *p0_table,
+			      global const ushort *data,
+			      global const float *x_table,
+			      OUTPUT_T depth_out,
+			      OUTPUT_T ir_out,
+			      const int trig_mode,
+			      global const float *trig_table,
+			      global const half *trig_table_half,
+			      const int depth_format,
+			      const int ir_format,
+			      global uchar *confidence,
+			      global float *temporal_state)
+{
+    const uint i = get_global_id(0);
+    const uint x = i % 512;
+    const uint y = i / 512;
+
+    float3 a, b, n;
+    int3 saturated;
+    decodePixel(lut11to16, z_table, p0_table, data,
+		trig_mode, trig_table, trig_table_half,
+		i, &a, &b, &n, &saturated);
+
+#if !defined(DISABLE_IR)
+    WRITE_OUTPUT(ir_out, ir_format, x, y, computeIR(n, saturated));
+#endif
+    uchar flags;
+    float ir_sum;
+    float d = computeDepth(a, b, x_table, z_table, i, &flags, &ir_sum);
+    d = TEMPORAL_UPDATE(temporal_state, i, d, &flags);
+    WRITE_OUTPUT(depth_out, depth_format, x, y, d);
+#if defined(OUTPUT_CONFIDENCE)
+    confidence[i] = flags | (any(saturated != (int3)(0)) ? CONFIDENCE_SATURATED : 0);
+#endif
+}
@@ -91,6 +91,14 @@ static char * opencl_strenum(cl_int e) {
 #define buf_n_size	IMAGE_SIZE * sizeof(cl_float3)
 #define buf_ir_size	IMAGE_SIZE * sizeof(cl_float)
 #define buf_depth_size  IMAGE_SIZE * sizeof(cl_float)
+#define trig_table_len  (3 * IMAGE_SIZE * 6)
+
+/* must match TRIG_* in depth.cl */
+enum {
+    TRIG_COMPUTE = 0,
+    TRIG_TABLE = 1,
+    TRIG_TABLE_HALF = 2,
+};
 
 struct parameters {
      float ab_multiplier;
@@ -110,6 +118,21 @@ struct parameters {
 
      float min_depth;
      float max_depth;
+
+     float joint_bilateral_ab_threshold;
+     float joint_bilateral_max_edge;
+     float joint_bilateral_exp;
+
+     float edge_ab_avg_min_value;
+     float edge_ab_std_dev_threshold;
+     float edge_close_delta_threshold;
+     float edge_far_delta_threshold;
+     float edge_max_delta_threshold;
+     float edge_avg_delta_threshold;
+
+     float temporal_alpha;
+     float temporal_reset_abs;
+     float temporal_reset_rel;
 };
 
 typedef struct Slot_tag Slot;
@@ -117,12 +140,25 @@ struct Slot_tag {
     cl_kernel kernel_1;
     cl_kernel kernel_2;
 
-    cl_mem buf_packet;
+    cl_mem buf_packet; /* in zero-copy mode, this wraps the caller's buffer
+			* and is owned by host_wrapper or DecoderCL::m_wrapper */
+    void *host_packet; /* page-aligned source buffer in zero-copy mode;
+			* see get_input_buffer() */
+    cl_mem host_wrapper; /* wraps host_packet */
 
     cl_mem buf_a;
     cl_mem buf_b;
     cl_mem buf_n;
 
+    /* used by the filters */
+    cl_kernel kernel_filter1;
+    cl_kernel kernel_filter2;
+    cl_mem buf_a_filtered;
+    cl_mem buf_b_filtered;
+    cl_mem buf_edge_test;
+    cl_mem buf_raw_depth;
+    cl_mem buf_ir_sum;
+
 #if defined(HAVE_GLEW)
     union {
 	struct {
@@ -133,14 +169,26 @@ struct Slot_tag {
     } texture;
 #endif
 
-    cl_mem image[2]; /* 0:depth, 1:ir */
+    cl_mem output[2]; /* 0:depth, 1:ir; images if OpenGL is enabled, otherwise buffers */
+    cl_mem buf_confidence;
+    void *mapped[3];  /* host pointers returned by map_output(); indexed by K4W2_DECODER_PLANE_* */
     cl_event eventWrite[2];
     cl_event eventPPS1[1];
     cl_event eventPPS2[1];
-    cl_event event0, event1;
+    cl_event eventFilter[2];
+    cl_event event0, event1, event2;
 };
 
 
+/* Wrappers of the caller's buffers in zero-copy mode, cached by address
+ * so that a buffer is wrapped only once; see wrap_host_memory(). */
+#define MAX_WRAPPERS 16
+typedef struct {
+    const void *host;
+    cl_mem mem;
+    unsigned long last_used;
+} Wrapper;
+
 /**
  * @class DecoderCL depth_cl.c
  *
@@ -157,10 +205,21 @@ struct DecoderCL_tag
     cl_mem buf_p0_table;
     cl_mem buf_x_table;
     cl_mem buf_z_table;
+    cl_mem buf_trig_table;
+    cl_mem buf_trig_table_half;
+    cl_mem buf_temporal_state; /* running average of the temporal filter, shared by all slots */
+
+    cl_device_id device;
+    struct parameters m_params;
+    cl_int m_trig_mode;
+    cl_int m_pixelformat[2]; /* K4W2_PIXELFORMAT_* of depth and ir */
 
     Slot *m_slot;
     size_t m_num_slot;
 
+    Wrapper m_wrapper[MAX_WRAPPERS];
+    unsigned long m_wrapper_clock;
+
     unsigned int m_type;
 };
 
@@ -176,6 +235,10 @@ static int request(DecoderCL *decoder,
 		   int slot, const void *ptr, int length);
 static int fetch(DecoderCL *decoder,
 		 int slot, void *dst, int dst_length);
+static int map_output(DecoderCL *decoder,
+		      int slot, unsigned int option, const void **ptr);
+static int unmap_output(DecoderCL *decoder,
+			int slot, unsigned int option);
 static int get_gl_texture(DecoderCL *decoder,
 			  int slot, unsigned int option, unsigned int *texture);
 
@@ -204,6 +267,21 @@ init_params(struct parameters *p)
 
      p->min_depth = 500.0f;
      p->max_depth = 4500.0f;
+
+     p->joint_bilateral_ab_threshold = 3.0f;
+     p->joint_bilateral_max_edge = 2.5f;
+     p->joint_bilateral_exp = 5.0f;
+
+     p->edge_ab_avg_min_value = 50.0f;
+     p->edge_ab_std_dev_threshold = 0.05f;
+     p->edge_close_delta_threshold = 50.0f;
+     p->edge_far_delta_threshold = 30.0f;
+     p->edge_max_delta_threshold = 100.0f;
+     p->edge_avg_delta_threshold = 0.0f;
+
+     p->temporal_alpha = 0.3f;
+     p->temporal_reset_abs = 50.0f;
+     p->temporal_reset_rel = 0.03f;
 }
 
 static void
@@ -227,8 +305,29 @@ fill_trig_table(const struct kinect2_p0table *src, cl_float3 *dst)
     }
 }
 
+static void
+fill_trig_values(const struct parameters *params, const cl_float3 *p0, float *dst)
+{
+    int f;
+    for (f = 0; f < 3; ++f) {
+	int i;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (i = 0; i < IMAGE_SIZE; ++i) {
+	    float *it = &dst[(f * IMAGE_SIZE + i) * 6];
+	    int k;
+	    for (k = 0; k < 3; ++k) {
+		const float tmp = p0[i].s[f] + params->phase_in_rad[k];
+		it[k]     = cosf(tmp);
+		it[3 + k] = sinf(-tmp);
+	    }
+	}
+    }
+}
+
 static char *
-generateOptions(const struct parameters *params) 
+generateOptions(const struct parameters *params, unsigned int type)
 {
     const size_t size = 2 * 1024;
     char *buf = (char *)malloc(size);
@@ -240,6 +339,13 @@ generateOptions(const struct parameters *params)
 
     p += snprintf(p, LEFT(tail - p), " -D KINECT2_DEPTH_FRAME_SIZE=%zd", KINECT2_DEPTH_FRAME_SIZE);
     p += snprintf(p, LEFT(tail - p), " -D BFI_BITMASK=0x180");
+    if (type & K4W2_DECODER_ENABLE_OPENGL)
+	p += snprintf(p, LEFT(tail - p), " -D OUTPUT_IMAGE");
+    if (type & K4W2_DECODER_DISABLE_IR)
+	p += snprintf(p, LEFT(tail - p), " -D DISABLE_IR");
+    p += snprintf(p, LEFT(tail - p), " -D IR_MODE=%u", (type & K4W2_DECODER_IR_MASK) >> 14);
+    if (type & K4W2_DECODER_ENABLE_CONFIDENCE)
+	p += snprintf(p, LEFT(tail - p), " -D OUTPUT_CONFIDENCE");
 
     p += snprintf(p, LEFT(tail - p), " -D AB_MULTIPLIER=" FMT, params->ab_multiplier);
     p += snprintf(p, LEFT(tail - p), " -D AB_MULTIPLIER_PER_FRQ0=" FMT, params->ab_multiplier_per_frq[0]);
@@ -260,6 +366,33 @@ generateOptions(const struct parameters *params)
     p += snprintf(p, LEFT(tail - p), " -D MIN_DEALIAS_CONFIDENCE=" FMT, params->min_dealias_confidence);
     p += snprintf(p, LEFT(tail - p), " -D MAX_DEALIAS_CONFIDENCE=" FMT, params->max_dealias_confidence);
 
+    p += snprintf(p, LEFT(tail - p), " -D MIN_DEPTH=" FMT, params->min_depth);
+    p += snprintf(p, LEFT(tail - p), " -D MAX_DEPTH=" FMT, params->max_depth);
+
+    if (type & K4W2_DECODER_BILATERAL_FILTER) {
+	/* the threshold is compared with squared norms of a/b values */
+	const float threshold = params->joint_bilateral_ab_threshold / params->ab_multiplier;
+	p += snprintf(p, LEFT(tail - p), " -D BILATERAL_FILTER");
+	p += snprintf(p, LEFT(tail - p), " -D JOINT_BILATERAL_THRESHOLD=" FMT, threshold * threshold);
+	p += snprintf(p, LEFT(tail - p), " -D JOINT_BILATERAL_MAX_EDGE=" FMT, params->joint_bilateral_max_edge);
+	p += snprintf(p, LEFT(tail - p), " -D JOINT_BILATERAL_EXP=" FMT, params->joint_bilateral_exp);
+    }
+    if (type & K4W2_DECODER_EDGE_AWARE_FILTER) {
+	p += snprintf(p, LEFT(tail - p), " -D EDGE_AWARE_FILTER");
+	p += snprintf(p, LEFT(tail - p), " -D EDGE_AB_AVG_MIN_VALUE=" FMT, params->edge_ab_avg_min_value);
+	p += snprintf(p, LEFT(tail - p), " -D EDGE_AB_STD_DEV_THRESHOLD=" FMT, params->edge_ab_std_dev_threshold);
+	p += snprintf(p, LEFT(tail - p), " -D EDGE_CLOSE_DELTA_THRESHOLD=" FMT, params->edge_close_delta_threshold);
+	p += snprintf(p, LEFT(tail - p), " -D EDGE_FAR_DELTA_THRESHOLD=" FMT, params->edge_far_delta_threshold);
+	p += snprintf(p, LEFT(tail - p), " -D EDGE_MAX_DELTA_THRESHOLD=" FMT, params->edge_max_delta_threshold);
+	p += snprintf(p, LEFT(tail - p), " -D EDGE_AVG_DELTA_THRESHOLD=" FMT, params->edge_avg_delta_threshold);
+    }
+    if (type & K4W2_DECODER_TEMPORAL_FILTER) {
+	p += snprintf(p, LEFT(tail - p), " -D TEMPORAL_FILTER");
+	p += snprintf(p, LEFT(tail - p), " -D TEMPORAL_ALPHA=" FMT, params->temporal_alpha);
+	p += snprintf(p, LEFT(tail - p), " -D TEMPORAL_RESET_ABS=" FMT, params->temporal_reset_abs);
+	p += snprintf(p, LEFT(tail - p), " -D TEMPORAL_RESET_REL=" FMT, params->temporal_reset_rel);
+    }
+
 #undef LEFT
 #undef FMT
 
@@ -267,30 +400,62 @@ generateOptions(const struct parameters *params)
 }
 
 
+static void
+release_event(cl_event *event)
+{
+    if (*event) {
+	CHK_CL( clReleaseEvent(*event) );
+	*event = NULL;
+    }
+}
+
+static void
+set_trig_args(Slot *s, const DecoderCL *decoder, cl_int trig_mode)
+{
+    /* trailing arguments of processPixelStage1 or processPixelFused */
+    const cl_uint idx = (decoder->m_type & K4W2_DECODER_FUSED_KERNEL) ? 7 : 8;
+    CHK_CL( clSetKernelArg(s->kernel_1, idx + 0, sizeof(cl_int), &trig_mode) );
+    CHK_CL( clSetKernelArg(s->kernel_1, idx + 1, sizeof(cl_mem), &decoder->buf_trig_table) );
+    CHK_CL( clSetKernelArg(s->kernel_1, idx + 2, sizeof(cl_mem), &decoder->buf_trig_table_half) );
+}
+
+static void
+set_format_args(Slot *s, const DecoderCL *decoder)
+{
+    if (decoder->m_type & K4W2_DECODER_FUSED_KERNEL) {
+	CHK_CL( clSetKernelArg(s->kernel_1, 10, sizeof(cl_int), &decoder->m_pixelformat[0]) );
+	CHK_CL( clSetKernelArg(s->kernel_1, 11, sizeof(cl_int), &decoder->m_pixelformat[1]) );
+    } else {
+	CHK_CL( clSetKernelArg(s->kernel_1, 11, sizeof(cl_int), &decoder->m_pixelformat[1]) );
+	CHK_CL( clSetKernelArg(s->kernel_2, 5, sizeof(cl_int), &decoder->m_pixelformat[0]) );
+	if (s->kernel_filter2)
+	    CHK_CL( clSetKernelArg(s->kernel_filter2, 4, sizeof(cl_int), &decoder->m_pixelformat[0]) );
+    }
+}
+
 static void
 open_slot(Slot *s, const DecoderCL *decoder)
 {
     cl_int err;
-    s->buf_packet = clCreateBuffer(decoder->context, CL_READ_ONLY_CACHE,  buf_packet_size, NULL, &err);
-    s->buf_a      = clCreateBuffer(decoder->context, CL_READ_WRITE_CACHE, buf_a_size, NULL, &err);
-    s->buf_b      = clCreateBuffer(decoder->context, CL_READ_WRITE_CACHE, buf_b_size, NULL, &err);
-    s->buf_n      = clCreateBuffer(decoder->context, CL_READ_WRITE_CACHE, buf_n_size, NULL, &err);
-
-    cl_image_format format;
-    format.image_channel_order = CL_R;
-    format.image_channel_data_type = CL_FLOAT;
-
-    cl_image_desc desc;
-    desc.image_type = CL_MEM_OBJECT_IMAGE2D;
-    desc.image_width = 512;
-    desc.image_height = 424;
-    desc.image_depth = 0;
-    desc.image_array_size = 0;
-    desc.image_row_pitch = 0;
-    desc.image_slice_pitch = 0;
-    desc.num_mip_levels = 0;
-    desc.num_samples = 0;
-    desc.buffer = NULL;
+    if (decoder->m_type & K4W2_DECODER_ZERO_COPY) {
+	/* buf_packet will be created by request() */
+	s->buf_packet = NULL;
+    } else {
+	s->buf_packet = clCreateBuffer(decoder->context, CL_READ_ONLY_CACHE,  buf_packet_size, NULL, &err);
+    }
+    if (decoder->m_type & K4W2_DECODER_FUSED_KERNEL) {
+	/* a/b values never leave the kernel */
+	s->buf_a = s->buf_b = s->buf_n = NULL;
+    } else {
+	s->buf_a  = clCreateBuffer(decoder->context, CL_READ_WRITE_CACHE, buf_a_size, NULL, &err);
+	s->buf_b  = clCreateBuffer(decoder->context, CL_READ_WRITE_CACHE, buf_b_size, NULL, &err);
+	if (decoder->m_type & K4W2_DECODER_DISABLE_IR) {
+	    /* stage 1 doesn't write n_out; a NULL buffer is passed instead */
+	    s->buf_n = NULL;
+	} else {
+	    s->buf_n = clCreateBuffer(decoder->context, CL_READ_WRITE_CACHE, buf_n_size, NULL, &err);
+	}
+    }
 
     size_t i;
 #if defined(HAVE_GLEW)
@@ -308,8 +473,8 @@ open_slot(Slot *s, const DecoderCL *decoder)
 	    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
 	    CHECK_GL();
 
-	    s->image[i] = clCreateFromGLTexture(decoder->context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0,
-						s->texture.name[i], &err);
+	    s->output[i] = clCreateFromGLTexture(decoder->context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0,
+						 s->texture.name[i], &err);
 	    if (CL_SUCCESS != err) {
 		ABORT("failed, err: %d", err);
 	    }
@@ -317,20 +482,54 @@ open_slot(Slot *s, const DecoderCL *decoder)
     } else {
 	for (i = 0; i < 2; ++i) {
 	    s->texture.name[i] = 0;
-	    s->image[i] = clCreateImage(decoder->context, CL_MEM_WRITE_ONLY,
-					&format,
-					&desc,
-					NULL, &err);
 	}
     }
-#else
-    for (i = 0; i < 2; ++i) {
-	s->image[i] = clCreateImage(decoder->context, CL_MEM_WRITE_ONLY,
-				    &format,
-				    &desc,
-				    NULL, &err);
-    }
 #endif
+    if (!(decoder->m_type & K4W2_DECODER_ENABLE_OPENGL)) {
+	const cl_mem_flags flags = CL_MEM_WRITE_ONLY |
+	    ((decoder->m_type & K4W2_DECODER_ZERO_COPY)?CL_MEM_ALLOC_HOST_PTR:0);
+	for (i = 0; i < 2; ++i) {
+	    s->output[i] = clCreateBuffer(decoder->context, flags,
+					  buf_depth_size, NULL, &err);
+	}
+    }
+    if (decoder->m_type & K4W2_DECODER_ENABLE_CONFIDENCE) {
+	const cl_mem_flags flags = CL_MEM_READ_WRITE |
+	    ((decoder->m_type & K4W2_DECODER_ZERO_COPY)?CL_MEM_ALLOC_HOST_PTR:0);
+	s->buf_confidence = clCreateBuffer(decoder->context, flags,
+					   IMAGE_SIZE, NULL, &err);
+    } else {
+	s->buf_confidence = NULL;
+    }
+    for (i = 0; i < ARRAY_SIZE(s->mapped); ++i) {
+	s->mapped[i] = NULL;
+    }
+    s->eventWrite[0] = s->eventWrite[1] = NULL;
+    s->eventPPS1[0] = s->eventPPS2[0] = NULL;
+    s->eventFilter[0] = s->eventFilter[1] = NULL;
+    s->event0 = s->event1 = s->event2 = NULL;
+    s->kernel_filter1 = s->kernel_filter2 = NULL;
+    s->buf_a_filtered = s->buf_b_filtered = NULL;
+    s->buf_edge_test = s->buf_raw_depth = s->buf_ir_sum = NULL;
+
+    if (decoder->m_type & K4W2_DECODER_FUSED_KERNEL) {
+	s->kernel_1 = clCreateKernel(decoder->program, "processPixelFused", &err);
+	if (!s->kernel_1)
+	    ABORT("no processPixelFused");
+	CHK_CL( clSetKernelArg(s->kernel_1, 0, sizeof(cl_mem), &decoder->buf_lut11to16) );
+	CHK_CL( clSetKernelArg(s->kernel_1, 1, sizeof(cl_mem), &decoder->buf_z_table) );
+	CHK_CL( clSetKernelArg(s->kernel_1, 2, sizeof(cl_mem), &decoder->buf_p0_table) );
+	CHK_CL( clSetKernelArg(s->kernel_1, 3, sizeof(cl_mem), &s->buf_packet) );
+	CHK_CL( clSetKernelArg(s->kernel_1, 4, sizeof(cl_mem), &decoder->buf_x_table) );
+	CHK_CL( clSetKernelArg(s->kernel_1, 5, sizeof(cl_mem), &s->output[0]) );
+	CHK_CL( clSetKernelArg(s->kernel_1, 6, sizeof(cl_mem), &s->output[1]) );
+	CHK_CL( clSetKernelArg(s->kernel_1, 12, sizeof(cl_mem), &s->buf_confidence) );
+	CHK_CL( clSetKernelArg(s->kernel_1, 13, sizeof(cl_mem), &decoder->buf_temporal_state) );
+	s->kernel_2 = NULL;
+	set_trig_args(s, decoder, decoder->m_trig_mode);
+	set_format_args(s, decoder);
+	return;
+    }
 
     s->kernel_1 = clCreateKernel(decoder->program, "processPixelStage1", &err);
     if (!s->kernel_1)
@@ -342,7 +541,9 @@ open_slot(Slot *s, const DecoderCL *decoder)
     CHK_CL( clSetKernelArg(s->kernel_1, 4, sizeof(cl_mem), &s->buf_a) );
     CHK_CL( clSetKernelArg(s->kernel_1, 5, sizeof(cl_mem), &s->buf_b) );
     CHK_CL( clSetKernelArg(s->kernel_1, 6, sizeof(cl_mem), &s->buf_n) );
-    CHK_CL( clSetKernelArg(s->kernel_1, 7, sizeof(cl_mem), &s->image[1]) );
+    CHK_CL( clSetKernelArg(s->kernel_1, 7, sizeof(cl_mem), &s->output[1]) );
+    CHK_CL( clSetKernelArg(s->kernel_1, 12, sizeof(cl_mem), &s->buf_confidence) );
+    set_trig_args(s, decoder, decoder->m_trig_mode);
 
     s->kernel_2 = clCreateKernel(decoder->program, "processPixelStage2", &err);
     if (!s->kernel_2)
@@ -351,20 +552,90 @@ open_slot(Slot *s, const DecoderCL *decoder)
     CHK_CL( clSetKernelArg(s->kernel_2, 1, sizeof(cl_mem), &s->buf_b) );
     CHK_CL( clSetKernelArg(s->kernel_2, 2, sizeof(cl_mem), &decoder->buf_x_table) );
     CHK_CL( clSetKernelArg(s->kernel_2, 3, sizeof(cl_mem), &decoder->buf_z_table) );
-    CHK_CL( clSetKernelArg(s->kernel_2, 4, sizeof(cl_mem), &s->image[0]) );
+    CHK_CL( clSetKernelArg(s->kernel_2, 4, sizeof(cl_mem), &s->output[0]) );
+    CHK_CL( clSetKernelArg(s->kernel_2, 6, sizeof(cl_mem), &s->buf_confidence) );
+
+    if (decoder->m_type & K4W2_DECODER_BILATERAL_FILTER) {
+	/* stage 2 reads the filtered copies of a/b */
+	s->buf_a_filtered = clCreateBuffer(decoder->context, CL_READ_WRITE_CACHE, buf_a_size, NULL, &err);
+	s->buf_b_filtered = clCreateBuffer(decoder->context, CL_READ_WRITE_CACHE, buf_b_size, NULL, &err);
+	s->buf_edge_test  = clCreateBuffer(decoder->context, CL_READ_WRITE_CACHE, IMAGE_SIZE, NULL, &err);
+
+	s->kernel_filter1 = clCreateKernel(decoder->program, "filterPixelStage1", &err);
+	if (!s->kernel_filter1)
+	    ABORT("no filterPixelStage1");
+	CHK_CL( clSetKernelArg(s->kernel_filter1, 0, sizeof(cl_mem), &s->buf_a) );
+	CHK_CL( clSetKernelArg(s->kernel_filter1, 1, sizeof(cl_mem), &s->buf_b) );
+	CHK_CL( clSetKernelArg(s->kernel_filter1, 2, sizeof(cl_mem), &s->buf_a_filtered) );
+	CHK_CL( clSetKernelArg(s->kernel_filter1, 3, sizeof(cl_mem), &s->buf_b_filtered) );
+	CHK_CL( clSetKernelArg(s->kernel_filter1, 4, sizeof(cl_mem), &s->buf_edge_test) );
+
+	CHK_CL( clSetKernelArg(s->kernel_2, 0, sizeof(cl_mem), &s->buf_a_filtered) );
+	CHK_CL( clSetKernelArg(s->kernel_2, 1, sizeof(cl_mem), &s->buf_b_filtered) );
+    }
+
+    if (decoder->m_type & K4W2_DECODER_EDGE_AWARE_FILTER) {
+	/* stage 2 writes raw depth here, and filterPixelStage2() writes the outputs */
+	s->buf_raw_depth = clCreateBuffer(decoder->context, CL_READ_WRITE_CACHE, buf_depth_size, NULL, &err);
+	s->buf_ir_sum    = clCreateBuffer(decoder->context, CL_READ_WRITE_CACHE, buf_depth_size, NULL, &err);
+
+	s->kernel_filter2 = clCreateKernel(decoder->program, "filterPixelStage2", &err);
+	if (!s->kernel_filter2)
+	    ABORT("no filterPixelStage2");
+	CHK_CL( clSetKernelArg(s->kernel_filter2, 0, sizeof(cl_mem), &s->buf_raw_depth) );
+	CHK_CL( clSetKernelArg(s->kernel_filter2, 1, sizeof(cl_mem), &s->buf_ir_sum) );
+	CHK_CL( clSetKernelArg(s->kernel_filter2, 2, sizeof(cl_mem), &s->buf_edge_test) );
+	CHK_CL( clSetKernelArg(s->kernel_filter2, 3, sizeof(cl_mem), &s->output[0]) );
+	CHK_CL( clSetKernelArg(s->kernel_filter2, 5, sizeof(cl_mem), &s->buf_confidence) );
+	CHK_CL( clSetKernelArg(s->kernel_filter2, 6, sizeof(cl_mem), &decoder->buf_temporal_state) );
+    }
+    CHK_CL( clSetKernelArg(s->kernel_2, 7, sizeof(cl_mem), &s->buf_raw_depth) );
+    CHK_CL( clSetKernelArg(s->kernel_2, 8, sizeof(cl_mem), &s->buf_ir_sum) );
+    CHK_CL( clSetKernelArg(s->kernel_2, 9, sizeof(cl_mem), &decoder->buf_temporal_state) );
+
+    set_format_args(s, decoder);
 }
 
 static void
 close_slot(Slot *s, unsigned int type)
 {
-    CHK_CL( clReleaseMemObject(s->buf_packet) );
-    CHK_CL( clReleaseMemObject(s->buf_a) );
-    CHK_CL( clReleaseMemObject(s->buf_b) );
-    CHK_CL( clReleaseMemObject(s->buf_n) );
+    if (s->buf_packet && !(type & K4W2_DECODER_ZERO_COPY))
+	CHK_CL( clReleaseMemObject(s->buf_packet) );
+    if (s->host_wrapper)
+	CHK_CL( clReleaseMemObject(s->host_wrapper) );
+    k4w2_free(s->host_packet);
+    s->host_packet = NULL;
+    if (s->buf_a)
+	CHK_CL( clReleaseMemObject(s->buf_a) );
+    if (s->buf_b)
+	CHK_CL( clReleaseMemObject(s->buf_b) );
+    if (s->buf_n)
+	CHK_CL( clReleaseMemObject(s->buf_n) );
     size_t i;
     for (i = 0; i < 2; ++i) {
-	CHK_CL( clReleaseMemObject(s->image[i]) );
+	CHK_CL( clReleaseMemObject(s->output[i]) );
     }
+    if (s->buf_confidence)
+	CHK_CL( clReleaseMemObject(s->buf_confidence) );
+    if (s->buf_a_filtered)
+	CHK_CL( clReleaseMemObject(s->buf_a_filtered) );
+    if (s->buf_b_filtered)
+	CHK_CL( clReleaseMemObject(s->buf_b_filtered) );
+    if (s->buf_edge_test)
+	CHK_CL( clReleaseMemObject(s->buf_edge_test) );
+    if (s->buf_raw_depth)
+	CHK_CL( clReleaseMemObject(s->buf_raw_depth) );
+    if (s->buf_ir_sum)
+	CHK_CL( clReleaseMemObject(s->buf_ir_sum) );
+    release_event(&s->eventWrite[0]);
+    release_event(&s->eventWrite[1]);
+    release_event(&s->eventPPS1[0]);
+    release_event(&s->eventPPS2[0]);
+    release_event(&s->eventFilter[0]);
+    release_event(&s->eventFilter[1]);
+    release_event(&s->event0);
+    release_event(&s->event1);
+    release_event(&s->event2);
     if (type & K4W2_DECODER_ENABLE_OPENGL) {
 #if defined(HAVE_GLEW)
 	glDeleteTextures(2, &s->texture.name[0]);
@@ -372,7 +643,12 @@ close_slot(Slot *s, unsigned int type)
     }
 
     CHK_CL( clReleaseKernel(s->kernel_1) );
-    CHK_CL( clReleaseKernel(s->kernel_2) );
+    if (s->kernel_2)
+	CHK_CL( clReleaseKernel(s->kernel_2) );
+    if (s->kernel_filter1)
+	CHK_CL( clReleaseKernel(s->kernel_filter1) );
+    if (s->kernel_filter2)
+	CHK_CL( clReleaseKernel(s->kernel_filter2) );
 }
 
 
@@ -473,9 +749,31 @@ open_decoder(DecoderCL *decoder,
 	      size_t num_slot,
 	      const unsigned int type)
 {
-    decoder->m_type = type;
     cl_int err = CL_SUCCESS;
 
+    decoder->m_type = type;
+    decoder->m_params = *params;
+    decoder->m_trig_mode = TRIG_COMPUTE;
+    decoder->m_pixelformat[0] = decoder->m_pixelformat[1] = K4W2_PIXELFORMAT_FLOAT;
+    decoder->buf_trig_table = NULL;
+    decoder->buf_trig_table_half = NULL;
+    memset(decoder->m_wrapper, 0, sizeof(decoder->m_wrapper));
+    decoder->m_wrapper_clock = 0;
+#if !defined(HAVE_GLEW)
+    decoder->m_type &= ~K4W2_DECODER_ENABLE_OPENGL;
+#endif
+    if ((decoder->m_type & K4W2_DECODER_ZERO_COPY) &&
+	(decoder->m_type & K4W2_DECODER_ENABLE_OPENGL)) {
+	VERBOSE("K4W2_DECODER_ZERO_COPY is ignored because OpenGL is enabled");
+	decoder->m_type &= ~K4W2_DECODER_ZERO_COPY;
+    }
+    if ((decoder->m_type & K4W2_DECODER_FUSED_KERNEL) &&
+	(decoder->m_type & (K4W2_DECODER_BILATERAL_FILTER|K4W2_DECODER_EDGE_AWARE_FILTER))) {
+	/* the filters need a/b values or depth of neighbouring pixels */
+	VERBOSE("K4W2_DECODER_FUSED_KERNEL is ignored because filters are enabled");
+	decoder->m_type &= ~K4W2_DECODER_FUSED_KERNEL;
+    }
+
     cl_platform_id platforms[10] = {0};
     cl_uint num_platforms = 0;
     CHK_CL( clGetPlatformIDs(ARRAY_SIZE(platforms),
@@ -488,7 +786,7 @@ open_decoder(DecoderCL *decoder,
     cl_context_properties properties[10] = {0};
     setup_cl_context_properties(properties, sizeof(properties),
 				platforms[0],
-				type);
+				decoder->m_type);
 
     cl_device_id devices[10] = {0};
     cl_uint num_devices = 0;
@@ -511,6 +809,16 @@ open_decoder(DecoderCL *decoder,
     if (CL_SUCCESS != err) {
 	ABORT("create context failed");
     }
+    decoder->device = devices[0];
+
+    if (decoder->m_type & K4W2_DECODER_ZERO_COPY) {
+	cl_bool unified = CL_FALSE;
+	CHK_CL( clGetDeviceInfo(devices[0], CL_DEVICE_HOST_UNIFIED_MEMORY,
+				sizeof(unified), &unified, NULL) );
+	if (!unified) {
+	    VERBOSE("device has no unified memory; zero-copy buffers may be slow");
+	}
+    }
 
     decoder->queue   = clCreateCommandQueue(decoder->context,
 					    devices[0],
@@ -522,7 +830,7 @@ open_decoder(DecoderCL *decoder,
 	K4W2_DATADIR,
     };
 
-    const int MAX_SOURCECODE_SIZE = 20 * 1024;
+    const int MAX_SOURCECODE_SIZE = 64 * 1024;
     char* sourcecode = (char *)malloc(MAX_SOURCECODE_SIZE);
     size_t sourcelength;
     int r = k4w2_search_and_load(searchpath, ARRAY_SIZE(searchpath),
@@ -553,7 +861,7 @@ open_decoder(DecoderCL *decoder,
 	ABORT("create program failed. %s", opencl_strenum(err));
     }
 
-    const char *options = generateOptions(params);
+    const char *options = generateOptions(params, decoder->m_type);
     err = clBuildProgram(decoder->program,
 			 num_devices,
 			 &devices[0],
@@ -594,7 +902,19 @@ open_decoder(DecoderCL *decoder,
 					  IMAGE_SIZE * sizeof(cl_float3), NULL,
 					  &err);
 
-    decoder->m_slot = (Slot *)malloc(sizeof(Slot) * num_slot);
+    if (decoder->m_type & K4W2_DECODER_TEMPORAL_FILTER) {
+	const cl_float zero = 0.0f;
+	decoder->buf_temporal_state = clCreateBuffer(decoder->context, CL_MEM_READ_WRITE,
+						     IMAGE_SIZE * sizeof(cl_float), NULL,
+						     &err);
+	CHK_CL( clEnqueueFillBuffer(decoder->queue, decoder->buf_temporal_state,
+				    &zero, sizeof(zero), 0, IMAGE_SIZE * sizeof(cl_float),
+				    0, NULL, NULL) );
+    } else {
+	decoder->buf_temporal_state = NULL;
+    }
+
+    decoder->m_slot = (Slot *)calloc(num_slot, sizeof(Slot));
     decoder->m_num_slot = num_slot;
     int i;
     for (i=0; i<num_slot; ++i) {
@@ -609,7 +929,7 @@ open_decoder(DecoderCL *decoder,
 static void
 close_decoder(DecoderCL *decoder)
 {
-    if (decoder)
+    if (!decoder)
 	return ;
 
     int i;
@@ -618,10 +938,21 @@ close_decoder(DecoderCL *decoder)
     }
     free( decoder->m_slot );
 
+    for (i=0; i<MAX_WRAPPERS; ++i) {
+	if (decoder->m_wrapper[i].mem)
+	    CHK_CL( clReleaseMemObject(decoder->m_wrapper[i].mem) );
+    }
+
     CHK_CL( clReleaseMemObject(decoder->buf_lut11to16) );
     CHK_CL( clReleaseMemObject(decoder->buf_p0_table) );
     CHK_CL( clReleaseMemObject(decoder->buf_x_table) );
     CHK_CL( clReleaseMemObject(decoder->buf_z_table) );
+    if (decoder->buf_trig_table)
+	CHK_CL( clReleaseMemObject(decoder->buf_trig_table) );
+    if (decoder->buf_trig_table_half)
+	CHK_CL( clReleaseMemObject(decoder->buf_trig_table_half) );
+    if (decoder->buf_temporal_state)
+	CHK_CL( clReleaseMemObject(decoder->buf_temporal_state) );
 
     CHK_CL( clReleaseProgram(decoder->program) );
     CHK_CL( clReleaseCommandQueue(decoder->queue) );
@@ -629,6 +960,175 @@ close_decoder(DecoderCL *decoder)
     CHK_CL( clReleaseContext(decoder->context) );
 }
 
+/*
+ * Returns the average execution time of kernel_1 of slot 0 in
+ * nanoseconds, or 0 on error.
+ */
+static cl_ulong
+benchmark_kernel(DecoderCL *decoder, cl_command_queue queue, cl_int trig_mode)
+{
+    static const int NUM_ITERATIONS = 8;
+    static const size_t global_work_size[1] = {IMAGE_SIZE};
+    Slot *s = &decoder->m_slot[0];
+    cl_ulong total = 0;
+    int i;
+
+    set_trig_args(s, decoder, trig_mode);
+    for (i = -1; i < NUM_ITERATIONS; ++i) { /* the first run is a warm-up */
+	cl_event event = NULL;
+	cl_ulong start = 0, end = 0;
+	cl_int err = clEnqueueNDRangeKernel(queue, s->kernel_1, 1, NULL,
+					    global_work_size, NULL,
+					    0, NULL, &event);
+	if (CL_SUCCESS != err) {
+	    VERBOSE("clEnqueueNDRangeKernel() returns '%s'", opencl_strenum(err));
+	    return 0;
+	}
+	CHK_CL( clWaitForEvents(1, &event) );
+	CHK_CL( clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+					sizeof(start), &start, NULL) );
+	CHK_CL( clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+					sizeof(end), &end, NULL) );
+	release_event(&event);
+	if (i >= 0)
+	    total += end - start;
+    }
+    return total / NUM_ITERATIONS;
+}
+
+/*
+ * Runs the first kernel with each trig mode on a dummy frame and returns
+ * the fastest mode.
+ */
+static cl_int
+select_trig_mode(DecoderCL *decoder)
+{
+    cl_int err;
+    cl_int best = TRIG_COMPUTE;
+    cl_command_queue queue = clCreateCommandQueue(decoder->context,
+						  decoder->device,
+						  CL_QUEUE_PROFILING_ENABLE,
+						  &err);
+    if (CL_SUCCESS != err) {
+	VERBOSE("clCreateCommandQueue() returns '%s'", opencl_strenum(err));
+	return best;
+    }
+
+    Slot *s = &decoder->m_slot[0];
+    cl_mem dummy = clCreateBuffer(decoder->context, CL_MEM_READ_ONLY,
+				  buf_packet_size, NULL, &err);
+    const cl_uchar zero = 0;
+    CHK_CL( clEnqueueFillBuffer(queue, dummy, &zero, sizeof(zero),
+				0, buf_packet_size, 0, NULL, NULL) );
+    CHK_CL( clSetKernelArg(s->kernel_1, 3, sizeof(cl_mem), &dummy) );
+
+#if defined(HAVE_GLEW)
+    if (decoder->m_type & K4W2_DECODER_ENABLE_OPENGL) {
+	CHK_CL( clEnqueueAcquireGLObjects(queue, ARRAY_SIZE(s->output), &s->output[0],
+					  0, NULL, NULL) );
+    }
+#endif
+
+    static const char *names[] = {"compute", "table", "table_half"};
+    cl_ulong best_time = 0;
+    cl_int mode;
+    for (mode = TRIG_COMPUTE; mode <= TRIG_TABLE_HALF; ++mode) {
+	const cl_ulong t = benchmark_kernel(decoder, queue, mode);
+	VERBOSE("trig mode '%s': %lu ns", names[mode], (unsigned long)t);
+	if (t && (0 == best_time || t < best_time)) {
+	    best_time = t;
+	    best = mode;
+	}
+    }
+
+#if defined(HAVE_GLEW)
+    if (decoder->m_type & K4W2_DECODER_ENABLE_OPENGL) {
+	CHK_CL( clEnqueueReleaseGLObjects(queue, ARRAY_SIZE(s->output), &s->output[0],
+					  0, NULL, NULL) );
+    }
+#endif
+    CHK_CL( clFinish(queue) );
+
+    CHK_CL( clSetKernelArg(s->kernel_1, 3, sizeof(cl_mem), &s->buf_packet) );
+    CHK_CL( clReleaseMemObject(dummy) );
+    CHK_CL( clReleaseCommandQueue(queue) );
+
+    VERBOSE("use trig mode '%s'", names[best]);
+    return best;
+}
+
+/*
+ * Uploads the cos/sin tables required by the selected trig mode, and
+ * updates the kernel arguments of all slots.
+ */
+static void
+setup_trig_tables(DecoderCL *decoder, const cl_float3 *p0)
+{
+    cl_int err;
+    size_t i;
+
+    if (decoder->buf_trig_table) {
+	CHK_CL( clReleaseMemObject(decoder->buf_trig_table) );
+	decoder->buf_trig_table = NULL;
+    }
+    if (decoder->buf_trig_table_half) {
+	CHK_CL( clReleaseMemObject(decoder->buf_trig_table_half) );
+	decoder->buf_trig_table_half = NULL;
+    }
+
+    const unsigned int trig = decoder->m_type & K4W2_DECODER_TRIG_MASK;
+    if (K4W2_DECODER_TRIG_COMPUTE == trig) {
+	decoder->m_trig_mode = TRIG_COMPUTE;
+    } else {
+	float *table = (float *)malloc(trig_table_len * sizeof(float));
+	fill_trig_values(&decoder->m_params, p0, table);
+
+	if (K4W2_DECODER_TRIG_TABLE_HALF != trig) {
+	    decoder->buf_trig_table = clCreateBuffer(decoder->context,
+						     CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+						     trig_table_len * sizeof(float), table,
+						     &err);
+	}
+	if (K4W2_DECODER_TRIG_TABLE != trig) {
+	    cl_half *half_table = (cl_half *)malloc(trig_table_len * sizeof(cl_half));
+	    for (i = 0; i < trig_table_len; ++i) {
+		half_table[i] = k4w2_float_to_half(table[i]);
+	    }
+	    decoder->buf_trig_table_half = clCreateBuffer(decoder->context,
+							  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+							  trig_table_len * sizeof(cl_half), half_table,
+							  &err);
+	    free(half_table);
+	}
+	free(table);
+
+	switch (trig) {
+	case K4W2_DECODER_TRIG_TABLE:
+	    decoder->m_trig_mode = TRIG_TABLE;
+	    break;
+	case K4W2_DECODER_TRIG_TABLE_HALF:
+	    decoder->m_trig_mode = TRIG_TABLE_HALF;
+	    break;
+	default:
+	    decoder->m_trig_mode = select_trig_mode(decoder);
+	    /* drop the table which is not used */
+	    if (TRIG_TABLE != decoder->m_trig_mode && decoder->buf_trig_table) {
+		CHK_CL( clReleaseMemObject(decoder->buf_trig_table) );
+		decoder->buf_trig_table = NULL;
+	    }
+	    if (TRIG_TABLE_HALF != decoder->m_trig_mode && decoder->buf_trig_table_half) {
+		CHK_CL( clReleaseMemObject(decoder->buf_trig_table_half) );
+		decoder->buf_trig_table_half = NULL;
+	    }
+	    break;
+	}
+    }
+
+    for (i = 0; i < decoder->m_num_slot; ++i) {
+	set_trig_args(&decoder->m_slot[i], decoder, decoder->m_trig_mode);
+    }
+}
+
 static int
 set_params(DecoderCL *decoder,
 	   const struct kinect2_color_camera_param * color,
@@ -646,14 +1146,12 @@ set_params(DecoderCL *decoder,
 				     0, NULL, NULL) );
     }
 
-    {
-	cl_float3 tmp[IMAGE_SIZE];
-	fill_trig_table(p0table, tmp);
-	CHK_CL( clEnqueueWriteBuffer(decoder->queue,
-				     decoder->buf_p0_table, CL_TRUE,
-				     0, sizeof(tmp), tmp,
-				     0, NULL, NULL) );
-    }
+    cl_float3 *p0 = (cl_float3 *)malloc(IMAGE_SIZE * sizeof(cl_float3));
+    fill_trig_table(p0table, p0);
+    CHK_CL( clEnqueueWriteBuffer(decoder->queue,
+				 decoder->buf_p0_table, CL_TRUE,
+				 0, IMAGE_SIZE * sizeof(cl_float3), p0,
+				 0, NULL, NULL) );
 
     {
 	float x_table[IMAGE_SIZE];
@@ -661,8 +1159,10 @@ set_params(DecoderCL *decoder,
 	int r = k4w2_create_xz_table(depth,
 				     x_table, sizeof(x_table),
 				     z_table, sizeof(z_table));
-	if (K4W2_SUCCESS != r)
+	if (K4W2_SUCCESS != r) {
+	    free(p0);
 	    return r;
+	}
 	CHK_CL (clEnqueueWriteBuffer(decoder->queue,
 				     decoder->buf_x_table, CL_TRUE,
 				     0, sizeof(x_table), x_table,
@@ -675,11 +1175,81 @@ set_params(DecoderCL *decoder,
 
 
     CHK_CL( clFinish(decoder->queue) );
+
+    /* the tables above are needed by the benchmark in select_trig_mode() */
+    setup_trig_tables(decoder, p0);
+    free(p0);
+
     
     return K4W2_SUCCESS;
 }
 
 
+/**
+ * Returns a buffer which wraps the host memory #ptr, creating it the
+ * first time #ptr is seen. When the cache is full, the least recently
+ * used wrapper is released; OpenCL keeps it alive until the kernels
+ * using it have completed.
+ * @param created  set to 1 if the wrapper has just been created
+ */
+static cl_mem
+wrap_host_memory(DecoderCL *decoder, const void *ptr, size_t length, int *created)
+{
+    Wrapper *w = NULL;
+    cl_int err;
+    int i;
+
+    *created = 0;
+    for (i = 0; i < MAX_WRAPPERS; ++i) {
+	if (decoder->m_wrapper[i].host == ptr) {
+	    w = &decoder->m_wrapper[i];
+	    w->last_used = ++decoder->m_wrapper_clock;
+	    return w->mem;
+	}
+	/* unused entries have last_used == 0 */
+	if (!w || decoder->m_wrapper[i].last_used < w->last_used)
+	    w = &decoder->m_wrapper[i];
+    }
+
+    if (w->mem)
+	CHK_CL( clReleaseMemObject(w->mem) );
+    w->host = NULL;
+    w->last_used = 0;
+    w->mem = clCreateBuffer(decoder->context,
+			    CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
+			    length, (void *)ptr, &err);
+    if (CL_SUCCESS != err) {
+	VERBOSE("clCreateBuffer() returns '%s'", opencl_strenum(err));
+	w->mem = NULL;
+	return NULL;
+    }
+    w->host = ptr;
+    w->last_used = ++decoder->m_wrapper_clock;
+    *created = 1;
+    return w->mem;
+}
+
+/**
+ * Makes what the host has written to the memory wrapped by #mem visible
+ * to the device. This is almost free on devices sharing memory with the
+ * host, and copies the buffer otherwise.
+ * @param event  signaled when the device can read #mem
+ */
+static int
+sync_host_memory(DecoderCL *decoder, cl_mem mem, size_t length, cl_event *event)
+{
+    cl_int err;
+    void *p = clEnqueueMapBuffer(decoder->queue, mem, CL_FALSE,
+				 CL_MAP_WRITE_INVALIDATE_REGION, 0, length,
+				 0, NULL, NULL, &err);
+    if (CL_SUCCESS != err) {
+	VERBOSE("clEnqueueMapBuffer() returns '%s'", opencl_strenum(err));
+	return K4W2_ERROR;
+    }
+    CHK_CL( clEnqueueUnmapMemObject(decoder->queue, mem, p, 0, NULL, event) );
+    return K4W2_SUCCESS;
+}
+
 static int
 request(DecoderCL *decoder, int slot, const void *ptr, int length)
 {
@@ -688,22 +1258,53 @@ request(DecoderCL *decoder, int slot, const void *ptr, int length)
     }
 
     Slot* s = &decoder->m_slot[slot];
+    int num_event_write = 0;
+    size_t i;
 
-    CHK_CL( clEnqueueWriteBuffer(decoder->queue,
-				 s->buf_packet, CL_FALSE, 0, length, ptr,
-				 0, NULL,
-				 &s->eventWrite[0]) );
+    /* kernels must not write to buffers mapped by the host */
+    for (i = 0; i < ARRAY_SIZE(s->mapped); ++i) {
+	unmap_output(decoder, slot, i);
+    }
+
+    release_event(&s->eventWrite[0]);
+    release_event(&s->eventWrite[1]);
+    release_event(&s->eventPPS1[0]);
+    release_event(&s->eventPPS2[0]);
+    release_event(&s->eventFilter[0]);
+    release_event(&s->eventFilter[1]);
+
+    if (decoder->m_type & K4W2_DECODER_ZERO_COPY) {
+	/* Wraps the caller's buffer instead of copying it; the wrapper
+	 * of a buffer seen before is reused. */
+	cl_mem mem;
+	int created = 0;
+	if (s->host_wrapper && ptr == s->host_packet) {
+	    mem = s->host_wrapper;
+	} else {
+	    mem = wrap_host_memory(decoder, ptr, length, &created);
+	    if (!mem)
+		return K4W2_ERROR;
+	}
+	if (!created &&
+	    K4W2_SUCCESS != sync_host_memory(decoder, mem, length,
+					     &s->eventWrite[num_event_write++]))
+	    return K4W2_ERROR;
+	s->buf_packet = mem;
+	CHK_CL( clSetKernelArg(s->kernel_1, 3, sizeof(cl_mem), &s->buf_packet) );
+    } else {
+	CHK_CL( clEnqueueWriteBuffer(decoder->queue,
+				     s->buf_packet, CL_FALSE, 0, length, ptr,
+				     0, NULL,
+				     &s->eventWrite[num_event_write++]) );
+    }
 
-    // !!FIXME!!
-    int num_event_write = 1;
 #if defined(HAVE_GLEW)
-    cl_mem objs[2] = {s->image[0], s->image[1]};
+    cl_mem objs[2] = {s->output[0], s->output[1]};
     if (decoder->m_type & K4W2_DECODER_ENABLE_OPENGL) {
 	CHK_CL( clEnqueueAcquireGLObjects(decoder->queue,
 					  ARRAY_SIZE(objs), &objs[0],
 					  0, NULL,
-					  &s->eventWrite[1]) );
-	num_event_write = 2;
+					  &s->eventWrite[num_event_write++]) );
     }
 #endif
 
@@ -714,17 +1315,46 @@ request(DecoderCL *decoder, int slot, const void *ptr, int length)
 				   NULL,
 				   global_work_size,
 				   NULL,
-				   num_event_write, &s->eventWrite[0],
+				   num_event_write,
+				   num_event_write?&s->eventWrite[0]:NULL,
 				   &s->eventPPS1[0]) );
 
-    CHK_CL( clEnqueueNDRangeKernel(decoder->queue,
-				   s->kernel_2,
-				   1,
-				   NULL,
-				   global_work_size,
-				   NULL,
-				   1, &s->eventPPS1[0],
-				   &s->eventPPS2[0]) );
+    if (s->kernel_2) {
+	cl_event *prev = &s->eventPPS1[0];
+	if (s->kernel_filter1) {
+	    CHK_CL( clEnqueueNDRangeKernel(decoder->queue,
+					   s->kernel_filter1,
+					   1,
+					   NULL,
+					   global_work_size,
+					   NULL,
+					   1, prev,
+					   &s->eventFilter[0]) );
+	    prev = &s->eventFilter[0];
+	}
+	CHK_CL( clEnqueueNDRangeKernel(decoder->queue,
+				       s->kernel_2,
+				       1,
+				       NULL,
+				       global_work_size,
+				       NULL,
+				       1, prev,
+				       s->kernel_filter2?&s->eventFilter[1]:&s->eventPPS2[0]) );
+	if (s->kernel_filter2) {
+	    CHK_CL( clEnqueueNDRangeKernel(decoder->queue,
+					   s->kernel_filter2,
+					   1,
+					   NULL,
+					   global_work_size,
+					   NULL,
+					   1, &s->eventFilter[1],
+					   &s->eventPPS2[0]) );
+	}
+    } else {
+	/* the fused kernel produces both outputs at once */
+	s->eventPPS2[0] = s->eventPPS1[0];
+	CHK_CL( clRetainEvent(s->eventPPS2[0]) );
+    }
 
 #if defined(HAVE_GLEW)
     if (decoder->m_type & K4W2_DECODER_ENABLE_OPENGL) {
@@ -757,31 +1387,204 @@ fetch(DecoderCL *decoder, int slot, void *dst, int dst_length)
     Slot* s = &decoder->m_slot[slot];
     static const size_t origin[3] = {0,0,0};
     static const size_t region[3] = {512, 424, 1};
+    const size_t depth_size = IMAGE_SIZE * k4w2_pixelformat_size(decoder->m_pixelformat[0]);
+    const size_t ir_size = IMAGE_SIZE * k4w2_pixelformat_size(decoder->m_pixelformat[1]);
+    const int with_ir = (dst_length >= depth_size + ir_size) &&
+	!(decoder->m_type & K4W2_DECODER_DISABLE_IR);
+    const int with_confidence = (dst_length >= depth_size + ir_size + IMAGE_SIZE) &&
+	(decoder->m_type & K4W2_DECODER_ENABLE_CONFIDENCE);
+
+    if (dst_length < depth_size)
+	return K4W2_ERROR;
 
-    CHK_CL( clEnqueueReadImage(decoder->queue,
-			       s->image[1],
-			       CL_FALSE, 
-			       origin, region,
-			       0,0,
-			       (char*)dst + buf_depth_size,
-			       ARRAY_SIZE(s->eventPPS1), &s->eventPPS1[0],
-			       &s->event0) );
-
-    CHK_CL( clEnqueueReadImage(decoder->queue,
-			       s->image[0],
-			       CL_FALSE, 
-			       origin, region,
-			       0,0,
-			       dst,
-			       ARRAY_SIZE(s->eventPPS2), &s->eventPPS2[0],
-			       &s->event1) );
-
-    CHK_CL( clWaitForEvents(1, &s->event0) );
+    release_event(&s->event0);
+    release_event(&s->event1);
+    release_event(&s->event2);
+
+    if (with_confidence) {
+	CHK_CL( clEnqueueReadBuffer(decoder->queue,
+				    s->buf_confidence,
+				    CL_FALSE,
+				    0, IMAGE_SIZE,
+				    (char*)dst + depth_size + ir_size,
+				    ARRAY_SIZE(s->eventPPS2), &s->eventPPS2[0],
+				    &s->event2) );
+    }
+
+    if (decoder->m_type & K4W2_DECODER_ENABLE_OPENGL) {
+	if (with_ir) {
+	    CHK_CL( clEnqueueReadImage(decoder->queue,
+				       s->output[1],
+				       CL_FALSE,
+				       origin, region,
+				       0,0,
+				       (char*)dst + depth_size,
+				       ARRAY_SIZE(s->eventPPS1), &s->eventPPS1[0],
+				       &s->event0) );
+	}
+	CHK_CL( clEnqueueReadImage(decoder->queue,
+				   s->output[0],
+				   CL_FALSE,
+				   origin, region,
+				   0,0,
+				   dst,
+				   ARRAY_SIZE(s->eventPPS2), &s->eventPPS2[0],
+				   &s->event1) );
+    } else {
+	if (with_ir) {
+	    CHK_CL( clEnqueueReadBuffer(decoder->queue,
+					s->output[1],
+					CL_FALSE,
+					0, ir_size,
+					(char*)dst + depth_size,
+					ARRAY_SIZE(s->eventPPS1), &s->eventPPS1[0],
+					&s->event0) );
+	}
+	CHK_CL( clEnqueueReadBuffer(decoder->queue,
+				    s->output[0],
+				    CL_FALSE,
+				    0, depth_size,
+				    dst,
+				    ARRAY_SIZE(s->eventPPS2), &s->eventPPS2[0],
+				    &s->event1) );
+    }
+
+    if (with_ir)
+	CHK_CL( clWaitForEvents(1, &s->event0) );
+    if (with_confidence)
+	CHK_CL( clWaitForEvents(1, &s->event2) );
     CHK_CL( clWaitForEvents(1, &s->event1) );
 
     return K4W2_SUCCESS;
 }
 
+/* returns the buffer of the plane, or NULL if it is not available */
+static cl_mem
+plane_buffer(const DecoderCL *decoder, Slot *s, unsigned int option, size_t *size)
+{
+    switch (option) {
+    case K4W2_DECODER_PLANE_DEPTH:
+	*size = IMAGE_SIZE * k4w2_pixelformat_size(decoder->m_pixelformat[0]);
+	return s->output[0];
+    case K4W2_DECODER_PLANE_IR:
+	if (decoder->m_type & K4W2_DECODER_DISABLE_IR)
+	    return NULL;
+	*size = IMAGE_SIZE * k4w2_pixelformat_size(decoder->m_pixelformat[1]);
+	return s->output[1];
+    case K4W2_DECODER_PLANE_CONFIDENCE:
+	*size = IMAGE_SIZE;
+	return s->buf_confidence;
+    }
+    return NULL;
+}
+
+static int
+map_output(DecoderCL *decoder, int slot, unsigned int option, const void **ptr)
+{
+    Slot* s = &decoder->m_slot[slot];
+    size_t size = 0;
+
+    if (decoder->m_type & K4W2_DECODER_ENABLE_OPENGL) {
+	return K4W2_NOT_SUPPORTED;
+    }
+    cl_mem mem = plane_buffer(decoder, s, option, &size);
+    if (!mem) {
+	return K4W2_NOT_SUPPORTED;
+    }
+
+    const int idx = option;
+    if (!s->mapped[idx]) {
+	cl_int err;
+	/* outputs of both kernels are ready once stage 2 has completed */
+	s->mapped[idx] = clEnqueueMapBuffer(decoder->queue,
+					    mem,
+					    CL_TRUE, CL_MAP_READ,
+					    0, size,
+					    ARRAY_SIZE(s->eventPPS2), &s->eventPPS2[0],
+					    NULL, &err);
+	if (CL_SUCCESS != err) {
+	    VERBOSE("clEnqueueMapBuffer() returns '%s'", opencl_strenum(err));
+	    s->mapped[idx] = NULL;
+	    return K4W2_ERROR;
+	}
+    }
+    *ptr = s->mapped[idx];
+    return K4W2_SUCCESS;
+}
+
+static int
+unmap_output(DecoderCL *decoder, int slot, unsigned int option)
+{
+    Slot* s = &decoder->m_slot[slot];
+    size_t size = 0;
+
+    if (decoder->m_type & K4W2_DECODER_ENABLE_OPENGL) {
+	return K4W2_NOT_SUPPORTED;
+    }
+    cl_mem mem = plane_buffer(decoder, s, option, &size);
+    if (!mem) {
+	return K4W2_NOT_SUPPORTED;
+    }
+
+    const int idx = option;
+    if (s->mapped[idx]) {
+	CHK_CL( clEnqueueUnmapMemObject(decoder->queue, mem,
+					s->mapped[idx], 0, NULL, NULL) );
+	s->mapped[idx] = NULL;
+    }
+    return K4W2_SUCCESS;
+}
+
+static int
+set_pixelformat(DecoderCL *decoder, unsigned int plane, int format)
+{
+    size_t i;
+
+    if (plane > K4W2_DECODER_PLANE_IR || 0 == k4w2_pixelformat_size(format))
+	return K4W2_ERROR;
+    if ((decoder->m_type & K4W2_DECODER_ENABLE_OPENGL) &&
+	K4W2_PIXELFORMAT_FLOAT != format) {
+	/* OpenGL textures are allocated as GL_R32F */
+	return K4W2_NOT_SUPPORTED;
+    }
+
+    decoder->m_pixelformat[plane] = format;
+    for (i = 0; i < decoder->m_num_slot; ++i) {
+	set_format_args(&decoder->m_slot[i], decoder);
+    }
+    return K4W2_SUCCESS;
+}
+
+/* Host memory can be used by the device without copies only if it is
+ * aligned, e.g. to a page on Intel GPUs; k4w2_alloc() returns such memory. */
+static int
+get_input_buffer(DecoderCL *decoder, int slot, void **ptr)
+{
+    Slot* s = &decoder->m_slot[slot];
+
+    if (!(decoder->m_type & K4W2_DECODER_ZERO_COPY))
+	return K4W2_NOT_SUPPORTED;
+    if (!s->host_packet) {
+	cl_int err;
+	s->host_packet = k4w2_alloc(buf_packet_size);
+	if (!s->host_packet)
+	    return K4W2_ERROR;
+	/* wrapped once here; request() reuses this wrapper */
+	s->host_wrapper = clCreateBuffer(decoder->context,
+					 CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
+					 buf_packet_size, s->host_packet, &err);
+	if (CL_SUCCESS != err) {
+	    VERBOSE("clCreateBuffer() returns '%s'", opencl_strenum(err));
+	    k4w2_free(s->host_packet);
+	    s->host_packet = NULL;
+	    s->host_wrapper = NULL;
+	    return K4W2_ERROR;
+	}
+    }
+    *ptr = s->host_packet;
+    return K4W2_SUCCESS;
+}
+
 typedef struct {
     struct k4w2_decoder_ctx decoder; 
     DecoderCL dcl;
@@ -837,6 +1640,43 @@ depth_cl_get_gl_texture(k4w2_decoder_t ctx, int slot, unsigned int option, unsig
     return get_gl_texture(&d->dcl, slot, option, texturename);
 }
 
+static int
+depth_cl_map(k4w2_decoder_t ctx, int slot, unsigned int option, const void **ptr)
+{
+    depth_cl * d = (depth_cl *)ctx;
+    return map_output(&d->dcl, slot, option, ptr);
+}
+
+static int
+depth_cl_unmap(k4w2_decoder_t ctx, int slot, unsigned int option)
+{
+    depth_cl * d = (depth_cl *)ctx;
+    return unmap_output(&d->dcl, slot, option);
+}
+
+static int
+depth_cl_get_input_buffer(k4w2_decoder_t ctx, int slot, void **ptr)
+{
+    depth_cl * d = (depth_cl *)ctx;
+    return get_input_buffer(&d->dcl, slot, ptr);
+}
+
+static int
+depth_cl_set_pixelformat(k4w2_decoder_t ctx, unsigned int plane, int format)
+{
+    depth_cl * d = (depth_cl *)ctx;
+    return set_pixelformat(&d->dcl, plane, format);
+}
+
+static int
+depth_cl_get_pixelformat(k4w2_decoder_t ctx, unsigned int plane)
+{
+    depth_cl * d = (depth_cl *)ctx;
+    if (plane > K4W2_DECODER_PLANE_IR)
+	return K4W2_ERROR;
+    return d->dcl.m_pixelformat[plane];
+}
+
 static int
 depth_cl_close(k4w2_decoder_t ctx)
 {
@@ -855,6 +1695,11 @@ REGISTER_MODULE(k4w2_decoder_depth_cl_init)
     ops.request	= depth_cl_request;
     ops.get_gl_texture = depth_cl_get_gl_texture;
     ops.fetch	= depth_cl_fetch;
+    ops.map	= depth_cl_map;
+    ops.unmap	= depth_cl_unmap;
+    ops.get_input_buffer = depth_cl_get_input_buffer;
+    ops.set_pixelformat = depth_cl_set_pixelformat;
+    ops.get_pixelformat = depth_cl_get_pixelformat;
     ops.close	= depth_cl_close;
 
     k4w2_register_decoder("depth OpenCL", &ops, sizeof(depth_cl));
@@ -15,14 +15,227 @@
 #else
 
 #include <turbojpeg.h>
+#ifdef _OPENMP
+#  include <omp.h>
+#endif
+
+/* the maximum number of parts of a frame; see K4W2_DECODER_PARALLEL_JPEG */
+#define MAX_PARTS 16
+/* the maximum number of MCU rows of an image split into parts */
+#define MAX_MCU_ROWS 512
+
+#define MIN(a,b)  (((a)>(b))?(b):(a))
+#define MAX(a,b)  (((a)>(b))?(a):(b))
 
 typedef struct {
     struct k4w2_decoder_ctx decoder; 
     tjhandle tj;
     unsigned char **buf;
     int colorspace;
+
+    /* used by K4W2_DECODER_PARALLEL_JPEG */
+    int num_parts;
+    tjhandle part_tj[MAX_PARTS];
+    unsigned char **part_jpeg; /* a JPEG image made for each part */
 } decoder_tj;
 
+/* layout of a baseline JPEG image with restart markers */
+typedef struct {
+    int header_length;       /* from SOI to the end of the SOS segment */
+    int height_offset;       /* offset of the height in the SOF segment */
+    int width, height;
+    int mcu_height;
+    int num_mcu_rows;
+    /* row[r] is the entropy-coded data beginning at MCU row r, or NULL
+     * if no restart interval begins there; row[num_mcu_rows] is EOI */
+    const unsigned char *row[MAX_MCU_ROWS + 1];
+} jpeg_layout;
+
+/**
+ * Finds the restart intervals which begin at the start of MCU rows.
+ * Such rows can be decoded independently of the rows above them, as the
+ * DC predictions are reset at every restart marker.
+ *
+ * @return K4W2_SUCCESS, or K4W2_NOT_SUPPORTED if the image cannot be split
+ */
+static int
+scan_jpeg(const unsigned char *jpeg, int length, jpeg_layout *l)
+{
+    const unsigned char *p = jpeg + 2;
+    const unsigned char *end = jpeg + length;
+    int restart_interval = 0;
+    int mcu_width = 0, mcus_per_row = 0;
+    int interval;
+
+    memset(l, 0, sizeof(*l));
+
+    /* segments up to SOS */
+    for (;;) {
+	int marker, len;
+	if (end < p + 4 || 0xff != p[0])
+	    return K4W2_NOT_SUPPORTED;
+	len = (p[2] << 8) | p[3];
+	if (end < p + 2 + len)
+	    return K4W2_NOT_SUPPORTED;
+	marker = p[1];
+	switch (marker) {
+	case 0xc0: /* SOF0 */
+	case 0xc1: /* SOF1 */
+	{
+	    int i, hmax = 1, vmax = 1;
+	    const int ncomp = p[9];
+	    l->height_offset = p + 5 - jpeg;
+	    l->height = (p[5] << 8) | p[6];
+	    l->width  = (p[7] << 8) | p[8];
+	    for (i = 0; 1 < ncomp && i < ncomp; ++i) {
+		hmax = MAX(hmax, p[11 + 3*i] >> 4);
+		vmax = MAX(vmax, p[11 + 3*i] & 15);
+	    }
+	    mcu_width = 8 * hmax;
+	    l->mcu_height = 8 * vmax;
+	    break;
+	}
+	case 0xc2: case 0xc3: case 0xc5: case 0xc6: case 0xc7:
+	case 0xc9: case 0xca: case 0xcb: case 0xcd: case 0xce: case 0xcf:
+	    /* progressive, lossless or arithmetic */
+	    return K4W2_NOT_SUPPORTED;
+	case 0xdd: /* DRI */
+	    restart_interval = (p[4] << 8) | p[5];
+	    break;
+	}
+	p += 2 + len;
+	if (0xda == marker) /* SOS; entropy-coded data follows */
+	    break;
+    }
+    l->header_length = p - jpeg;
+
+    if (!restart_interval || !l->mcu_height)
+	return K4W2_NOT_SUPPORTED;
+    mcus_per_row = (l->width + mcu_width - 1) / mcu_width;
+    l->num_mcu_rows = (l->height + l->mcu_height - 1) / l->mcu_height;
+    if (MAX_MCU_ROWS < l->num_mcu_rows)
+	return K4W2_NOT_SUPPORTED;
+
+    /* entropy-coded data; find RSTn and EOI */
+    l->row[0] = p;
+    for (interval = 1; p + 1 < end; ++p) {
+	if (0xff != p[0] || 0x00 == p[1] || 0xff == p[1])
+	    continue;
+	if (0xd0 <= p[1] && p[1] <= 0xd7) {
+	    const long mcu = (long)interval * restart_interval;
+	    if (0 == mcu % mcus_per_row && mcu / mcus_per_row < l->num_mcu_rows)
+		l->row[mcu / mcus_per_row] = p + 2;
+	    ++interval;
+	    ++p;
+	} else if (0xd9 == p[1]) {
+	    l->row[l->num_mcu_rows] = p;
+	    return K4W2_SUCCESS;
+	} else {
+	    /* e.g. DNL, or another scan */
+	    return K4W2_NOT_SUPPORTED;
+	}
+    }
+    return K4W2_NOT_SUPPORTED;
+}
+
+/**
+ * Makes a JPEG image of MCU rows [#r0, #r1) in #dst. The restart markers
+ * are renumbered from RST0, as a decoder expects.
+ *
+ * @return the length of the image
+ */
+static int
+make_part(const unsigned char *jpeg, const jpeg_layout *l, int r0, int r1,
+	  unsigned char *dst)
+{
+    const unsigned char *p = l->row[r0];
+    /* the data of row r1 follows the marker of its restart interval */
+    const unsigned char *end = (r1 < l->num_mcu_rows)? l->row[r1] - 2 : l->row[r1];
+    const int height = MIN(r1 * l->mcu_height, l->height) - r0 * l->mcu_height;
+    unsigned char *q = dst;
+    int rst = 0;
+
+    memcpy(q, jpeg, l->header_length);
+    q[l->height_offset]     = height >> 8;
+    q[l->height_offset + 1] = height & 0xff;
+    q += l->header_length;
+
+    while (p < end) {
+	const unsigned char *m = (const unsigned char *)memchr(p, 0xff, end - p);
+	if (!m || end <= m + 1) {
+	    memcpy(q, p, end - p);
+	    q += end - p;
+	    break;
+	}
+	if (0xff == m[1]) {
+	    /* a fill byte; the next 0xff may begin a marker, as in scan_jpeg() */
+	    memcpy(q, p, m + 1 - p);
+	    q += m + 1 - p;
+	    p = m + 1;
+	    continue;
+	}
+	memcpy(q, p, m + 2 - p);
+	q += m + 2 - p;
+	if (0xd0 <= m[1] && m[1] <= 0xd7)
+	    q[-1] = 0xd0 + (rst++ & 7);
+	p = m + 2;
+    }
+    *q++ = 0xff;
+    *q++ = 0xd9;
+    return q - dst;
+}
+
+/**
+ * Decodes parts of the image concurrently into disjoint rows of #dst.
+ * The parts are split at the restart intervals nearest to even shares of
+ * the MCU rows.
+ *
+ * @return K4W2_SUCCESS, K4W2_ERROR, or K4W2_NOT_SUPPORTED if the image
+ *         cannot be split or is longer than the part buffers
+ */
+static int
+decompress_parts(decoder_tj *d, const unsigned char *jpeg, int length,
+		 unsigned char *dst, int pitch)
+{
+    jpeg_layout l;
+    int bound[MAX_PARTS + 1];
+    int num = 0;
+    int i, res = 0;
+
+    /* a part is never longer than the whole image */
+    if (COLOR_FRAME_MAX_SIZE < length)
+	return K4W2_NOT_SUPPORTED;
+
+    if (K4W2_SUCCESS != scan_jpeg(jpeg, length, &l))
+	return K4W2_NOT_SUPPORTED;
+
+    bound[num++] = 0;
+    for (i = 1; i < d->num_parts; ++i) {
+	int r = i * l.num_mcu_rows / d->num_parts;
+	while (r < l.num_mcu_rows && !l.row[r])
+	    ++r;
+	if (bound[num - 1] < r && r < l.num_mcu_rows)
+	    bound[num++] = r;
+    }
+    bound[num] = l.num_mcu_rows;
+    if (num < 2)
+	return K4W2_NOT_SUPPORTED;
+
+#ifdef _OPENMP
+#pragma omp parallel for reduction(|:res) schedule(static,1)
+#endif
+    for (i = 0; i < num; ++i) {
+	const int part_length = make_part(jpeg, &l, bound[i], bound[i + 1],
+					  d->part_jpeg[i]);
+	const int y = bound[i] * l.mcu_height;
+	res |= tjDecompress2(d->part_tj[i], d->part_jpeg[i], part_length,
+			     dst + (size_t)y * pitch,
+			     l.width, pitch, MIN(bound[i + 1] * l.mcu_height, l.height) - y,
+			     d->colorspace, TJFLAG_FASTDCT);
+    }
+    return (0 == res)?K4W2_SUCCESS:K4W2_ERROR;
+}
+
 static int
 color_tj_open(k4w2_decoder_t ctx, unsigned int type)
 {
@@ -30,6 +243,8 @@ color_tj_open(k4w2_decoder_t ctx, unsigned int type)
 
     if ( (type & K4W2_DECODER_TYPE_MASK) != K4W2_DECODER_COLOR)
 	goto err;
+    if ( type & K4W2_DECODER_COLOR_PREVIEW )
+	goto err;
 
     d->buf = allocate_bufs(ctx->num_slot, 1920 * 1080 * 3);
     if (!d->buf)
@@ -37,6 +252,25 @@ color_tj_open(k4w2_decoder_t ctx, unsigned int type)
     d->tj = tjInitDecompress();
     d->colorspace = TJPF_BGR;
 
+    if (type & K4W2_DECODER_PARALLEL_JPEG) {
+	int i;
+#ifdef _OPENMP
+	d->num_parts = MIN(omp_get_max_threads(), MAX_PARTS);
+#else
+	d->num_parts = 1;
+#endif
+	if (1 < d->num_parts) {
+	    /* longer images are decoded by a single thread */
+	    d->part_jpeg = allocate_bufs(d->num_parts, COLOR_FRAME_MAX_SIZE);
+	    if (!d->part_jpeg)
+		goto err;
+	    for (i = 0; i < d->num_parts; ++i)
+		d->part_tj[i] = tjInitDecompress();
+	} else {
+	    VERBOSE("K4W2_DECODER_PARALLEL_JPEG is ignored; no threads");
+	}
+    }
+
     return K4W2_SUCCESS;
 err:
     free_bufs(d->buf);
@@ -49,11 +283,20 @@ static int
 color_tj_request(k4w2_decoder_t ctx, int slot, const void *src, int src_length)
 {
     decoder_tj * d = (decoder_tj *)ctx;
-    struct kinect2_color_header* h = (struct kinect2_color_header*)src;
+    const void *jpeg;
+    int jpeg_length;
     int res;
+    if (K4W2_SUCCESS != k4w2_get_color_jpeg(src, src_length, &jpeg, &jpeg_length))
+	return K4W2_ERROR;
+    if (d->part_jpeg) {
+	res = decompress_parts(d, (const unsigned char *)jpeg, jpeg_length,
+			       d->buf[slot], 1920 * 3);
+	if (K4W2_NOT_SUPPORTED != res)
+	    return res;
+    }
     res = tjDecompress2(d->tj,
-			h->image,
-			src_length,
+			(const unsigned char *)jpeg,
+			jpeg_length,
 			d->buf[slot],
 			1920, 1920 *3, 1080,
 			d->colorspace, TJFLAG_FASTDCT);
@@ -104,8 +347,14 @@ static int
 color_tj_close(k4w2_decoder_t ctx)
 {
     decoder_tj * d = (decoder_tj *)ctx;
+    int i;
     free_bufs(d->buf);
     d->buf = 0;
+    tjDestroy(d->tj);
+    for (i = 0; i < d->num_parts && d->part_jpeg; ++i)
+	tjDestroy(d->part_tj[i]);
+    free_bufs(d->part_jpeg);
+    d->part_jpeg = 0;
 
     return K4W2_SUCCESS;
 }
@@ -0,0 +1,579 @@
+/**
+ * @file   color_preview.c
+ *
+ * @brief  thumbnails of color frames made from the DC coefficients
+ *
+ * The DC coefficient of an 8x8 block is the average of its samples, so
+ * a 1/8 scale image is obtained by decoding the Huffman codes alone;
+ * the AC coefficients are skipped, and neither dequantization nor IDCT
+ * is needed. See K4W2_DECODER_COLOR_PREVIEW.
+ */
+
+#include "module.h"
+#include <stdint.h>
+
+#pragma GCC optimize ("O3")
+
+#define PREVIEW_WIDTH  K4W2_COLOR_PREVIEW_WIDTH
+#define PREVIEW_HEIGHT K4W2_COLOR_PREVIEW_HEIGHT
+
+#define MAX_COMPONENTS 3
+/* a plane may be padded to whole MCUs of up to 4x4 blocks */
+#define PLANE_SIZE ((PREVIEW_WIDTH + 3) * (PREVIEW_HEIGHT + 3))
+
+/* Huffman codes up to this length are decoded by a table lookup */
+#define LOOKAHEAD 9
+
+#define MIN(a,b)  (((a)>(b))?(b):(a))
+#define MAX(a,b)  (((a)>(b))?(a):(b))
+
+typedef struct {
+    uint8_t look_len[1 << LOOKAHEAD]; /* 0 if the code is longer */
+    uint8_t look_sym[1 << LOOKAHEAD];
+    /* for AC codes followed by their magnitude within the lookahead: the
+     * bits to skip (0 if not), and the coefficients skipped (0 for EOB) */
+    uint8_t look_skip[1 << LOOKAHEAD];
+    uint8_t look_run[1 << LOOKAHEAD];
+    int32_t maxcode[17];	/* the largest code of each length, or -1 */
+    int32_t valoffset[17];	/* huffval[] index minus the first code */
+    uint8_t huffval[256];
+} huff_table;
+
+typedef struct {
+    int id;
+    int h, v;			/* sampling factors */
+    int tq;			/* quantization table */
+    int td, ta;			/* DC and AC Huffman tables */
+    int stride;			/* blocks per row of plane[] */
+} component;
+
+typedef struct {
+    struct k4w2_decoder_ctx decoder;
+    unsigned char **buf;	/* buf[num_slot][PREVIEW_WIDTH*PREVIEW_HEIGHT*3] */
+    int colorspace;
+
+    /* tables of the frame being decoded; DHT and DQT persist across
+     * frames, as in a Motion JPEG stream */
+    int quant_dc[4];		/* the DC entry of each quantization table */
+    huff_table dc_table[4];
+    huff_table ac_table[4];
+    component comp[MAX_COMPONENTS];
+    int num_comp;
+    int width, height;
+    int hmax, vmax;
+    int restart_interval;
+
+    /* the average of each block of each component */
+    uint8_t plane[MAX_COMPONENTS][PLANE_SIZE];
+} decoder_preview;
+
+/* the tables of ITU-T T.81 Annex K.3, which Motion JPEG streams may omit */
+static const uint8_t std_dc_bits[2][16] = {
+    { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 },
+};
+static const uint8_t std_dc_val[12] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+static const uint8_t std_ac_bits[2][16] = {
+    { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d },
+    { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 },
+};
+static const uint8_t std_ac_val[2][162] = {
+    {
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+	0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+	0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+	0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+	0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+	0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+	0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+	0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+	0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+	0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+	0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa
+    },
+    {
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+	0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+	0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
+	0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+	0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+	0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+	0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+	0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+	0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+	0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+	0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa
+    },
+};
+
+typedef struct {
+    const uint8_t *p, *end;
+    uint64_t acc;		/* bits not consumed yet, from the MSB */
+    int nbits;
+} bit_reader;
+
+static void
+fill_bits(bit_reader *br)
+{
+    while (br->nbits <= 56) {
+	unsigned int b = 0;
+	if (br->p < br->end) {
+	    b = *br->p;
+	    if (0xff != b)
+		br->p++;
+	    else if (br->p + 1 < br->end && 0x00 == br->p[1])
+		br->p += 2;
+	    else
+		b = 0; /* a marker; zeros are fed until the next restart */
+	}
+	br->acc |= (uint64_t)b << (56 - br->nbits);
+	br->nbits += 8;
+    }
+}
+
+static int
+get_bits(bit_reader *br, int n)
+{
+    int v;
+    if (0 == n)
+	return 0;
+    if (br->nbits < n)
+	fill_bits(br);
+    v = (int)(br->acc >> (64 - n));
+    br->acc <<= n;
+    br->nbits -= n;
+    return v;
+}
+
+/* returns the decoded symbol, or -1 for an invalid code */
+static int
+decode_huff(bit_reader *br, const huff_table *t)
+{
+    unsigned int look;
+    int len;
+
+    if (br->nbits < 16)
+	fill_bits(br);
+    look = (unsigned int)(br->acc >> (64 - LOOKAHEAD));
+    len = t->look_len[look];
+    if (len) {
+	br->acc <<= len;
+	br->nbits -= len;
+	return t->look_sym[look];
+    }
+    for (len = LOOKAHEAD + 1; len <= 16; ++len) {
+	const int32_t code = (int32_t)(br->acc >> (64 - len));
+	if (code <= t->maxcode[len]) {
+	    br->acc <<= len;
+	    br->nbits -= len;
+	    return t->huffval[t->valoffset[len] + code];
+	}
+    }
+    return -1;
+}
+
+/* builds #t from the code counts bits[1..16] and the symbols of a DHT */
+static int
+build_huff(huff_table *t, const uint8_t *bits, const uint8_t *huffval, int num)
+{
+    int32_t code = 0;
+    int len, i, k = 0;
+
+    memset(t, 0, sizeof(*t));
+    memcpy(t->huffval, huffval, num);
+    for (len = 1; len <= 16; ++len) {
+	t->valoffset[len] = k - code;
+	for (i = 0; i < bits[len - 1]; ++i, ++k, ++code) {
+	    if ((1 << len) <= code)
+		return K4W2_ERROR;
+	    if (len <= LOOKAHEAD) {
+		const int shift = LOOKAHEAD - len;
+		const int r = huffval[k] >> 4, s = huffval[k] & 15;
+		int j;
+		for (j = 0; j < (1 << shift); ++j) {
+		    t->look_len[(code << shift) | j] = len;
+		    t->look_sym[(code << shift) | j] = huffval[k];
+		    if (len + s <= LOOKAHEAD) {
+			t->look_skip[(code << shift) | j] = len + s;
+			t->look_run[(code << shift) | j] =
+			    (s)?r + 1:((0xf0 == huffval[k])?16:0);
+		    }
+		}
+	    }
+	}
+	t->maxcode[len] = (bits[len - 1])?code - 1:-1;
+	code <<= 1;
+    }
+    return K4W2_SUCCESS;
+}
+
+/**
+ * Reads the segments up to SOS.
+ *
+ * @return the entropy-coded data, or NULL if the image is not supported
+ */
+static const uint8_t *
+parse_headers(decoder_preview *d, const uint8_t *jpeg, int length)
+{
+    const uint8_t *p = jpeg + 2;
+    const uint8_t *end = jpeg + length;
+    int i;
+
+    d->num_comp = 0;
+    d->restart_interval = 0;
+
+    while (p + 4 <= end) {
+	const uint8_t *s = p + 4;	/* the contents of the segment */
+	const uint8_t *next;
+	int marker, len;
+
+	if (0xff != p[0])
+	    return NULL;
+	marker = p[1];
+	len = (p[2] << 8) | p[3];
+	next = p + 2 + len;
+	if (len < 2 || end < next)
+	    return NULL;
+
+	switch (marker) {
+	case 0xdb: /* DQT */
+	    while (s < next) {
+		const int pq = s[0] >> 4, tq = s[0] & 3;
+		if (next < s + 1 + 64 * (pq + 1))
+		    return NULL;
+		d->quant_dc[tq] = (pq)?((s[1] << 8) | s[2]):s[1];
+		s += 1 + 64 * (pq + 1);
+	    }
+	    break;
+	case 0xc4: /* DHT */
+	    while (s + 17 <= next) {
+		const int tc = s[0] >> 4, th = s[0] & 3;
+		int num = 0;
+		for (i = 0; i < 16; ++i)
+		    num += s[1 + i];
+		if (256 < num || next < s + 17 + num)
+		    return NULL;
+		if (K4W2_SUCCESS != build_huff((tc)?&d->ac_table[th]:&d->dc_table[th],
+					       s + 1, s + 17, num))
+		    return NULL;
+		s += 17 + num;
+	    }
+	    break;
+	case 0xc0: /* SOF0 */
+	case 0xc1: /* SOF1 */
+	    if (len < 8 || 8 != s[0])
+		return NULL;
+	    d->height = (s[1] << 8) | s[2];
+	    d->width  = (s[3] << 8) | s[4];
+	    d->num_comp = s[5];
+	    if ((1 != d->num_comp && 3 != d->num_comp) || len < 8 + 3 * d->num_comp)
+		return NULL;
+	    d->hmax = d->vmax = 1;
+	    for (i = 0; i < d->num_comp; ++i) {
+		component *c = &d->comp[i];
+		c->id = s[6 + 3*i];
+		c->h  = (1 == d->num_comp)?1:(s[7 + 3*i] >> 4);
+		c->v  = (1 == d->num_comp)?1:(s[7 + 3*i] & 15);
+		c->tq = s[8 + 3*i] & 3;
+		if (c->h < 1 || 4 < c->h || c->v < 1 || 4 < c->v)
+		    return NULL;
+		d->hmax = MAX(d->hmax, c->h);
+		d->vmax = MAX(d->vmax, c->v);
+	    }
+	    break;
+	case 0xc2: case 0xc3: case 0xc5: case 0xc6: case 0xc7:
+	case 0xc9: case 0xca: case 0xcb: case 0xcd: case 0xce: case 0xcf:
+	    /* progressive, lossless or arithmetic */
+	    return NULL;
+	case 0xdd: /* DRI */
+	    if (len < 4)
+		return NULL;
+	    d->restart_interval = (s[0] << 8) | s[1];
+	    break;
+	case 0xda: /* SOS */
+	    /* only a single scan of all the components is supported */
+	    if (!d->num_comp || len < 6 + 2 * d->num_comp || s[0] != d->num_comp)
+		return NULL;
+	    for (i = 0; i < d->num_comp; ++i) {
+		component *c = &d->comp[i];
+		if (c->id != s[1 + 2*i])
+		    return NULL;
+		c->td = s[2 + 2*i] >> 4 & 3;
+		c->ta = s[2 + 2*i] & 3;
+	    }
+	    return next;
+	}
+	p = next;
+    }
+    return NULL;
+}
+
+/* stores the average of each block, in MCU order, into d->plane[] */
+static int
+decode_dc(decoder_preview *d, const uint8_t *data, const uint8_t *end)
+{
+    const int mcus_x = (d->width  + 8 * d->hmax - 1) / (8 * d->hmax);
+    const int mcus_y = (d->height + 8 * d->vmax - 1) / (8 * d->vmax);
+    int pred[MAX_COMPONENTS] = {0};
+    int todo = d->restart_interval;
+    bit_reader br;
+    int mx, my, i;
+
+    for (i = 0; i < d->num_comp; ++i) {
+	d->comp[i].stride = mcus_x * d->comp[i].h;
+	if (PLANE_SIZE < d->comp[i].stride * mcus_y * d->comp[i].v)
+	    return K4W2_ERROR;
+    }
+
+    br.p = data;
+    br.end = end;
+    br.acc = 0;
+    br.nbits = 0;
+
+    for (my = 0; my < mcus_y; ++my) {
+	for (mx = 0; mx < mcus_x; ++mx) {
+	    if (d->restart_interval && 0 == todo--) {
+		/* the bits left are padding; skip fill bytes and RSTn */
+		br.acc = 0;
+		br.nbits = 0;
+		while (br.p + 1 < br.end && 0xff == br.p[0] && 0xff == br.p[1])
+		    br.p++;
+		if (br.end <= br.p + 1 || 0xff != br.p[0] ||
+		    br.p[1] < 0xd0 || 0xd7 < br.p[1])
+		    return K4W2_ERROR;
+		br.p += 2;
+		memset(pred, 0, sizeof(pred));
+		todo = d->restart_interval - 1;
+	    }
+	    for (i = 0; i < d->num_comp; ++i) {
+		const component *c = &d->comp[i];
+		const huff_table *dc_table = &d->dc_table[c->td];
+		const huff_table *ac_table = &d->ac_table[c->ta];
+		const int q = d->quant_dc[c->tq];
+		int bx, by;
+		for (by = 0; by < c->v; ++by) {
+		    for (bx = 0; bx < c->h; ++bx) {
+			int s, k, v;
+			s = decode_huff(&br, dc_table);
+			if (s < 0 || 11 < s)
+			    return K4W2_ERROR;
+			v = get_bits(&br, s);
+			if (s && v < (1 << (s - 1)))
+			    v -= (1 << s) - 1;
+			pred[i] += v;
+
+			/* skip the AC coefficients */
+			for (k = 1; k < 64; ) {
+			    unsigned int look;
+			    int rs;
+			    if (br.nbits < 16)
+				fill_bits(&br);
+			    look = (unsigned int)(br.acc >> (64 - LOOKAHEAD));
+			    if (ac_table->look_skip[look]) {
+				br.acc <<= ac_table->look_skip[look];
+				br.nbits -= ac_table->look_skip[look];
+				if (!ac_table->look_run[look])
+				    break; /* EOB */
+				k += ac_table->look_run[look];
+				continue;
+			    }
+			    rs = decode_huff(&br, ac_table);
+			    if (rs < 0)
+				return K4W2_ERROR;
+			    if (rs & 15) {
+				get_bits(&br, rs & 15);
+				k += (rs >> 4) + 1;
+			    } else if (0xf0 == rs) {
+				k += 16;
+			    } else {
+				break; /* EOB */
+			    }
+			}
+			if (64 < k)
+			    return K4W2_ERROR;
+
+			/* the DC is 8 times the average, level shifted */
+			v = (pred[i] * q + 4 * (0 <= pred[i]?1:-1)) / 8 + 128;
+			d->plane[i][(my * c->v + by) * c->stride + mx * c->h + bx] =
+			    (v < 0)?0:((255 < v)?255:v);
+		    }
+		}
+	    }
+	}
+    }
+    return K4W2_SUCCESS;
+}
+
+/* converts the planes into an image of the colorspace */
+static void
+make_thumbnail(const decoder_preview *d, unsigned char *dst)
+{
+    const int ri = (K4W2_COLORSPACE_RGB == d->colorspace)?0:2;
+    /* the block of each component which covers a pixel in the row */
+    int col[MAX_COMPONENTS][PREVIEW_WIDTH];
+    int x, y, i;
+
+    for (i = 0; i < d->num_comp; ++i)
+	for (x = 0; x < PREVIEW_WIDTH; ++x)
+	    col[i][x] = x * d->comp[i].h / d->hmax;
+
+    for (y = 0; y < PREVIEW_HEIGHT; ++y) {
+	const uint8_t *row[MAX_COMPONENTS];
+	unsigned char *out = dst + y * PREVIEW_WIDTH * 3;
+
+	for (i = 0; i < d->num_comp; ++i)
+	    row[i] = d->plane[i] + y * d->comp[i].v / d->vmax * d->comp[i].stride;
+
+	if (1 == d->num_comp) {
+	    for (x = 0; x < PREVIEW_WIDTH; ++x, out += 3)
+		out[0] = out[1] = out[2] = row[0][col[0][x]];
+	    continue;
+	}
+	for (x = 0; x < PREVIEW_WIDTH; ++x, out += 3) {
+	    const float Y  = row[0][col[0][x]];
+	    const float cb = row[1][col[1][x]] - 128.0f;
+	    const float cr = row[2][col[2][x]] - 128.0f;
+	    const float r = Y + 1.402f * cr;
+	    const float g = Y - 0.344136f * cb - 0.714136f * cr;
+	    const float b = Y + 1.772f * cb;
+	    out[ri]     = (unsigned char)((r < 0)?0:((255 < r)?255:r + 0.5f));
+	    out[1]      = (unsigned char)((g < 0)?0:((255 < g)?255:g + 0.5f));
+	    out[2 - ri] = (unsigned char)((b < 0)?0:((255 < b)?255:b + 0.5f));
+	}
+    }
+}
+
+static int
+color_preview_open(k4w2_decoder_t ctx, unsigned int type)
+{
+    decoder_preview * d = (decoder_preview *)ctx;
+    int i;
+
+    if ( (type & K4W2_DECODER_TYPE_MASK) != K4W2_DECODER_COLOR)
+	goto err;
+    if ( !(type & K4W2_DECODER_COLOR_PREVIEW) )
+	goto err;
+
+    d->buf = allocate_bufs(ctx->num_slot, PREVIEW_WIDTH * PREVIEW_HEIGHT * 3);
+    if (!d->buf)
+	goto err;
+    d->colorspace = K4W2_COLORSPACE_BGR;
+
+    for (i = 0; i < 2; ++i) {
+	build_huff(&d->dc_table[i], std_dc_bits[i], std_dc_val, 12);
+	build_huff(&d->ac_table[i], std_ac_bits[i], std_ac_val[i], 162);
+    }
+
+    return K4W2_SUCCESS;
+err:
+    return K4W2_ERROR;
+}
+
+static int
+color_preview_request(k4w2_decoder_t ctx, int slot, const void *src, int src_length)
+{
+    decoder_preview * d = (decoder_preview *)ctx;
+    const void *jpeg;
+    int jpeg_length;
+    const uint8_t *data;
+
+    if (K4W2_SUCCESS != k4w2_get_color_jpeg(src, src_length, &jpeg, &jpeg_length))
+	return K4W2_ERROR;
+
+    data = parse_headers(d, (const uint8_t *)jpeg, jpeg_length);
+    if (!data) {
+	VERBOSE("unsupported JPEG image");
+	return K4W2_ERROR;
+    }
+    if ((d->width + 7) / 8 != PREVIEW_WIDTH || (d->height + 7) / 8 != PREVIEW_HEIGHT) {
+	VERBOSE("unexpected image size %dx%d", d->width, d->height);
+	return K4W2_ERROR;
+    }
+    if (K4W2_SUCCESS != decode_dc(d, data, (const uint8_t *)jpeg + jpeg_length))
+	return K4W2_ERROR;
+
+    make_thumbnail(d, d->buf[slot]);
+    return K4W2_SUCCESS;
+}
+
+static int
+color_preview_fetch(k4w2_decoder_t ctx, int slot, void *dst, int dst_length)
+{
+    decoder_preview * d = (decoder_preview *)ctx;
+    memcpy(dst, d->buf[slot], MIN(dst_length, PREVIEW_WIDTH * PREVIEW_HEIGHT * 3));
+    return K4W2_SUCCESS;
+}
+
+static int
+color_preview_get_colorspace(k4w2_decoder_t ctx)
+{
+    decoder_preview * d = (decoder_preview *)ctx;
+    return d->colorspace;
+}
+
+static int
+color_preview_set_colorspace(k4w2_decoder_t ctx, int colorspace)
+{
+    decoder_preview * d = (decoder_preview *)ctx;
+    switch (colorspace) {
+    case K4W2_COLORSPACE_BGR:
+    case K4W2_COLORSPACE_RGB:
+	d->colorspace = colorspace;
+	break;
+    default:
+	return K4W2_NOT_SUPPORTED;
+    }
+    return K4W2_SUCCESS;
+}
+
+static int
+color_preview_close(k4w2_decoder_t ctx)
+{
+    decoder_preview * d = (decoder_preview *)ctx;
+    free_bufs(d->buf);
+    d->buf = 0;
+    return K4W2_SUCCESS;
+}
+
+static const k4w2_decoder_ops ops = {
+    .open	= color_preview_open,
+    .get_colorspace = color_preview_get_colorspace,
+    .set_colorspace = color_preview_set_colorspace,
+    .request	= color_preview_request,
+    .fetch	= color_preview_fetch,
+    .close	= color_preview_close,
+};
+
+REGISTER_MODULE(k4w2_decoder_color_preview_init)
+{
+    k4w2_register_decoder("color preview", &ops, sizeof(decoder_preview));
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset:  4
+ * End:
+ */
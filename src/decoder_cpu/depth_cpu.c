@@ -21,6 +21,18 @@
 
 #pragma GCC optimize ("O3")
 
+/* tables derived from the camera parameters */
+struct depth_tables {
+    float trig_table0[512*424][6];
+    float trig_table1[512*424][6];
+    float trig_table2[512*424][6];
+
+    int16_t lut11to16[2048];
+
+    float x_table[512*424];
+    float z_table[512*424];
+};
+
 typedef struct {
     struct k4w2_decoder_ctx decoder; 
     struct parameters {
@@ -39,22 +51,58 @@ typedef struct {
 	float min_dealias_confidence;
 	float max_dealias_confidence;
 
-/*	float min_depth;
-	float max_depth;*/
-    } params;
+	float min_depth;
+	float max_depth;
 
-    float trig_table0[512*424][6];
-    float trig_table1[512*424][6];
-    float trig_table2[512*424][6];
+	float joint_bilateral_ab_threshold;
+	float joint_bilateral_max_edge;
+	float joint_bilateral_exp;
+	float gaussian_kernel[9];
 
-    int16_t lut11to16[2048];
+	float edge_ab_avg_min_value;
+	float edge_ab_std_dev_threshold;
+	float edge_close_delta_threshold;
+	float edge_far_delta_threshold;
+	float edge_max_delta_threshold;
+	float edge_avg_delta_threshold;
 
-    float x_table[512*424];
-    float z_table[512*424];
+	float temporal_alpha;
+	float temporal_reset_abs;
+	float temporal_reset_rel;
+    } params;
+
+    /* shared with other decoders; see k4w2_calibration_acquire() */
+    const struct depth_tables *tables;
 
     /* work area; work[ctx->num_slot][ 512*424*sizeof(float) * 9 ] */
     unsigned char **work;
 
+    /* results of the bilateral filter; edge_test[ctx->num_slot][512*424] */
+    unsigned char **edge_test;
+
+    /* rows saved by the bilateral filter;
+     * bilateral_rows[ctx->num_slot][ BILATERAL_ROWS_SIZE ] */
+    unsigned char **bilateral_rows;
+
+    /* raw depth and ir sum for the edge-aware filter;
+     * raw[ctx->num_slot][ 512*424*sizeof(float) * 2 ] */
+    unsigned char **raw;
+
+    /* running average of the temporal filter; temporal[512*424] */
+    float *temporal;
+
+    /* results of the temporal filter, which are reused when a slot is
+     * fetched again; temporal_out[ctx->num_slot][ TEMPORAL_OUT_SIZE ]
+     * holds the filtered depth followed by K4W2_CONFIDENCE_MOTION flags */
+    unsigned char **temporal_out;
+    /* temporal_done[slot] is set once temporal_out[slot] is filled */
+    unsigned char *temporal_done;
+
+    /* K4W2_PIXELFORMAT_* of depth and ir */
+    int pixelformat[2];
+
+    unsigned int type;
+
 } decoder_depth;
 
 
@@ -83,8 +131,31 @@ set_params(struct parameters *p)
     p->min_dealias_confidence = 0.3490659f;
     p->max_dealias_confidence = 0.6108653f;
 
-/*    p->min_depth = 500.0f;
-      p->max_depth = 4500.0f;*/
+    p->min_depth = 500.0f;
+    p->max_depth = 4500.0f;
+
+    p->joint_bilateral_ab_threshold = 3.0f;
+    p->joint_bilateral_max_edge = 2.5f;
+    p->joint_bilateral_exp = 5.0f;
+    {
+	static const float gaussian_kernel[9] = {
+	    0.1069973f, 0.1131098f, 0.1069973f,
+	    0.1131098f, 0.1195716f, 0.1131098f,
+	    0.1069973f, 0.1131098f, 0.1069973f
+	};
+	memcpy(p->gaussian_kernel, gaussian_kernel, sizeof(gaussian_kernel));
+    }
+
+    p->edge_ab_avg_min_value = 50.0f;
+    p->edge_ab_std_dev_threshold = 0.05f;
+    p->edge_close_delta_threshold = 50.0f;
+    p->edge_far_delta_threshold = 30.0f;
+    p->edge_max_delta_threshold = 100.0f;
+    p->edge_avg_delta_threshold = 0.0f;
+
+    p->temporal_alpha = 0.3f;
+    p->temporal_reset_abs = 50.0f;
+    p->temporal_reset_rel = 0.03f;
 }
 
 static inline int
@@ -234,7 +305,9 @@ processPixelStage2(int x, int y,
 		   const float m0_in[3],
 		   const float m1_in[3],
 		   const float m2_in[3],
-		   float * const ir_out, float * const depth_out, float * const ir_sum_out) 
+		   const int ir_mode,
+		   float * const ir_out, float * const depth_out, float * const ir_sum_out,
+		   unsigned char * const confidence_out) 
 {
     const int offset = y * 512 + x;
 
@@ -257,6 +330,11 @@ processPixelStage2(int x, int y,
 
     float ir_sum = m0[1] + m1[1] + m2[1];
 
+    /* the amplitude of a saturated measurement is set to 65535 by processMeasurementTriple() */
+    unsigned char confidence =
+	(m0_in[2] == 65535.0f || m1_in[2] == 65535.0f || m2_in[2] == 65535.0f) ?
+	K4W2_CONFIDENCE_SATURATED : 0;
+
     float phase;
     {
 	float ir_min = MIN( MIN(m0[1], m1[1]), m2[1]);
@@ -264,6 +342,7 @@ processPixelStage2(int x, int y,
 	if (ir_min < params->individual_ab_threshold || ir_sum < params->ab_threshold)
 	{
 	    phase = 0;
+	    confidence |= K4W2_CONFIDENCE_LOW_AMPLITUDE;
 	}
 	else
 	{
@@ -332,6 +411,8 @@ processPixelStage2(int x, int y,
 	    float mask3 = params->max_dealias_confidence * params->max_dealias_confidence >= norm ? 1.0f : 0.0f;
 	    t10 *= mask3;
 	    phase = 1 /*(modeMask & 2) != 0*/ ? t11 : t10;
+	    if (mask * mask2 == 0.0f)
+		confidence |= K4W2_CONFIDENCE_DEALIAS_REJECTED;
 	}
     }
 
@@ -353,6 +434,11 @@ processPixelStage2(int x, int y,
     depth_fit = depth_fit < 0 ? 0 : depth_fit;
     float depth = cond1 ? depth_fit : depth_linear; // r1.y -> later r2.z
 
+    if (!(params->min_depth <= depth && depth <= params->max_depth))
+	confidence |= K4W2_CONFIDENCE_OUT_OF_RANGE;
+    if (confidence_out)
+	*confidence_out = confidence;
+
     // depth
     *depth_out = depth;
     if(ir_sum_out != 0)
@@ -360,14 +446,265 @@ processPixelStage2(int x, int y,
 	*ir_sum_out = ir_sum;
     }
 
-    /* ir
-     * *ir_out = std::min((m1[2]) * ab_output_multiplier, 65535.0f);
-     * ir avg
-     *ir_out = MIN((m0[2] + m1[2] + m2[2]) * 0.3333333f * params->ab_output_multiplier, 65535.0f);
-     ir_out[0] = std::min(m0[2] * ab_output_multiplier, 65535.0f);
-     ir_out[1] = std::min(m1[2] * ab_output_multiplier, 65535.0f);
-     ir_out[2] = std::min(m2[2] * ab_output_multiplier, 65535.0f);
-    */
+    // ir
+    if (ir_out) {
+	float ir;
+	switch (ir_mode) {
+	case K4W2_DECODER_IR_FRQ0: ir = m0[2]; break;
+	case K4W2_DECODER_IR_FRQ1: ir = m1[2]; break;
+	case K4W2_DECODER_IR_FRQ2: ir = m2[2]; break;
+	default: ir = (m0[2] + m1[2] + m2[2]) * 0.3333333f; break;
+	}
+	*ir_out = MIN(ir * params->ab_output_multiplier, 65535.0f);
+    }
+}
+
+/* --- filters, based on the ones of libfreenect2 --- */
+
+#define ROW_SIZE (512*9)	/* floats per row of the work area */
+#define NUM_BANDS 8		/* 424 rows = 8 bands x 53 rows */
+/* bytes of the scratch rows of filter_bilateral(): 2 saved and 2 working
+ * rows per band */
+#define BILATERAL_ROWS_SIZE (sizeof(float) * ROW_SIZE * 4 * NUM_BANDS)
+
+/*
+ * Joint bilateral filter for a row of the work area. #above, #row and
+ * #below are unfiltered rows y-1, y and y+1; the result is written
+ * into #out.
+ */
+static void
+filter_bilateral_row(const struct parameters *params,
+		     const float *above, const float *row, const float *below,
+		     int y, float *out, unsigned char *max_edge_test)
+{
+    const float threshold0 =
+	(params->joint_bilateral_ab_threshold * params->joint_bilateral_ab_threshold) /
+	(params->ab_multiplier * params->ab_multiplier);
+    const float *rows[3] = {above, row, below};
+    int x;
+
+    for (x = 0; x < 512; ++x) {
+	const float *m = row + x*9;
+	float *m_out = out + x*9;
+	int edge_ok = 1;
+
+	if (x < 1 || y < 1 || x > 510 || y > 422) {
+	    memcpy(m_out, m, sizeof(float)*9);
+	    max_edge_test[x] = 1;
+	    continue;
+	}
+
+	int f;
+	for (f = 0; f < 9; f += 3) {
+	    const float norm2 = m[f+0] * m[f+0] + m[f+1] * m[f+1];
+	    const float inv_norm = 1.0f / sqrtf(norm2);
+	    const float n0 = m[f+0] * inv_norm;
+	    const float n1 = m[f+1] * inv_norm;
+
+	    float threshold = threshold0;
+	    float joint_bilateral_exp = params->joint_bilateral_exp;
+	    if (norm2 < threshold) {
+		threshold = 0.0f;
+		joint_bilateral_exp = 0.0f;
+	    }
+
+	    float weight_acc = 0.0f;
+	    float weighted_acc0 = 0.0f, weighted_acc1 = 0.0f;
+	    float dist_acc = 0.0f;
+	    int yi, xi, j = 0;
+	    for (yi = 0; yi < 3; ++yi) {
+		for (xi = -1; xi < 2; ++xi, ++j) {
+		    const float *other = rows[yi] + (x + xi)*9 + f;
+		    const float g = params->gaussian_kernel[j];
+		    if (yi == 1 && xi == 0) {
+			weight_acc += g;
+			weighted_acc0 += g * other[0];
+			weighted_acc1 += g * other[1];
+			continue;
+		    }
+		    const float other_norm2 = other[0] * other[0] + other[1] * other[1];
+		    if (other_norm2 < threshold)
+			continue;
+		    const float other_inv_norm = 1.0f / sqrtf(other_norm2);
+		    const float dist = 0.5f * (1.0f - (n0 * other[0] + n1 * other[1]) * other_inv_norm);
+		    const float weight = g * expf(-1.442695f * joint_bilateral_exp * dist);
+
+		    weighted_acc0 += weight * other[0];
+		    weighted_acc1 += weight * other[1];
+		    weight_acc += weight;
+		    dist_acc += dist;
+		}
+	    }
+	    edge_ok = edge_ok && dist_acc < params->joint_bilateral_max_edge;
+
+	    m_out[f+0] = 0.0f < weight_acc ? weighted_acc0 / weight_acc : 0.0f;
+	    m_out[f+1] = 0.0f < weight_acc ? weighted_acc1 / weight_acc : 0.0f;
+	    m_out[f+2] = m[f+2];
+	}
+	max_edge_test[x] = edge_ok;
+    }
+}
+
+/*
+ * Applies the bilateral filter to the work area in place. The frame is
+ * split into horizontal bands processed in parallel; each band keeps
+ * unfiltered copies of the previous and current rows, and the rows at
+ * band boundaries are saved before any band starts. #scratch holds
+ * BILATERAL_ROWS_SIZE bytes.
+ */
+static void
+filter_bilateral(const struct parameters *params, float *work, unsigned char *max_edge_test,
+		 float *scratch)
+{
+    const int band_height = 424 / NUM_BANDS;
+    float *saved = scratch;
+    int b;
+
+    for (b = 0; b < NUM_BANDS; ++b) {
+	const int begin = b * band_height;
+	const int end = begin + band_height;
+	if (begin > 0)
+	    memcpy(saved + (2*b+0)*ROW_SIZE, work + (begin-1)*ROW_SIZE, sizeof(float)*ROW_SIZE);
+	if (end < 424)
+	    memcpy(saved + (2*b+1)*ROW_SIZE, work + end*ROW_SIZE, sizeof(float)*ROW_SIZE);
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (b = 0; b < NUM_BANDS; ++b) {
+	const int begin = b * band_height;
+	const int end = begin + band_height;
+	float *rows = scratch + (2*NUM_BANDS + 2*b)*ROW_SIZE;
+	float *prev = rows;
+	float *cur = rows + ROW_SIZE;
+	int y;
+
+	for (y = begin; y < end; ++y) {
+	    const float *above = (y == begin) ? saved + (2*b+0)*ROW_SIZE : prev;
+	    const float *below = (y == end-1) ? saved + (2*b+1)*ROW_SIZE : work + (y+1)*ROW_SIZE;
+	    memcpy(cur, work + y*ROW_SIZE, sizeof(float)*ROW_SIZE);
+	    /* rows outside of the frame are never read */
+	    filter_bilateral_row(params, above, cur, below, y,
+				 work + y*ROW_SIZE, max_edge_test + y*512);
+	    float *tmp = prev;
+	    prev = cur;
+	    cur = tmp;
+	}
+    }
+}
+
+/*
+ * Edge-aware filter, which removes flying pixels. #raw holds pairs of
+ * raw depth and ir sum. Returns the filtered depth of (x, y).
+ */
+static float
+filter_edge_aware(const struct parameters *params,
+		  const float *raw, const unsigned char *max_edge_test,
+		  int x, int y)
+{
+    const int i = y*512 + x;
+    const float d = raw[i*2+0];
+
+    if (!(d >= params->min_depth && d <= params->max_depth))
+	return 0.0f;
+    if (x < 1 || y < 1 || x > 510 || y > 422)
+	return d;
+
+    const float ir_sum = raw[i*2+1];
+    float ir_sum_acc = ir_sum;
+    float squared_ir_sum_acc = ir_sum * ir_sum;
+    float min_depth = d;
+    float max_depth = d;
+    int yi, xi;
+
+    for (yi = -1; yi < 2; ++yi) {
+	for (xi = -1; xi < 2; ++xi) {
+	    if (yi == 0 && xi == 0)
+		continue;
+	    const int j = (y + yi)*512 + x + xi;
+	    const float d_other = raw[j*2+0];
+	    const float ir_sum_other = raw[j*2+1];
+
+	    ir_sum_acc += ir_sum_other;
+	    squared_ir_sum_acc += ir_sum_other * ir_sum_other;
+
+	    if (0.0f < d_other) {
+		min_depth = MIN(min_depth, d_other);
+		max_depth = MAX(max_depth, d_other);
+	    }
+	}
+    }
+
+    float tmp0 = sqrtf(squared_ir_sum_acc * 9.0f - ir_sum_acc * ir_sum_acc) / 9.0f;
+    const float edge_avg = MAX(ir_sum_acc / 9.0f, params->edge_ab_avg_min_value);
+    tmp0 /= edge_avg;
+
+    const float abs_min_diff = fabsf(d - min_depth);
+    const float abs_max_diff = fabsf(d - max_depth);
+    const float avg_diff = (abs_min_diff + abs_max_diff) * 0.5f;
+    const float max_abs_diff = MAX(abs_min_diff, abs_max_diff);
+
+    const int flying =
+	0.0f < d &&
+	tmp0 >= params->edge_ab_std_dev_threshold &&
+	params->edge_close_delta_threshold < abs_min_diff &&
+	params->edge_far_delta_threshold < abs_max_diff &&
+	params->edge_max_delta_threshold < max_abs_diff &&
+	params->edge_avg_delta_threshold < avg_diff;
+    const int edge = max_edge_test && !max_edge_test[i];
+
+    return (flying || edge) ? 0.0f : d;
+}
+
+#define TEMPORAL_OUT_SIZE (512*424 * (sizeof(float) + 1))
+
+/*
+ * Updates the running average #state with depth #d, and returns the
+ * filtered depth. Invalid pixels pass through and clear the state, and
+ * large changes restart the average.
+ */
+static inline float
+temporal_update(const struct parameters *params, float *state, float d,
+		unsigned char *confidence)
+{
+    const float s = *state;
+    float out = d;
+
+    if (params->min_depth <= d && d <= params->max_depth) {
+	if (s == 0.0f) {
+	    /* first valid sample */
+	} else if (fabsf(d - s) > (MAX(params->temporal_reset_abs, params->temporal_reset_rel * s))) {
+	    if (confidence)
+		*confidence |= K4W2_CONFIDENCE_MOTION;
+	} else {
+	    out = s + params->temporal_alpha * (d - s);
+	}
+	*state = out;
+    } else {
+	*state = 0.0f;
+    }
+    return out;
+}
+
+/*
+ * Applies the temporal filter to the depth #v of pixel #i of #slot. The
+ * running average is updated only by the first fetch after a request;
+ * later fetches of the slot return the same results.
+ */
+static inline float
+temporal_filter(decoder_depth *d, int slot, int i, float v, unsigned char *confidence)
+{
+    float *out = (float *)d->temporal_out[slot];
+    unsigned char *motion = (unsigned char *)(out + 512*424);
+
+    if (!d->temporal_done[slot]) {
+	motion[i] = 0;
+	out[i] = temporal_update(&d->params, &d->temporal[i], v, &motion[i]);
+    }
+    if (confidence)
+	*confidence |= motion[i];
+    return out[i];
 }
 
 static int
@@ -382,39 +719,87 @@ depth_cpu_open(k4w2_decoder_t ctx, unsigned int type)
     if (!d->work)
 	goto err;
 
+    if (type & K4W2_DECODER_BILATERAL_FILTER) {
+	d->edge_test = allocate_bufs(ctx->num_slot, 512 * 424);
+	if (!d->edge_test)
+	    goto err;
+	d->bilateral_rows = allocate_bufs(ctx->num_slot, BILATERAL_ROWS_SIZE);
+	if (!d->bilateral_rows)
+	    goto err;
+    }
+    if (type & K4W2_DECODER_EDGE_AWARE_FILTER) {
+	d->raw = allocate_bufs(ctx->num_slot, 512 * 424 * sizeof(float)*2);
+	if (!d->raw)
+	    goto err;
+    }
+    if (type & K4W2_DECODER_TEMPORAL_FILTER) {
+	d->temporal = (float *)k4w2_alloc(512 * 424 * sizeof(float));
+	if (!d->temporal)
+	    goto err;
+	memset(d->temporal, 0, 512 * 424 * sizeof(float));
+	d->temporal_out = allocate_bufs(ctx->num_slot, TEMPORAL_OUT_SIZE);
+	if (!d->temporal_out)
+	    goto err;
+	d->temporal_done = (unsigned char *)calloc(ctx->num_slot, 1);
+	if (!d->temporal_done)
+	    goto err;
+    }
+
+    d->pixelformat[0] = d->pixelformat[1] = K4W2_PIXELFORMAT_FLOAT;
+    d->type = type;
+
     return K4W2_SUCCESS;
 err:
     free_bufs(d->work);
     d->work = 0;
+    free_bufs(d->edge_test);
+    d->edge_test = 0;
+    free_bufs(d->bilateral_rows);
+    d->bilateral_rows = 0;
+    free_bufs(d->raw);
+    d->raw = 0;
+    k4w2_free(d->temporal);
+    d->temporal = 0;
+    free_bufs(d->temporal_out);
+    d->temporal_out = 0;
+    free(d->temporal_done);
+    d->temporal_done = 0;
     
     return K4W2_ERROR;
 }
 
-static void
-fill_trig_tables(const struct parameters *params, const uint16_t *p0table,
-		 float trig_table[512*424][6]) 
+struct build_args {
+    const struct parameters *params;
+    const struct kinect2_depth_camera_param *depth;
+    const struct kinect2_p0table *p0table;
+};
+
+static int
+build_tables(void *table, void *userdata)
 {
-    int x,y;
-    for (y=0;y<424;++y) {
-	for (x=0;x<512;++x) {
-	    float p0 = -0.000031 * M_PI * p0table[(423-y)*512 + x];
-	    int i = y*512 + x;
-
-	    float tmp0 = p0 + params->phase_in_rad[0];
-	    float tmp1 = p0 + params->phase_in_rad[1];
-	    float tmp2 = p0 + params->phase_in_rad[2];
-
-	    trig_table[i][0] = cos(tmp0);
-	    trig_table[i][1] = cos(tmp1);
-	    trig_table[i][2] = cos(tmp2);
-
-	    trig_table[i][3] = sin(-tmp0);
-	    trig_table[i][4] = sin(-tmp1);
-	    trig_table[i][5] = sin(-tmp2);
-	}
-    }
-}
+    struct depth_tables *t = (struct depth_tables *)table;
+    const struct build_args *args = (const struct build_args *)userdata;
+    int r;
+
+    r = k4w2_create_lut_table(t->lut11to16, sizeof(t->lut11to16));
+    if (K4W2_SUCCESS != r)
+	return r;
 
+    r = k4w2_create_xz_table(args->depth,
+			     t->x_table, sizeof(t->x_table),
+			     t->z_table, sizeof(t->z_table));
+    if (K4W2_SUCCESS != r)
+	return r;
+    
+    k4w2_create_trig_table(args->params->phase_in_rad, args->p0table->p0table0,
+			   t->trig_table0);
+    k4w2_create_trig_table(args->params->phase_in_rad, args->p0table->p0table1,
+			   t->trig_table1);
+    k4w2_create_trig_table(args->params->phase_in_rad, args->p0table->p0table2,
+			   t->trig_table2);
+
+    return K4W2_SUCCESS;
+}
 
 static int
 depth_cpu_set_params(k4w2_decoder_t ctx, 
@@ -423,23 +808,26 @@ depth_cpu_set_params(k4w2_decoder_t ctx,
 		     struct kinect2_p0table * p0table)
 {
     decoder_depth * d = (decoder_depth *)ctx;
-    int r;
+    struct build_args args;
+    uint64_t key;
 
     set_params(&d->params);
 
-    r = k4w2_create_lut_table(d->lut11to16, sizeof(d->lut11to16));
-    if (K4W2_SUCCESS != r)
-	return r;
+    key = k4w2_hash64(K4W2_HASH_INIT, d->params.phase_in_rad,
+		      sizeof(d->params.phase_in_rad));
+    key = k4w2_hash64(key, depth, sizeof(*depth));
+    key = k4w2_hash64(key, p0table, sizeof(*p0table));
 
-    r = k4w2_create_xz_table(depth,
-			     d->x_table, sizeof(d->x_table),
-			     d->z_table, sizeof(d->z_table));
-    if (K4W2_SUCCESS != r)
-	return K4W2_SUCCESS;
-    
-    fill_trig_tables(&d->params, p0table->p0table0, d->trig_table0);
-    fill_trig_tables(&d->params, p0table->p0table1, d->trig_table1);
-    fill_trig_tables(&d->params, p0table->p0table2, d->trig_table2);
+    args.params = &d->params;
+    args.depth = depth;
+    args.p0table = p0table;
+
+    k4w2_calibration_release(d->tables);
+    d->tables = (const struct depth_tables *)
+	k4w2_calibration_acquire("depth_cpu", key, sizeof(struct depth_tables),
+				 build_tables, &args);
+    if (!d->tables)
+	return K4W2_ERROR;
 
     return K4W2_SUCCESS;
 }
@@ -452,6 +840,13 @@ depth_cpu_request(k4w2_decoder_t ctx, int slot, const void *src, int src_length)
     float * work = (float*)d->work[slot];
 
     int y;
+
+    if (!d->tables) {
+	VERBOSE("camera parameters are not set");
+	return K4W2_ERROR;
+    }
+    if (d->temporal_done)
+	d->temporal_done[slot] = 0;
 #ifdef _OPENMP
 #pragma omp parallel for
 #endif
@@ -463,26 +858,30 @@ depth_cpu_request(k4w2_decoder_t ctx, int slot, const void *src, int src_length)
 	    int32_t m0_raw[3], m1_raw[3], m2_raw[3];
 
 
-	    m0_raw[0] = decodePixelMeasurement(src, 0, x, y, d->lut11to16);
-	    m0_raw[1] = decodePixelMeasurement(src, 1, x, y, d->lut11to16);
-	    m0_raw[2] = decodePixelMeasurement(src, 2, x, y, d->lut11to16);
-	    m1_raw[0] = decodePixelMeasurement(src, 3, x, y, d->lut11to16);
-	    m1_raw[1] = decodePixelMeasurement(src, 4, x, y, d->lut11to16);
-	    m1_raw[2] = decodePixelMeasurement(src, 5, x, y, d->lut11to16);
-	    m2_raw[0] = decodePixelMeasurement(src, 6, x, y, d->lut11to16);
-	    m2_raw[1] = decodePixelMeasurement(src, 7, x, y, d->lut11to16);
-	    m2_raw[2] = decodePixelMeasurement(src, 8, x, y, d->lut11to16);
+	    m0_raw[0] = decodePixelMeasurement(src, 0, x, y, d->tables->lut11to16);
+	    m0_raw[1] = decodePixelMeasurement(src, 1, x, y, d->tables->lut11to16);
+	    m0_raw[2] = decodePixelMeasurement(src, 2, x, y, d->tables->lut11to16);
+	    m1_raw[0] = decodePixelMeasurement(src, 3, x, y, d->tables->lut11to16);
+	    m1_raw[1] = decodePixelMeasurement(src, 4, x, y, d->tables->lut11to16);
+	    m1_raw[2] = decodePixelMeasurement(src, 5, x, y, d->tables->lut11to16);
+	    m2_raw[0] = decodePixelMeasurement(src, 6, x, y, d->tables->lut11to16);
+	    m2_raw[1] = decodePixelMeasurement(src, 7, x, y, d->tables->lut11to16);
+	    m2_raw[2] = decodePixelMeasurement(src, 8, x, y, d->tables->lut11to16);
 
-	    processMeasurementTriple((const float (*)[6])d->trig_table0, d->z_table,
+	    processMeasurementTriple((const float (*)[6])d->tables->trig_table0, d->tables->z_table,
 				     d->params.ab_multiplier_per_frq[0], d->params.ab_multiplier, x, y, m0_raw, p+0);
-	    processMeasurementTriple((const float (*)[6])d->trig_table1, d->z_table,
+	    processMeasurementTriple((const float (*)[6])d->tables->trig_table1, d->tables->z_table,
 				     d->params.ab_multiplier_per_frq[1], d->params.ab_multiplier, x, y, m1_raw, p+3);
-	    processMeasurementTriple((const float (*)[6])d->trig_table2, d->z_table,
+	    processMeasurementTriple((const float (*)[6])d->tables->trig_table2, d->tables->z_table,
 				     d->params.ab_multiplier_per_frq[2], d->params.ab_multiplier, x, y, m2_raw, p+6);
 
 	}
     }
 
+    if (d->type & K4W2_DECODER_BILATERAL_FILTER)
+	filter_bilateral(&d->params, work, d->edge_test[slot],
+			 (float *)d->bilateral_rows[slot]);
+
     return K4W2_SUCCESS;
 }
 
@@ -502,8 +901,23 @@ depth_cpu_fetch(k4w2_decoder_t ctx, int slot, void *dst, int dst_length)
     const float *work = (float*)d->work[slot];
 
 
-    float *dst_i = (dst_length == 424*512*sizeof(float)*2)?(float*)dst + 424*512:NULL;
-    float *dst_d = (float*)dst;
+    const int depth_fmt = d->pixelformat[0];
+    const int depth_plane_size = 424*512*k4w2_pixelformat_size(depth_fmt);
+    const int ir_fmt = d->pixelformat[1];
+    const int ir_plane_size = 424*512*k4w2_pixelformat_size(ir_fmt);
+    void *dst_d = dst;
+    float *raw = (d->raw) ? (float*)d->raw[slot] : NULL;
+    void *dst_i = NULL;
+    unsigned char *dst_c = NULL;
+
+    if (!d->tables || dst_length < depth_plane_size)
+	return K4W2_ERROR;
+    if (!(d->type & K4W2_DECODER_DISABLE_IR) &&
+	dst_length >= depth_plane_size + ir_plane_size)
+	dst_i = (char *)dst + depth_plane_size;
+    if ((d->type & K4W2_DECODER_ENABLE_CONFIDENCE) &&
+	dst_length >= depth_plane_size + ir_plane_size + 424*512)
+	dst_c = (unsigned char *)dst + depth_plane_size + ir_plane_size;
 
     int y;
 #ifdef _OPENMP
@@ -513,25 +927,93 @@ depth_cpu_fetch(k4w2_decoder_t ctx, int slot, void *dst, int dst_length)
 	int x;
 	for (x = 0; x < 512; ++x) {
 	    const float *p = work + x*9 + y*512*9;
+	    float depth, ir;
 	    processPixelStage2(x, y,
 			       &d->params,
-			       d->z_table,
-			       d->x_table,
+			       d->tables->z_table,
+			       d->tables->x_table,
 			       p + 0, p + 3, p + 6,
-			       (dst_i)?dst_i + (423 - y)*512 + x:NULL,
-			       (dst_d)?dst_d + (423 - y)*512 + x:NULL,
-			       0);
+			       d->type & K4W2_DECODER_IR_MASK,
+			       (dst_i)?&ir:NULL, &depth,
+			       (raw)?raw + (y*512 + x)*2 + 1:NULL,
+			       (dst_c)?dst_c + (423 - y)*512 + x:NULL);
+	    if (raw) {
+		raw[(y*512 + x)*2] = depth; /* filtered below */
+	    } else {
+		if (d->temporal)
+		    depth = temporal_filter(d, slot, y*512 + x, depth,
+					    (dst_c)?dst_c + (423 - y)*512 + x:NULL);
+		k4w2_store_pixel(dst_d, depth_fmt, (423 - y)*512 + x, depth);
+	    }
+	    if (dst_i)
+		k4w2_store_pixel(dst_i, ir_fmt, (423 - y)*512 + x, ir);
 	}
     }
 
+    if (raw) {
+	const unsigned char *max_edge_test = (d->edge_test) ? d->edge_test[slot] : NULL;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (y = 0; y < 424; ++y) {
+	    int x;
+	    for (x = 0; x < 512; ++x) {
+		const float raw_depth = raw[(y*512 + x)*2];
+		float depth = filter_edge_aware(&d->params, raw, max_edge_test, x, y);
+		if (dst_c && depth == 0.0f &&
+		    d->params.min_depth <= raw_depth && raw_depth <= d->params.max_depth)
+		    dst_c[(423 - y)*512 + x] |= K4W2_CONFIDENCE_EDGE;
+		if (d->temporal)
+		    depth = temporal_filter(d, slot, y*512 + x, depth,
+					    (dst_c)?dst_c + (423 - y)*512 + x:NULL);
+		k4w2_store_pixel(dst_d, depth_fmt, (423 - y)*512 + x, depth);
+	    }
+	}
+    }
+
+    if (d->temporal)
+	d->temporal_done[slot] = 1;
+    return K4W2_SUCCESS;
+}
+static int
+depth_cpu_set_pixelformat(k4w2_decoder_t ctx, unsigned int plane, int format)
+{
+    decoder_depth * d = (decoder_depth *)ctx;
+    if (plane > K4W2_DECODER_PLANE_IR || 0 == k4w2_pixelformat_size(format))
+	return K4W2_ERROR;
+    d->pixelformat[plane] = format;
     return K4W2_SUCCESS;
 }
+
+static int
+depth_cpu_get_pixelformat(k4w2_decoder_t ctx, unsigned int plane)
+{
+    decoder_depth * d = (decoder_depth *)ctx;
+    if (plane > K4W2_DECODER_PLANE_IR)
+	return K4W2_ERROR;
+    return d->pixelformat[plane];
+}
+
 static int
 depth_cpu_close(k4w2_decoder_t ctx)
 {
     decoder_depth * d = (decoder_depth *)ctx;
     free_bufs(d->work);
     d->work = 0;
+    free_bufs(d->edge_test);
+    d->edge_test = 0;
+    free_bufs(d->bilateral_rows);
+    d->bilateral_rows = 0;
+    free_bufs(d->raw);
+    d->raw = 0;
+    k4w2_free(d->temporal);
+    d->temporal = 0;
+    free_bufs(d->temporal_out);
+    d->temporal_out = 0;
+    free(d->temporal_done);
+    d->temporal_done = 0;
+    k4w2_calibration_release(d->tables);
+    d->tables = 0;
     return K4W2_SUCCESS;
 }
 
@@ -541,6 +1023,8 @@ static const k4w2_decoder_ops ops = {
     .request	= depth_cpu_request,
 /*    .wait	= depth_cpu_wait,*/
     .fetch	= depth_cpu_fetch,
+    .set_pixelformat = depth_cpu_set_pixelformat,
+    .get_pixelformat = depth_cpu_get_pixelformat,
     .close	= depth_cpu_close,
 };
 
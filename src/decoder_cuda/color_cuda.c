@@ -44,6 +44,8 @@ color_cuda_open(k4w2_decoder_t ctx, unsigned int type)
 
     if ( (type & K4W2_DECODER_TYPE_MASK) != K4W2_DECODER_COLOR)
 	goto err;
+    if ( type & K4W2_DECODER_COLOR_PREVIEW )
+	goto err;
     if ( type & K4W2_DECODER_DISABLE_CUDA )
 	goto err;
 
@@ -96,13 +98,17 @@ static int
 color_cuda_request(k4w2_decoder_t ctx, int slot, const void *src, int src_length)
 {
     decoder_cuda * d = (decoder_cuda *)ctx;
-    struct kinect2_color_header* h = (struct kinect2_color_header*)src;
     const size_t s = slot % ctx->num_slot;
+    const void *jpeg;
+    int jpeg_length;
+
+    if (K4W2_SUCCESS != k4w2_get_color_jpeg(src, src_length, &jpeg, &jpeg_length))
+	return K4W2_ERROR;
 
     if (d->slot[s].texture_id) {
-	gpujpeg_decoder_decode(d->cuda, h->image, src_length, &d->slot[s].output);
+	gpujpeg_decoder_decode(d->cuda, (uint8_t *)jpeg, jpeg_length, &d->slot[s].output);
     } else {
-	gpujpeg_decoder_request(d->cuda, h->image, src_length);
+	gpujpeg_decoder_request(d->cuda, (uint8_t *)jpeg, jpeg_length);
     }
     return K4W2_SUCCESS;
 }
@@ -81,6 +81,8 @@ color_nvjpeg_open(k4w2_decoder_t ctx, unsigned int type)
 
     if ( (type & K4W2_DECODER_TYPE_MASK) != K4W2_DECODER_COLOR)
 	goto err;
+    if ( type & K4W2_DECODER_COLOR_PREVIEW )
+	goto err;
     if ( type & K4W2_DECODER_DISABLE_CUDA )
 	goto err;
 
@@ -174,8 +176,12 @@ static int
 color_nvjpeg_request(k4w2_decoder_t ctx, int slotNo, const void *src, int src_length)
 {
     decoder_nvjpeg * d = (decoder_nvjpeg *)ctx;
-    struct kinect2_color_header* h = (struct kinect2_color_header*)src;
     decoder_slot *slot = &d->slot[slotNo % ctx->num_slot];
+    const void *jpeg;
+    int jpeg_length;
+
+    if (K4W2_SUCCESS != k4w2_get_color_jpeg(src, src_length, &jpeg, &jpeg_length))
+	return K4W2_ERROR;
 
     CUDA_CHECK_ERR();
 
@@ -194,7 +200,7 @@ color_nvjpeg_request(k4w2_decoder_t ctx, int slotNo, const void *src, int src_le
 
     nvjpegStatus_t res;
     res = nvjpegDecodePhaseOne(d->handle, slot->jpeg,
-			       h->image, src_length, d->outputfmt,
+			       (const unsigned char *)jpeg, jpeg_length, d->outputfmt,
 			       d->stream);
     if (res) {
 	VERBOSE("nvjpegDecodePhaseOne() failed; %s", nvjpeg_strerro(res));
@@ -18,6 +18,7 @@
     do { if (!(ctx)) { VERBOSE("wrong ctx"); return K4W2_ERROR; } } while (0)
 
 int k4w2_debug_level = 0;
+int k4w2_num_event_threads = 0;
 
 int
 k4w2_set_debug_level(int newlevel)
@@ -27,12 +28,88 @@ k4w2_set_debug_level(int newlevel)
     return oldlevel;
 }
 
+/** 
+ * Sets the number of threads that handle USB events of all devices.
+ *
+ * By default (0), each device has its own USB context and event thread,
+ * so that devices never wait for each other's events. When a positive
+ * number is given, devices opened after this call share one USB context
+ * which is serviced by #num_threads threads. This saves threads when many
+ * devices are used, but the devices can no longer be pinned to CPUs with
+ * k4w2_set_thread_affinity().
+ *
+ * The v4l2 driver has a single shared thread instead, which waits on the
+ * streams of all devices started after this call.
+ *
+ * @param num_threads  the number of event threads, or 0
+ *
+ * @return the previous value, or K4W2_ERROR
+ */
+int
+k4w2_set_num_event_threads(int num_threads)
+{
+    int old = k4w2_num_event_threads;
+    if (num_threads < 0)
+	return K4W2_ERROR;
+    k4w2_num_event_threads = num_threads;
+    return old;
+}
+
+/** 
+ * Pins the threads which receive frames from the device to the CPUs
+ * listed in #cpus[]. Callbacks set by k4w2_set_color_callback() and
+ * k4w2_set_depth_callback() run on these threads.
+ *
+ * @param ctx       device
+ * @param cpus      an array of CPU numbers
+ * @param num_cpus  the number of elements in cpus[]; 0 removes the affinity
+ *
+ * @return K4W2_SUCCESS, K4W2_ERROR or K4W2_NOT_SUPPORTED
+ */
+int
+k4w2_set_thread_affinity(k4w2_t ctx, const int cpus[], int num_cpus)
+{
+    int res;
+    CHECK(ctx);
+    if (num_cpus < 0 || K4W2_MAX_AFFINITY_CPUS < num_cpus || (num_cpus && !cpus)) {
+	VERBOSE("wrong number of cpus; %d", num_cpus);
+	return K4W2_ERROR;
+    }
+    if (!ctx->ops->set_affinity)
+	return K4W2_NOT_SUPPORTED;
+
+    if (num_cpus)
+	memcpy(ctx->cpus, cpus, sizeof(cpus[0]) * num_cpus);
+    ctx->num_cpus = num_cpus;
+    res = ctx->ops->set_affinity(ctx);
+    if (K4W2_SUCCESS != res)
+	ctx->num_cpus = 0;
+    return res;
+}
+
+/** 
+ * Pins the calling thread to the CPUs listed in #cpus[].
+ * This is useful to place the threads which run decoders on the same
+ * CPUs (or NUMA node) as the device.
+ *
+ * @param cpus      an array of CPU numbers
+ * @param num_cpus  the number of elements in cpus[]; 0 removes the affinity
+ *
+ * @return K4W2_SUCCESS, K4W2_ERROR or K4W2_NOT_SUPPORTED
+ */
+int
+k4w2_set_current_thread_affinity(const int cpus[], int num_cpus)
+{
+    return k4w2_thread_set_affinity(THREAD_SELF(), cpus, num_cpus);
+}
+
 typedef struct {
     const char *name;
     const k4w2_driver_ops *ops;
     int ctx_size;
+    unsigned int disable_flag; /* K4W2_DISABLE_* to skip this driver */
 } driver_entry;
-static driver_entry drivers[16] = {{NULL,NULL,-1}};
+static driver_entry drivers[16] = {{NULL,NULL,-1,0}};
 static int num_drivers = 0;
 static MUTEX_T driver_mutex = MUTEX_INITIALIZER;
 
@@ -46,6 +123,31 @@ k4w2_register_driver(const char *name,
     drivers[i].name = name;
     drivers[i].ops  = ops;
     drivers[i].ctx_size = ctx_size;
+    if (0 == strcmp(name, "v4l2"))
+	drivers[i].disable_flag = K4W2_DISABLE_V4L2;
+    else if (0 == strcmp(name, "libusb"))
+	drivers[i].disable_flag = K4W2_DISABLE_LIBUSB;
+}
+
+/* registers drivers; driver_mutex must be locked */
+static void
+initialize_drivers(void)
+{
+    static int firsttime = 1;
+
+    if (firsttime) {
+#if defined WITH_V4L2
+	INITIALIZE_MODULE(k4w2_driver_v4l2_init);
+#endif
+#if defined WITH_LIBUSB
+	INITIALIZE_MODULE(k4w2_driver_libusb_init);
+#endif
+	if (getenv("LIBK4W2_VERBOSE")) {
+	    k4w2_debug_level = atoi(getenv("LIBK4W2_VERBOSE"));
+	}
+
+	firsttime = 0;
+    }
 }
 
 k4w2_t
@@ -57,10 +159,103 @@ allocate_driver(const k4w2_driver_ops *ops, int ctx_size)
 
     memset(ctx, 0, ctx_size);
     ctx->ops = ops;
+    MUTEX_INIT(&ctx->param_mutex);
 
     return ctx;
 }
 
+static void
+release_driver(k4w2_t ctx)
+{
+    int i;
+    for (i = 0; i < NUM_PARAMS; ++i)
+	free(ctx->param[i]);
+    MUTEX_DESTROY(&ctx->param_mutex);
+    free(ctx);
+}
+
+static const struct param_entry {
+    const char *filename; /* see k4w2_camera_params_save() */
+    int length;
+} param_table[NUM_PARAMS] = {
+    {"color.bin",   sizeof(struct kinect2_color_camera_param)},
+    {"depth.bin",   sizeof(struct kinect2_depth_camera_param)},
+    {"p0table.bin", sizeof(struct kinect2_p0table)},
+};
+
+/**
+ * Reads a parameter page. Each page is read from the device only once,
+ * and is served from ctx->param[] afterwards.
+ */
+static int
+read_param(k4w2_t ctx, PARAM_ID id, void *param, int length)
+{
+    int r = K4W2_SUCCESS;
+
+    if (length != param_table[id].length)
+	return K4W2_ERROR;
+
+    MUTEX_LOCK(&ctx->param_mutex);
+    if (!ctx->param[id]) {
+	void *buf = malloc(length);
+	if (!buf) {
+	    r = K4W2_ERROR;
+	    goto exit;
+	}
+	r = ctx->ops->read_param(ctx, id, buf, length);
+	if (K4W2_SUCCESS != r) {
+	    free(buf);
+	    goto exit;
+	}
+	ctx->param[id] = buf;
+    }
+    if (param)
+	memcpy(param, ctx->param[id], length);
+exit:
+    MUTEX_UNLOCK(&ctx->param_mutex);
+    return r;
+}
+
+/** 
+ * Fills #options with the default values.
+ *
+ * @param options 
+ */
+void
+k4w2_open_options_init(struct k4w2_open_options *options)
+{
+    if (!options)
+	return;
+    memset(options, 0, sizeof(*options));
+    options->size = sizeof(*options);
+    options->color_num_xfers = 16;
+    options->color_xfer_size = 0x4000;
+    options->depth_num_xfers = 8;
+    options->depth_num_packets = 32;
+    options->num_framebuffers[COLOR_CH] = 30;
+    options->num_framebuffers[DEPTH_CH] = 30;
+    options->num_v4l2_buffers = 8;
+}
+
+static int
+check_open_options(const struct k4w2_open_options *o)
+{
+    if (o->size != sizeof(*o)) {
+	VERBOSE("open options are not initialized by k4w2_open_options_init(),"
+		" or built against another version of libk4w2");
+	return K4W2_ERROR;
+    }
+    if (o->color_num_xfers < 1 ||
+	o->color_xfer_size < 1024 || 0 != o->color_xfer_size % 1024 ||
+	o->depth_num_xfers < 1 || o->depth_num_packets < 1 ||
+	o->num_framebuffers[COLOR_CH] < 2 || o->num_framebuffers[DEPTH_CH] < 2 ||
+	o->num_v4l2_buffers < 2) {
+	VERBOSE("wrong open options");
+	return K4W2_ERROR;
+    }
+    return K4W2_SUCCESS;
+}
+
 /** 
  * 
  * 
@@ -73,52 +268,129 @@ allocate_driver(const k4w2_driver_ops *ops, int ctx_size)
  */
 k4w2_t
 k4w2_open(unsigned int deviceid, unsigned int flags)
+{
+    return k4w2_open_ex(deviceid, flags, NULL);
+}
+
+/** 
+ * Opens a device like k4w2_open(), with the transfer and buffering
+ * options given in #options.
+ *
+ * @param deviceid 
+ * @param flags 
+ * @param options  options, or NULL to use the defaults
+ * 
+ * @return 
+ *
+ * @note this function is threaded-safe.
+ */
+k4w2_t
+k4w2_open_ex(unsigned int deviceid, unsigned int flags,
+	     const struct k4w2_open_options *options)
 {
     int i = 0;
-    static int firsttime = 1;
     k4w2_t ctx = NULL;
-    MUTEX_LOCK(&driver_mutex);
-
-    if (firsttime) {
-#if defined WITH_V4L2
-	INITIALIZE_MODULE(k4w2_driver_v4l2_init);
-#endif
-#if defined WITH_LIBUSB
-	INITIALIZE_MODULE(k4w2_driver_libusb_init);
-#endif
-	if (getenv("LIBK4W2_VERBOSE")) {
-	    k4w2_debug_level = atoi(getenv("LIBK4W2_VERBOSE"));
-	}
+    struct k4w2_open_options defaults;
 
-	firsttime = 0;
+    if (!options) {
+	k4w2_open_options_init(&defaults);
+	options = &defaults;
     }
+    if (K4W2_SUCCESS != check_open_options(options))
+	return NULL;
+
+    MUTEX_LOCK(&driver_mutex);
+
+    initialize_drivers();
 
     for (i = 0; i < num_drivers; ++i) {
 	assert(drivers[i].ops);
 	assert(drivers[i].ctx_size >= 0);
+	if (flags & drivers[i].disable_flag)
+	    continue;
 	ctx = allocate_driver(drivers[i].ops, drivers[i].ctx_size);
 	if (!ctx)
 	    continue;
 
 	ctx->begin = (flags & K4W2_DISABLE_COLOR)?DEPTH_CH:COLOR_CH;
 	ctx->end   = (flags & K4W2_DISABLE_DEPTH)?COLOR_CH:DEPTH_CH;
+	ctx->options = *options;
 	if (!ctx->ops->open) {
 	    VERBOSE("internal error; open() is not implemented.");
-	    free(ctx);
-	    ctx = NULL;
 	} else if (K4W2_SUCCESS == ctx->ops->open(ctx, deviceid, flags)) {
 	    VERBOSE("%s driver is selected.", drivers[i].name);
 	    goto exit;
 	} 
-	free(ctx);
+	release_driver(ctx);
 	ctx = NULL;
     }
 
 exit:
     MUTEX_UNLOCK(&driver_mutex);
+
+    if (ctx && (flags & K4W2_PREFETCH_PARAMS)) {
+	PARAM_ID id;
+	for (id = COLOR_PARAM; id < NUM_PARAMS; ++id) {
+	    if (K4W2_SUCCESS != read_param(ctx, id, NULL, param_table[id].length))
+		VERBOSE("failed to prefetch %s", param_table[id].filename);
+	}
+    }
     return ctx;
 }
 
+/** 
+ * Lists the sensors attached to this host.
+ *
+ * A sensor handled by the gspca/kinect2 kernel module is listed by the
+ * v4l2 driver, and the others by the libusb driver. To open a listed
+ * sensor, pass its deviceid to k4w2_open() together with the flag
+ * that disables the other driver (K4W2_DISABLE_V4L2 or
+ * K4W2_DISABLE_LIBUSB).
+ *
+ * @param info         an array to be filled; may be NULL if max_devices is 0
+ * @param max_devices  the number of elements in info[]
+ * 
+ * @return the number of sensors found, which may be larger than
+ *         max_devices, or K4W2_ERROR
+ *
+ * @note this function is threaded-safe.
+ */
+int
+k4w2_enumerate(struct k4w2_device_info info[], int max_devices)
+{
+    int i;
+    int num = 0;
+
+    if (max_devices < 0 || (max_devices && !info))
+	return K4W2_ERROR;
+
+    MUTEX_LOCK(&driver_mutex);
+
+    initialize_drivers();
+
+    for (i = 0; i < num_drivers; ++i) {
+	const int offset = (num < max_devices)?num:max_devices;
+	int j, n;
+	if (!drivers[i].ops->enumerate)
+	    continue;
+	if (max_devices)
+	    memset(info + offset, 0, sizeof(info[0]) * (max_devices - offset));
+	n = drivers[i].ops->enumerate(info + offset, max_devices - offset);
+	if (n < 0) {
+	    VERBOSE("%s driver failed to enumerate sensors.", drivers[i].name);
+	    continue;
+	}
+	for (j = offset; j < max_devices && j < offset + n; ++j) {
+	    snprintf(info[j].driver, sizeof(info[j].driver), "%s",
+		     drivers[i].name);
+	}
+	num += n;
+    }
+
+    MUTEX_UNLOCK(&driver_mutex);
+    return num;
+}
+
 int
 k4w2_set_color_callback(k4w2_t ctx,
 			k4w2_callback_t callback,
@@ -141,6 +413,169 @@ k4w2_set_depth_callback(k4w2_t ctx,
     return K4W2_SUCCESS;
 }
 
+/** 
+ * Gives a buffer passed to a callback back to the device.
+ *
+ * When the device is opened with K4W2_HOLD_BUFFERS, a buffer passed to
+ * the callbacks stays valid, and is never overwritten, until it is
+ * released by this function. This lets decoders read frames directly
+ * from the buffers of the device, e.g. with K4W2_DECODER_ZERO_COPY, and
+ * from other threads. At least one buffer is always kept by the device;
+ * frames are dropped while the others are held.
+ *
+ * Only the v4l2 driver holds buffers; the buffers of the libusb driver
+ * stay valid until num_framebuffers frames have been received.
+ *
+ * @param ctx     device
+ * @param buffer  buffer passed to the callback
+ *
+ * @return K4W2_SUCCESS, K4W2_ERROR or K4W2_NOT_SUPPORTED
+ */
+int
+k4w2_release_buffer(k4w2_t ctx, const void *buffer)
+{
+    CHECK(ctx);
+    if (!ctx->ops->release_buffer)
+	return K4W2_NOT_SUPPORTED;
+    return ctx->ops->release_buffer(ctx, buffer);
+}
+
+/** 
+ * Exports a buffer passed to a callback as a dmabuf, so that it can be
+ * imported by other devices, such as GPUs, without copies. The same
+ * buffer always has the same file descriptor, which is owned by #ctx
+ * and closed by k4w2_close().
+ *
+ * @param ctx     device
+ * @param buffer  buffer passed to the callback
+ *
+ * @return a file descriptor, K4W2_ERROR or K4W2_NOT_SUPPORTED
+ */
+int
+k4w2_export_buffer(k4w2_t ctx, const void *buffer)
+{
+    CHECK(ctx);
+    if (!ctx->ops->export_buffer)
+	return K4W2_NOT_SUPPORTED;
+    return ctx->ops->export_buffer(ctx, buffer);
+}
+
+/** 
+ * Makes the device assemble depth frames directly into #buffers[],
+ * which are used in turn, instead of its own ring of buffers. Passing
+ * the input buffers of decoder slots (see
+ * k4w2_decoder_get_input_buffer()) lets each byte be copied only once,
+ * from the USB transfers to the place the decoder reads. The pointer
+ * passed to the depth callback is one of #buffers[]; a buffer is
+ * overwritten #num_buffers frames later.
+ *
+ * Call this while the device is stopped. The buffers must be kept until
+ * the device is closed or this is called again.
+ *
+ * Only the libusb driver supports this; the v4l2 driver can keep frames
+ * in its own buffers with K4W2_HOLD_BUFFERS.
+ *
+ * @param ctx          device
+ * @param buffers      an array of buffers, or NULL to use the buffers of
+ *                     the device again
+ * @param num_buffers  the number of elements in buffers[]; at least 2
+ * @param size         size of each buffer; at least
+ *                     KINECT2_DEPTH_FRAME_SIZE*10 bytes
+ *
+ * @return K4W2_SUCCESS, K4W2_ERROR or K4W2_NOT_SUPPORTED
+ */
+int
+k4w2_set_depth_buffers(k4w2_t ctx, void *const buffers[],
+		       int num_buffers, int size)
+{
+    CHECK(ctx);
+    if (buffers && (num_buffers < 2 || size < (int)DEPTH_FRAME_MAX_SIZE)) {
+	VERBOSE("wrong depth buffers; %d x %d bytes", num_buffers, size);
+	return K4W2_ERROR;
+    }
+    if (!ctx->ops->set_depth_buffers)
+	return K4W2_NOT_SUPPORTED;
+    return ctx->ops->set_depth_buffers(ctx, buffers, num_buffers, size);
+}
+
+/** 
+ * Tells which sub-frames of a depth frame are valid. A depth frame
+ * consists of 10 sub-frames, each followed by a footer. With
+ * K4W2_SALVAGE_DEPTH, the libusb driver delivers frames even if some
+ * sub-frames have been lost on the bus; the footers of the lost ones
+ * have zero length.
+ *
+ * @param buffer  depth frame passed to the callback
+ *
+ * @return a mask where bit n is set if the sub-frame n is valid;
+ *         0x3ff means the frame is complete
+ */
+unsigned int
+k4w2_get_depth_subframe_mask(const void *buffer)
+{
+    unsigned int mask = 0;
+    int n;
+    for (n = 0; n < 10; ++n) {
+	const struct kinect2_depth_footer *f = (const struct kinect2_depth_footer *)
+	    ((const char *)buffer + KINECT2_DEPTH_FRAME_SIZE*(n + 1) - sizeof(*f));
+	if (KINECT2_DEPTH_IMAGE_SIZE == f->length && (unsigned)n == f->subsequence)
+	    mask |= 1u<<n;
+    }
+    return mask;
+}
+
+/** 
+ * Locates the JPEG image in a color frame. The frame is checked for the
+ * magic numbers of its header and footer, and for the SOI and EOI
+ * markers of the image; the padding after EOI is excluded. Decoders
+ * reject broken frames with this before decoding them, and recorders
+ * can store only the image.
+ *
+ * @param buffer       color frame passed to the callback
+ * @param length       length of the frame
+ * @param jpeg         the beginning of the image will be stored here
+ * @param jpeg_length  the length of the image will be stored here
+ *
+ * @return K4W2_SUCCESS, or K4W2_ERROR if the frame is broken
+ */
+int
+k4w2_get_color_jpeg(const void *buffer, int length,
+		    const void **jpeg, int *jpeg_length)
+{
+    const struct kinect2_color_header *h = (const struct kinect2_color_header *)buffer;
+    const struct kinect2_color_footer *f;
+    const unsigned char *begin, *end;
+
+    if (!buffer || length < (int)(sizeof(*h) + sizeof(*f)) + 4)
+	return K4W2_ERROR;
+    f = KINECT2_GET_COLOR_FOOTER(buffer, length);
+    if (0x42424242 != h->magic || 0x42424242 != f->magic) {
+	VERBOSE("wrong magic of color frame; %08x, %08x",
+		(unsigned)h->magic, (unsigned)f->magic);
+	return K4W2_ERROR;
+    }
+
+    begin = h->image;
+    end = (const unsigned char *)f;
+    if (0xff != begin[0] || 0xd8 != begin[1]) {
+	VERBOSE("SOI not found");
+	return K4W2_ERROR;
+    }
+    /* the image is padded up to the end of the bulk transfer */
+    while (begin + 4 <= end && !(0xff == end[-2] && 0xd9 == end[-1]))
+	--end;
+    if (end < begin + 4) {
+	VERBOSE("EOI not found");
+	return K4W2_ERROR;
+    }
+
+    if (jpeg)
+	*jpeg = begin;
+    if (jpeg_length)
+	*jpeg_length = (int)(end - begin);
+    return K4W2_SUCCESS;
+}
+
 int
 k4w2_start(k4w2_t ctx)
 {
@@ -162,6 +597,7 @@ k4w2_close(k4w2_t *ctx)
 	return;
     if (*ctx) {
 	(*ctx)->ops->close(*ctx);
+	release_driver(*ctx);
 	*ctx = 0;
     }
 }
@@ -171,7 +607,7 @@ k4w2_read_color_camera_param(k4w2_t ctx,
 			     struct kinect2_color_camera_param *param)
 {
     CHECK(ctx);
-    return ctx->ops->read_param(ctx,COLOR_PARAM, param,sizeof(*param));
+    return read_param(ctx, COLOR_PARAM, param, sizeof(*param));
 }
 
 int
@@ -179,7 +615,45 @@ k4w2_read_depth_camera_param(k4w2_t ctx,
 			     struct kinect2_depth_camera_param *param)
 {
     CHECK(ctx);
-    return ctx->ops->read_param(ctx,DEPTH_PARAM, param,sizeof(*param));
+    return read_param(ctx, DEPTH_PARAM, param, sizeof(*param));
+}
+
+/** 
+ * Stores camera parameters saved by k4w2_camera_params_save() in the
+ * parameter cache of #ctx, so that k4w2_read_color_camera_param() and
+ * the like don't read them from the device. The files must have been
+ * saved from the same sensor; see k4w2_enumerate() to identify it.
+ *
+ * @param ctx 
+ * @param dirname 
+ * 
+ * @return K4W2_SUCCESS if all parameters are loaded
+ */
+int
+k4w2_preload_camera_params(k4w2_t ctx, const char *dirname)
+{
+    PARAM_ID id;
+    int r = K4W2_SUCCESS;
+    CHECK(ctx);
+
+    for (id = COLOR_PARAM; id < NUM_PARAMS; ++id) {
+	const size_t length = param_table[id].length;
+	size_t actual_size = 0;
+	void *buf = malloc(length);
+	if (!buf ||
+	    K4W2_SUCCESS != k4w2_load(dirname, param_table[id].filename,
+				      buf, length, &actual_size) ||
+	    actual_size != length) {
+	    free(buf);
+	    r = K4W2_ERROR;
+	    continue;
+	}
+	MUTEX_LOCK(&ctx->param_mutex);
+	free(ctx->param[id]);
+	ctx->param[id] = buf;
+	MUTEX_UNLOCK(&ctx->param_mutex);
+    }
+    return r;
 }
 
 int
@@ -187,7 +661,7 @@ k4w2_read_p0table(k4w2_t ctx,
 		  struct kinect2_p0table *p0table)
 {
     CHECK(ctx);
-    return ctx->ops->read_param(ctx, P0TABLE, p0table, sizeof(*p0table));
+    return read_param(ctx, P0TABLE, p0table, sizeof(*p0table));
 }
 
 /*
@@ -35,6 +35,8 @@ typedef struct {
 
 typedef struct {
     buffer_t *slot; /* slot[num_slot] */
+    unsigned char **bufs; /* memory of slot[]; see allocate_bufs(), or NULL
+			   * if the memory is given by the user */
     int num_slot;
     int buf_size;
     buffer_t *next; /* a pointer to the being updated element in slot[] */
@@ -45,15 +47,10 @@ typedef struct {
 static void
 release_ringbuf(ringbuffer_t *rg)
 {
-    if (rg->slot) {
-	int i;
-	for (i = 0; i < rg->num_slot; ++i) {
-	    free(rg->slot[i].pointer);
-	    rg->slot[i].pointer = NULL;
-	}
-	free(rg->slot);
-	rg->slot = NULL;
-    }
+    free_bufs(rg->bufs);
+    rg->bufs = NULL;
+    free(rg->slot);
+    rg->slot = NULL;
 }
 
 static int
@@ -61,12 +58,14 @@ allocate_ringbuf(ringbuffer_t *rg, int num_slot, int buf_size){
     int i;
     memset(rg, 0, sizeof(*rg));
     rg->num_slot = num_slot;
-    rg->slot = (buffer_t*)malloc(num_slot * sizeof(buffer_t));
+    rg->slot = (buffer_t*)calloc(num_slot, sizeof(buffer_t));
     rg->buf_size = buf_size;
+    /* page-aligned slots can be used by zero-copy decoders as they are */
+    rg->bufs = allocate_bufs(num_slot, (buf_size + 4095) & ~4095);
+    if (!rg->slot || !rg->bufs)
+	goto exit;
     for (i = 0; i < num_slot; ++i) {
-	rg->slot[i].pointer = (unsigned char*)malloc(buf_size);
-	if (!rg->slot[i].pointer)
-	    goto exit;
+	rg->slot[i].pointer = rg->bufs[i];
     }
     rg->next = &rg->slot[0];
     rg->next->length = 0;
@@ -78,6 +77,27 @@ exit:
     return K4W2_ERROR;
 }
 
+/* makes #rg assemble frames into the user's buffers */
+static int
+attach_ringbuf(ringbuffer_t *rg, void *const buffers[], int num_slot, int buf_size)
+{
+    int i;
+    buffer_t *slot = (buffer_t*)calloc(num_slot, sizeof(buffer_t));
+    if (!slot)
+	return K4W2_ERROR;
+    release_ringbuf(rg);
+    rg->slot = slot;
+    rg->num_slot = num_slot;
+    rg->buf_size = buf_size;
+    for (i = 0; i < num_slot; ++i) {
+	rg->slot[i].pointer = (unsigned char *)buffers[i];
+    }
+    rg->next = &rg->slot[0];
+    rg->next->length = 0;
+    rg->last = NULL;
+    return K4W2_SUCCESS;
+}
+
 static int
 append_data(ringbuffer_t *rg, const void *pointer, int length)
 {
@@ -85,7 +105,7 @@ append_data(ringbuffer_t *rg, const void *pointer, int length)
 	return K4W2_ERROR;
     }
 
-    memcpy(rg->next->pointer + rg->next->length, pointer, length);
+    memmove(rg->next->pointer + rg->next->length, pointer, length);
     rg->next->length += length;
     return K4W2_SUCCESS;
 }
@@ -114,14 +134,39 @@ typedef struct {
 
     usb_stream_t stream[2];       /* 0:color/bulk stream, 1:depth/isoc stream */
     ringbuffer_t ring[2];
-    unsigned depth_synced:1;
+    unsigned depth_started:1;     /* depth_cb() may be writing to ring[1] */
+    unsigned salvage_depth:1;     /* K4W2_SALVAGE_DEPTH */
+
+    /* depth frame being assembled in ring[1].next; see depth_cb() */
+    int depth_subseq;             /* sub-frame being received, 0..9 */
+    int depth_subframe_length;    /* bytes of the sub-frame received so far */
+    unsigned depth_overrun:1;     /* the sub-frame is broken */
+    unsigned depth_valid;         /* (1<<n) is set if sub-frame n is received */
+    uint32_t depth_sequence;      /* sequence of the frame */
+
+    /* color transfers received in place; see aim_xfer() */
+    int color_cursor;             /* offset in ring[0].next for the next aim, or -1 */
+    int color_resync;             /* aims left to be made at their own buffers */
 
     uint32_t request_sequence;
 
     THREAD_T thread;              /* libusb's event loop */
     volatile unsigned shutdown:1; /* set 1 will terminate event loop */
+    unsigned shared_context:1;    /* context is owned by shared_usb */
 } k4w2_libusb;
 
+/* USB context shared by all devices when k4w2_num_event_threads > 0 */
+static struct {
+    MUTEX_T mutex;
+    libusb_context *context;
+    int refcount;                 /* the number of devices using context */
+    THREAD_T *threads;            /* threads[num_threads] */
+    int num_threads;
+    volatile unsigned shutdown:1; /* set 1 will terminate event loops */
+} shared_usb = {MUTEX_INITIALIZER};
+
+#define MAX_DEVICES 32
+
 #define ControlAndRgbInterfaceId 0
 #define IrInterfaceId            1
 
@@ -142,9 +187,6 @@ static const unsigned char inbound_endpoint  = 0x081;
 static const unsigned char outbound_endpoint = 0x002;
 
 #define CTRL_TIMEOUT 1000
-#define BULK_SIZE    0x4000
-
-#define NUM_FRAMEBUFFERS 30
 
 #define cpu_to_le32(x) (x)
 
@@ -164,14 +206,180 @@ static const unsigned char outbound_endpoint = 0x002;
     } while (0)
 
 
+static void *
+shared_usb_thread(void *userarg)
+{
+    struct timeval t = {1, 0};
+
+    TRACE("shared libusb_thread begin");
+
+    while (!shared_usb.shutdown) {
+	libusb_handle_events_timeout_completed(shared_usb.context, &t, 0);
+    }
+
+    TRACE("shared libusb_thread end");
+    return NULL;
+}
+
+/**
+ * Returns the shared USB context in #context, and starts its event
+ * threads if this is the first user.
+ */
+static int
+acquire_shared_context(libusb_context **context)
+{
+    int r = LIBUSB_SUCCESS;
+    int i;
+
+    MUTEX_LOCK(&shared_usb.mutex);
+    if (0 == shared_usb.refcount) {
+	r = libusb_init(&shared_usb.context);
+	if (LIBUSB_SUCCESS != r) {
+	    VERBOSE("libusb_init() returns %s", libusb_error_name(r));
+	    goto exit;
+	}
+	shared_usb.threads = (THREAD_T*)calloc(k4w2_num_event_threads,
+					       sizeof(THREAD_T));
+	if (!shared_usb.threads) {
+	    r = LIBUSB_ERROR_NO_MEM;
+	    goto exit;
+	}
+	shared_usb.shutdown = 0;
+	for (i = 0; i < k4w2_num_event_threads; ++i) {
+	    if (THREAD_CREATE(&shared_usb.threads[i], shared_usb_thread, NULL)) {
+		VERBOSE("THREAD_CREATE() failed.");
+		break;
+	    }
+	}
+	shared_usb.num_threads = i;
+	if (0 == shared_usb.num_threads) {
+	    r = LIBUSB_ERROR_OTHER;
+	    goto exit;
+	}
+	VERBOSE("%d event threads are shared", shared_usb.num_threads);
+    }
+    ++shared_usb.refcount;
+    *context = shared_usb.context;
+exit:
+    if (LIBUSB_SUCCESS != r && 0 == shared_usb.refcount) {
+	free(shared_usb.threads);
+	shared_usb.threads = NULL;
+	if (shared_usb.context)
+	    libusb_exit(shared_usb.context);
+	shared_usb.context = NULL;
+    }
+    MUTEX_UNLOCK(&shared_usb.mutex);
+    return r;
+}
+
+static void
+release_shared_context(void)
+{
+    int i;
+
+    MUTEX_LOCK(&shared_usb.mutex);
+    assert(0 < shared_usb.refcount);
+    if (0 == --shared_usb.refcount) {
+	shared_usb.shutdown = 1;
+	for (i = 0; i < shared_usb.num_threads; ++i)
+	    THREAD_JOIN(shared_usb.threads[i]);
+	free(shared_usb.threads);
+	shared_usb.threads = NULL;
+	shared_usb.num_threads = 0;
+
+	libusb_exit(shared_usb.context);
+	shared_usb.context = NULL;
+    }
+    MUTEX_UNLOCK(&shared_usb.mutex);
+}
+
+typedef struct {
+    libusb_device *dev[MAX_DEVICES];
+    int num_devs;
+} device_list;
+
 static void
 kinect2_found_callback(libusb_device *device,
 		       const struct libusb_device_descriptor *desc,
 		       void *userdata)
 {
-    k4w2_libusb *usb = (k4w2_libusb*)userdata;
+    device_list *list = (device_list*)userdata;
+    libusb_device_handle *handle = NULL;
+
+    /* a device bound to gspca/kinect2 is listed by the v4l2 driver */
+    if (LIBUSB_SUCCESS == libusb_open(device, &handle)) {
+	const int bound =
+	    1 == libusb_kernel_driver_active(handle, ControlAndRgbInterfaceId) ||
+	    1 == libusb_kernel_driver_active(handle, IrInterfaceId);
+	libusb_close(handle);
+	if (bound)
+	    return;
+    }
 
-    usb->dev = device;
+    if (list->num_devs < ARRAY_SIZE(list->dev))
+	list->dev[list->num_devs++] = libusb_ref_device(device);
+}
+
+/* orders devices by their bus number and port path */
+static int
+compare_topology(const void *a, const void *b)
+{
+    libusb_device *dev_a = *(libusb_device * const *)a;
+    libusb_device *dev_b = *(libusb_device * const *)b;
+    uint8_t path_a[8], path_b[8];
+    int len_a, len_b;
+    int i;
+
+    if (libusb_get_bus_number(dev_a) != libusb_get_bus_number(dev_b))
+	return libusb_get_bus_number(dev_a) - libusb_get_bus_number(dev_b);
+
+    len_a = libusb_get_port_numbers(dev_a, path_a, sizeof(path_a));
+    len_b = libusb_get_port_numbers(dev_b, path_b, sizeof(path_b));
+    for (i = 0; i < len_a && i < len_b; ++i) {
+	if (path_a[i] != path_b[i])
+	    return path_a[i] - path_b[i];
+    }
+    return len_a - len_b;
+}
+
+/**
+ * Lists kinect2 devices in the order of the USB topology, so that
+ * the index of each device doesn't change unless it's re-plugged.
+ * Devices bound to a kernel driver are skipped.
+ * The devices must be released by release_kinect2_devices().
+ *
+ * @return the number of devices stored in list
+ */
+static int
+find_kinect2_devices(libusb_context *context, device_list *list)
+{
+    static const struct DeviceTable {
+	uint16_t vendor_id;
+	uint16_t product_id;
+    } tbl[] = {
+	{0x045e, 0x02d8}, /* kinect for windows 2 */
+	{0x045e, 0x02c4}, /* kinect for windows 2 preview? */
+    };
+    int i;
+
+    list->num_devs = 0;
+    for (i = 0; i < ARRAY_SIZE(tbl); ++i) {
+	usb_foreach_device(context,
+			   tbl[i].vendor_id, tbl[i].product_id,
+			   kinect2_found_callback,
+			   list);
+    }
+    qsort(list->dev, list->num_devs, sizeof(list->dev[0]), compare_topology);
+    return list->num_devs;
+}
+
+static void
+release_kinect2_devices(device_list *list)
+{
+    int i;
+    for (i = 0; i < list->num_devs; ++i)
+	libusb_unref_device(list->dev[i]);
+    list->num_devs = 0;
 }
 
 static int
@@ -180,24 +388,16 @@ open_device(k4w2_libusb *usb, unsigned int device_id, int attempt_reset)
     int res;
 
     if (!usb->dev) {
-	static const struct DeviceTable {
-	    uint16_t vendor_id;
-	    uint16_t product_id;
-	} tbl[] = {
-	    {0x045e, 0x02d8}, /* kinect for windows 2 */
-	    {0x045e, 0x02c4}, /* kinect for windows 2 preview? */
-	};
-	int i;
-	for (i = 0; i < ARRAY_SIZE(tbl); ++i) {
-	    usb_foreach_device(usb->context,
-			       tbl[i].vendor_id, tbl[i].product_id,
-			       kinect2_found_callback,
-			       usb);
-	}
-	if (!usb->dev) {
-	    VERBOSE("no kinect2 found.");
+	device_list list;
+	find_kinect2_devices(usb->context, &list);
+	if (list.num_devs <= device_id) {
+	    VERBOSE("kinect2 #%u not found; %d device(s) found.",
+		    device_id, list.num_devs);
+	    release_kinect2_devices(&list);
 	    goto exit;
 	}
+	usb->dev = libusb_ref_device(list.dev[device_id]);
+	release_kinect2_devices(&list);
     }
 
     assert(NULL == usb->handle);
@@ -239,6 +439,8 @@ open_device(k4w2_libusb *usb, unsigned int device_id, int attempt_reset)
 	     */
 	    nanosleep(&wait_for_initialize, 0);
 
+	    libusb_unref_device(usb->dev);
+	    usb->dev = NULL; /* rediscover the device */
 	    return open_device(usb, device_id, 0);
 	    /* break; */
 	}
@@ -409,6 +611,129 @@ k4w2_libusb_thread(void *userarg)
     return NULL;
 }
 
+#define DEPTH_SUBFRAMES 10
+#define DEPTH_VALID_ALL ((1u<<DEPTH_SUBFRAMES) - 1)
+
+static void
+reset_depth_frame(k4w2_libusb *usb)
+{
+    usb->depth_subseq = 0;
+    usb->depth_subframe_length = 0;
+    usb->depth_overrun = 0;
+    usb->depth_valid = 0;
+}
+
+static struct kinect2_depth_footer *
+subframe_footer(unsigned char *frame, int n)
+{
+    return (struct kinect2_depth_footer *)(frame + KINECT2_DEPTH_FRAME_SIZE*(n + 1)
+					   - sizeof(struct kinect2_depth_footer));
+}
+
+/**
+ * Passes the frame in ring[1].next to the callback, if all sub-frames
+ * have been received, or if any has and K4W2_SALVAGE_DEPTH is set. The
+ * footers of the missing sub-frames are copied from a received one, with
+ * their subsequence set and their length cleared; see
+ * k4w2_get_depth_subframe_mask().
+ */
+static void
+flush_depth_frame(k4w2_t ctx)
+{
+    k4w2_libusb * usb = (k4w2_libusb *)ctx;
+    ringbuffer_t *rg = &usb->ring[DEPTH_CH];
+    const unsigned valid = usb->depth_valid;
+    unsigned char *frame = rg->next->pointer;
+    int n;
+
+    reset_depth_frame(usb);
+    if (!valid)
+	return;
+    if (DEPTH_VALID_ALL != valid) {
+	const struct kinect2_depth_footer *f;
+	if (!usb->salvage_depth) {
+	    VERBOSE("depth frame %u is dropped; sub-frames %03x",
+		    (unsigned)usb->depth_sequence, valid);
+	    return;
+	}
+	for (n = 0; !(valid & (1u<<n)); ++n)
+	    ;
+	f = subframe_footer(frame, n);
+	for (n = 0; n < DEPTH_SUBFRAMES; ++n) {
+	    if (!(valid & (1u<<n))) {
+		struct kinect2_depth_footer *g = subframe_footer(frame, n);
+		memcpy(g, f, sizeof(*g));
+		g->subsequence = n;
+		g->length = 0;
+	    }
+	}
+	VERBOSE("depth frame %u is salvaged; sub-frames %03x",
+		(unsigned)usb->depth_sequence, valid);
+    }
+
+    rg->next->length = KINECT2_DEPTH_FRAME_SIZE*DEPTH_SUBFRAMES;
+    commit_frame(rg);
+    if (ctx->callback[DEPTH_CH]) {
+	ctx->callback[DEPTH_CH](rg->last->pointer, rg->last->length,
+				ctx->userdata[DEPTH_CH]);
+    }
+}
+
+/**
+ * Places a received sub-frame by the subsequence in its footer.
+ * Sub-frames are written where the next one is expected, and moved only
+ * if some have been lost in between.
+ */
+static void
+end_of_subframe(k4w2_t ctx, const struct kinect2_depth_footer *f)
+{
+    k4w2_libusb * usb = (k4w2_libusb *)ctx;
+    ringbuffer_t *rg = &usb->ring[DEPTH_CH];
+    const int n = f->subsequence;
+    unsigned char *src = rg->next->pointer + KINECT2_DEPTH_FRAME_SIZE*usb->depth_subseq;
+
+    if (usb->depth_overrun ||
+	KINECT2_DEPTH_FRAME_SIZE != usb->depth_subframe_length ||
+	0x00 != f->magic0 || KINECT2_DEPTH_IMAGE_SIZE != f->length ||
+	DEPTH_SUBFRAMES <= n) {
+	VERBOSE("wrong sub-frame; subseq:%d, len:%d, received:%d",
+		(int)f->subsequence, (int)f->length, usb->depth_subframe_length);
+	/* guess the lost one was expected; the next footer tells the truth */
+	usb->depth_subframe_length = 0;
+	usb->depth_overrun = 0;
+	if (usb->depth_subseq + 1 < DEPTH_SUBFRAMES)
+	    ++usb->depth_subseq;
+	return;
+    }
+
+    if (usb->depth_valid &&
+	(f->sequence != usb->depth_sequence || n < usb->depth_subseq)) {
+	/* the rest of the frame has been lost; this begins the next one,
+	 * which goes to the following slot unless this one is dropped */
+	if (DEPTH_VALID_ALL == usb->depth_valid || usb->salvage_depth) {
+	    buffer_t *following = rg->slot + (rg->next - rg->slot + 1)%rg->num_slot;
+	    memcpy(following->pointer + KINECT2_DEPTH_FRAME_SIZE*n, src,
+		   KINECT2_DEPTH_FRAME_SIZE);
+	} else if (n != usb->depth_subseq) {
+	    memcpy(rg->next->pointer + KINECT2_DEPTH_FRAME_SIZE*n, src,
+		   KINECT2_DEPTH_FRAME_SIZE);
+	}
+	flush_depth_frame(ctx);
+    } else if (n != usb->depth_subseq) {
+	memcpy(rg->next->pointer + KINECT2_DEPTH_FRAME_SIZE*n, src,
+	       KINECT2_DEPTH_FRAME_SIZE);
+    }
+
+    usb->depth_valid |= 1u<<n;
+    usb->depth_sequence = f->sequence;
+    usb->depth_subframe_length = 0;
+    usb->depth_overrun = 0;
+    if (DEPTH_SUBFRAMES - 1 == n)
+	flush_depth_frame(ctx);
+    else
+	usb->depth_subseq = n + 1;
+}
+
 static void
 depth_cb(struct libusb_transfer *xfer, void *userarg)
 {
@@ -420,43 +745,97 @@ depth_cb(struct libusb_transfer *xfer, void *userarg)
     for (i = 0; i < xfer->num_iso_packets; ++i) {
 	const struct libusb_iso_packet_descriptor* d = &xfer->iso_packet_desc[i];
 	if (0 < d->actual_length) {
-	    if (usb->depth_synced) {
-		if (K4W2_SUCCESS != append_data(rg, ptr, d->actual_length)) {
+	    const int offset = KINECT2_DEPTH_FRAME_SIZE*usb->depth_subseq
+		+ usb->depth_subframe_length;
+	    if (KINECT2_DEPTH_FRAME_SIZE < usb->depth_subframe_length + (int)d->actual_length ||
+		rg->buf_size < offset + (int)d->actual_length) {
+		if (!usb->depth_overrun)
 		    VERBOSE("buffer overrun!!");
-		    usb->depth_synced = 0;
-		    rollback_frame(rg);
-		}
+		usb->depth_overrun = 1;
+	    } else if (!usb->depth_overrun) {
+		memcpy(rg->next->pointer + offset, ptr, d->actual_length);
+		usb->depth_subframe_length += d->actual_length;
 	    }
 	    if (d->actual_length != d->length) {
-		/* this packet is last one */
+		/* this packet is the last one of a sub-frame */
 		const struct kinect2_depth_footer *f;
 		f = (struct kinect2_depth_footer*)(ptr
 						   + d->actual_length
 						   - sizeof(*f));
-		if (0x00 != f->magic0 ||
-		    KINECT2_DEPTH_IMAGE_SIZE != f->length) {
-		    VERBOSE("wrong pkt; i:%d, synced:%d, len: %d",
-			    i,
-			    usb->depth_synced,
-			    f->length);
-		    usb->depth_synced = 0;
-		    rollback_frame(rg);
-		} else {
-		    if (9==f->subsequence) {
-			usb->depth_synced = 1;
-			commit_frame(rg);
-			if (ctx->callback[DEPTH_CH]) {
-			    ctx->callback[DEPTH_CH](rg->last->pointer, rg->last->length,
-						    ctx->userdata[DEPTH_CH]);
-			}
-		    }
-		}
+		end_of_subframe(ctx, f);
 	    }
 	}
 	ptr += d->length;
     }
 }
 
+/* appends the data of #xfer, which may have been received in place */
+static void
+append_xfer(ringbuffer_t *rg, const struct libusb_transfer *xfer)
+{
+    if (xfer->buffer == rg->next->pointer + rg->next->length)
+	rg->next->length += xfer->actual_length;
+    else
+	append_data(rg, xfer->buffer, xfer->actual_length);
+}
+
+/**
+ * Points #xfer to where its data will belong in the ring, i.e. after
+ * the data of the transfers in flight, so that JPEG bytes are received
+ * in place. Data that ends up elsewhere is copied by append_xfer().
+ *
+ * Each aim advances the cursor by a whole transfer, so no two transfers
+ * in flight target overlapping memory, and the data received never
+ * grows faster than the cursor; a copy never reaches a target in flight.
+ * The slot is never reused meanwhile if the ring has more slots than
+ * transfers.
+ */
+static void
+aim_xfer(k4w2_libusb *usb, struct libusb_transfer *xfer)
+{
+    k4w2_t ctx = (k4w2_t)usb;
+    ringbuffer_t *rg = &usb->ring[COLOR_CH];
+    const int num_xfers = usb_stream_get_num_xfers(usb->stream[COLOR_CH]);
+    const int size = ctx->options.color_xfer_size;
+    int offset;
+
+    if (0 < usb->color_resync) {
+	/* the others in flight may not land where they were aimed */
+	--usb->color_resync;
+	xfer->buffer = usb_stream_get_buffer(usb->stream[COLOR_CH], xfer);
+	return;
+    }
+    if (usb->color_cursor < 0) {
+	/* the others in flight are received into their own buffers */
+	usb->color_cursor = rg->next->length + (num_xfers - 1) * size;
+    }
+    offset = usb->color_cursor;
+    usb->color_cursor += size;
+
+    if (num_xfers < rg->num_slot && offset + size <= rg->buf_size)
+	xfer->buffer = rg->next->pointer + offset;
+    else
+	xfer->buffer = usb_stream_get_buffer(usb->stream[COLOR_CH], xfer);
+}
+
+/**
+ * Called when the frame is committed or dropped. The transfers in flight
+ * were aimed for the old frame.
+ *
+ * After a commit, none of them target the new slot, as that would take a
+ * trip around the ring; to the new slot, they are as good as their own
+ * buffers, so the cursor restarts from its length. After a rollback, they
+ * target the same slot, so the next ones are aimed at their own buffers
+ * until none of the old aims are left.
+ */
+static void
+resync_xfers(k4w2_libusb *usb, int committed)
+{
+    usb->color_resync = (committed)?0:
+	usb_stream_get_num_xfers(usb->stream[COLOR_CH]) - 1;
+    usb->color_cursor = -1;
+}
+
 static void
 color_cb(struct libusb_transfer *xfer, void *userarg)
 {
@@ -466,13 +845,21 @@ color_cb(struct libusb_transfer *xfer, void *userarg)
 
     assert (0 != xfer->actual_length);
 
-    if (BULK_SIZE != xfer->actual_length) {
+    if (ctx->options.color_xfer_size != xfer->actual_length) {
 	/* last packet */
-	append_data(rg, xfer->buffer, xfer->actual_length);
-	commit_frame(rg);
-	if (ctx->callback[COLOR_CH]) {
-	    ctx->callback[COLOR_CH](rg->last->pointer, rg->last->length,
-				    ctx->userdata[COLOR_CH]);
+	append_xfer(rg, xfer);
+	if (K4W2_SUCCESS != k4w2_get_color_jpeg(rg->next->pointer,
+						rg->next->length, NULL, NULL)) {
+	    VERBOSE("skip broken color frame.");
+	    rollback_frame(rg);
+	    resync_xfers(usb, 0);
+	} else {
+	    commit_frame(rg);
+	    if (ctx->callback[COLOR_CH]) {
+		ctx->callback[COLOR_CH](rg->last->pointer, rg->last->length,
+					ctx->userdata[COLOR_CH]);
+	    }
+	    resync_xfers(usb, 1);
 	}
     } else {
 	if (0 == usb->ring[COLOR_CH].next->length) {
@@ -482,12 +869,15 @@ color_cb(struct libusb_transfer *xfer, void *userarg)
 	    if (0x42424242 != frm->magic) {
 		VERBOSE("skip broken color packet.");
 		rollback_frame(rg);
+		resync_xfers(usb, 0);
+		aim_xfer(usb, xfer);
 		return;
 	    }
 	} 
 	/* first or inter packet */
-	append_data(rg, xfer->buffer, xfer->actual_length);
+	append_xfer(rg, xfer);
     }
+    aim_xfer(usb, xfer);
 }
 
 static int
@@ -498,7 +888,14 @@ k4w2_libusb_open(k4w2_t ctx, unsigned int device_id, unsigned int flags)
     int attempt_reset = 1; /* !0 enables attempt_reset workaround */
     int current;
 
-    STRICT( libusb_init(&usb->context) );
+    usb->salvage_depth = (flags & K4W2_SALVAGE_DEPTH)?1:0;
+
+    if (0 < k4w2_num_event_threads) {
+	STRICT( acquire_shared_context(&usb->context) );
+	usb->shared_context = 1;
+    } else {
+	STRICT( libusb_init(&usb->context) );
+    }
     STRICT( open_device(usb, device_id, attempt_reset) );
     if (!usb->dev || !usb->handle)
 	goto exit;
@@ -518,13 +915,12 @@ k4w2_libusb_open(k4w2_t ctx, unsigned int device_id, unsigned int flags)
     }
 
     if (COLOR_ENABLED(ctx)) {
-	const int num_xfers = 16;
 	usb->stream[0] = usb_stream_open(usb->handle,
 					 LIBUSB_TRANSFER_TYPE_BULK,
 					 0x83,
-					 num_xfers,
+					 ctx->options.color_num_xfers,
 					 1,
-					 BULK_SIZE,
+					 ctx->options.color_xfer_size,
 					 color_cb,
 					 ctx);
 	if (!usb->stream[0]) {
@@ -532,8 +928,9 @@ k4w2_libusb_open(k4w2_t ctx, unsigned int device_id, unsigned int flags)
 	    goto exit;
 	}
 
-	if (K4W2_SUCCESS != allocate_ringbuf(&usb->ring[0], NUM_FRAMEBUFFERS,
-					     64*0x4000) ) {
+	if (K4W2_SUCCESS != allocate_ringbuf(&usb->ring[0],
+					     ctx->options.num_framebuffers[COLOR_CH],
+					     COLOR_FRAME_MAX_SIZE) ) {
 	    goto exit;
 	}
     }
@@ -547,14 +944,12 @@ k4w2_libusb_open(k4w2_t ctx, unsigned int device_id, unsigned int flags)
 	    goto exit;
 	}
 	VERBOSE("iso packet size is %d bytes", max_iso_packet_size);
-	const int num_pkts  = 32;
-	const int num_xfers = 8;
 
 	usb->stream[1] = usb_stream_open(usb->handle,
 					 LIBUSB_TRANSFER_TYPE_ISOCHRONOUS,
 					 0x84,
-					 num_xfers,
-					 num_pkts, 
+					 ctx->options.depth_num_xfers,
+					 ctx->options.depth_num_packets,
 					 max_iso_packet_size,
 					 depth_cb,
 					 ctx);
@@ -563,19 +958,25 @@ k4w2_libusb_open(k4w2_t ctx, unsigned int device_id, unsigned int flags)
 	    goto exit;
 	}
 
-    	if (K4W2_SUCCESS != allocate_ringbuf(&usb->ring[1], NUM_FRAMEBUFFERS,
-					     KINECT2_DEPTH_FRAME_SIZE*10)) {
+    	if (K4W2_SUCCESS != allocate_ringbuf(&usb->ring[1],
+					     ctx->options.num_framebuffers[DEPTH_CH],
+					     DEPTH_FRAME_MAX_SIZE)) {
 	    goto exit;
 	}
     }
 
 
-    usb->shutdown = 0;
-    if (THREAD_CREATE(&usb->thread, k4w2_libusb_thread, ctx)) {
-	VERBOSE("THREAD_CREATE() failed.");
-	goto exit;
+    if (!usb->shared_context) {
+	usb->shutdown = 0;
+	if (THREAD_CREATE(&usb->thread, k4w2_libusb_thread, ctx)) {
+	    VERBOSE("THREAD_CREATE() failed.");
+	    goto exit;
+	}
     }
 
+    /* the transfers are submitted with their own buffers */
+    usb->color_cursor = -1;
+    usb->color_resync = 0;
     for (ch = ctx->begin; ch <= ctx->end; ++ch)
 	usb_stream_start(usb->stream[ch]);
 
@@ -597,6 +998,7 @@ k4w2_libusb_start(k4w2_t ctx)
     }
     if (DEPTH_ENABLED(ctx)) {
 	VERBOSE("start depth");
+	usb->depth_started = 1;
 	send_cmd(usb, KCMD_START_DEPTH, NULL, 0, 0);
     }
 
@@ -615,6 +1017,7 @@ k4w2_libusb_stop(k4w2_t ctx)
     if (DEPTH_ENABLED(ctx)) {
 	usb_stream_stop(usb->stream[DEPTH_CH]);
 	send_cmd(usb, KCMD_STOP_DEPTH, NULL, 0, 0);
+	usb->depth_started = 0;
     }
 
     return K4W2_SUCCESS;
@@ -648,9 +1051,22 @@ k4w2_libusb_close(k4w2_t ctx)
 
     if (usb->handle)
 	libusb_close(usb->handle);
+    usb->handle = NULL;
+
+    if (usb->dev)
+	libusb_unref_device(usb->dev);
+    usb->dev = NULL;
+
+    if (usb->context) {
+	if (usb->shared_context)
+	    release_shared_context();
+	else
+	    libusb_exit(usb->context);
+	usb->context = NULL;
+    }
 
-    if (usb->context)
-	libusb_exit(usb->context);
+    for (ch = COLOR_CH; ch <= DEPTH_CH; ++ch)
+	release_ringbuf(&usb->ring[ch]);
     return K4W2_SUCCESS;
 }
 
@@ -683,6 +1099,84 @@ exit:
     return res;
 }
 
+static int
+k4w2_libusb_set_affinity(k4w2_t ctx)
+{
+    k4w2_libusb * usb = (k4w2_libusb *)ctx;
+
+    if (usb->shared_context) {
+	VERBOSE("event threads are shared; see k4w2_set_num_event_threads()");
+	return K4W2_NOT_SUPPORTED;
+    }
+    return k4w2_thread_set_affinity(usb->thread, ctx->cpus, ctx->num_cpus);
+}
+
+static int
+k4w2_libusb_enumerate(struct k4w2_device_info info[], int max_devices)
+{
+    libusb_context *context = NULL;
+    device_list list;
+    int i;
+
+    if (LIBUSB_SUCCESS != libusb_init(&context))
+	return K4W2_ERROR;
+
+    find_kinect2_devices(context, &list);
+    for (i = 0; i < list.num_devs && i < max_devices; ++i) {
+	libusb_device *dev = list.dev[i];
+	struct libusb_device_descriptor desc;
+	libusb_device_handle *handle = NULL;
+	uint8_t path[8];
+	int len, j, n;
+
+	info[i].deviceid = i;
+
+	/* the serial number can be read only if the device can be opened */
+	if (LIBUSB_SUCCESS == libusb_get_device_descriptor(dev, &desc) &&
+	    desc.iSerialNumber &&
+	    LIBUSB_SUCCESS == libusb_open(dev, &handle)) {
+	    if (libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+						   (unsigned char*)info[i].serial,
+						   sizeof(info[i].serial)) < 0)
+		info[i].serial[0] = 0;
+	    libusb_close(handle);
+	}
+
+	n = snprintf(info[i].path, sizeof(info[i].path), "%d",
+		     libusb_get_bus_number(dev));
+	len = libusb_get_port_numbers(dev, path, sizeof(path));
+	for (j = 0; j < len && n < sizeof(info[i].path); ++j) {
+	    n += snprintf(info[i].path + n, sizeof(info[i].path) - n,
+			  (0 == j)?"-%d":".%d", path[j]);
+	}
+    }
+    i = list.num_devs;
+    release_kinect2_devices(&list);
+
+    libusb_exit(context);
+    return i;
+}
+
+static int
+k4w2_libusb_set_depth_buffers(k4w2_t ctx, void *const buffers[],
+			      int num_buffers, int size)
+{
+    k4w2_libusb * usb = (k4w2_libusb *)ctx;
+
+    if (!DEPTH_ENABLED(ctx) || usb->depth_started) {
+	VERBOSE("depth stream is disabled or running");
+	return K4W2_ERROR;
+    }
+    reset_depth_frame(usb);
+    if (!buffers) {
+	release_ringbuf(&usb->ring[DEPTH_CH]);
+	return allocate_ringbuf(&usb->ring[DEPTH_CH],
+				ctx->options.num_framebuffers[DEPTH_CH],
+				DEPTH_FRAME_MAX_SIZE);
+    }
+    return attach_ringbuf(&usb->ring[DEPTH_CH], buffers, num_buffers, size);
+}
+
 static const k4w2_driver_ops ops =
 {
     .open	= k4w2_libusb_open,
@@ -690,6 +1184,9 @@ static const k4w2_driver_ops ops =
     .stop	= k4w2_libusb_stop,
     .close	= k4w2_libusb_close,
     .read_param = k4w2_libusb_read_param,
+    .set_affinity = k4w2_libusb_set_affinity,
+    .enumerate  = k4w2_libusb_enumerate,
+    .set_depth_buffers = k4w2_libusb_set_depth_buffers,
 };
 
 REGISTER_MODULE(k4w2_driver_libusb_init)
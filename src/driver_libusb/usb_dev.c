@@ -47,8 +47,9 @@ usb_foreach_device(libusb_context *usb_context,
 	callback(list[idx], &desc, userdata);
     }
 
-    /* release all devices in list[] */
-    libusb_free_device_list(list, 0);
+    /* release all devices in list[]; callback must take a reference
+     * of the device to keep it */
+    libusb_free_device_list(list, 1);
 }
 
 /*
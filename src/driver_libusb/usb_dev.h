@@ -52,6 +52,9 @@ usb_stream_t usb_stream_open(libusb_device_handle * handle,
 int usb_stream_set_callback(usb_stream_t strm,
 			    usb_stream_callback callback,
 			    void *callback_arg);
+unsigned char *usb_stream_get_buffer(usb_stream_t strm,
+				     const struct libusb_transfer *xfer);
+int usb_stream_get_num_xfers(usb_stream_t strm);
 int usb_stream_start(usb_stream_t strm);
 int usb_stream_stop(usb_stream_t strm);
 int usb_stream_close(usb_stream_t *strm);
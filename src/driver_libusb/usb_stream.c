@@ -50,12 +50,43 @@ struct usb_stream_ctx {
 
 #define CHECK_STREAM_CTX(ctx) do { if (0==(ctx)) return -1; } while(0)
 
+/** 
+ * Returns the buffer allocated for #xfer by usb_stream_open().
+ * Callbacks may point xfer->buffer elsewhere before the transfer is
+ * resubmitted, e.g. to receive data in place; the stream restores this
+ * buffer when the transfer fails.
+ */
+unsigned char *
+usb_stream_get_buffer(usb_stream_t strm, const struct libusb_transfer *xfer)
+{
+    int i;
+    for (i = 0; i < strm->num_xfers; ++i) {
+	if (strm->xfers[i] == xfer)
+	    return strm->buffers + i * strm->num_pkts * strm->pkt_len;
+    }
+    assert(0);
+    return NULL;
+}
+
+int
+usb_stream_get_num_xfers(usb_stream_t strm)
+{
+    CHECK_STREAM_CTX(strm);
+    return strm->num_xfers;
+}
+
 static void
 usbmisc_stream_callback(struct libusb_transfer *xfer)
 {
     usb_stream_t strm = (usb_stream_t)xfer->user_data;
 
     int r;
+
+    /* data of the failed transfer was not consumed; don't let it land
+     * where the callback expected it */
+    if (LIBUSB_TRANSFER_COMPLETED != xfer->status)
+	xfer->buffer = usb_stream_get_buffer(strm, xfer);
+
     switch(xfer->status) {
     case LIBUSB_TRANSFER_COMPLETED: /* Normal operation. */
 	if (strm->callback)
@@ -20,7 +20,7 @@
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 
-#include <poll.h>
+#include <sys/epoll.h>
 
 #include <string.h> /* strerror() */
 #include <linux/videodev2.h>
@@ -34,12 +34,23 @@
 typedef struct {
      void   *start;
      size_t  length;
+     int     dmabuf;    /* fd exported by VIDIOC_EXPBUF, or -1 */
+     unsigned held:1;   /* passed to the callback, and not yet requeued */
 } Buffer;
 
 typedef struct {
      int              fd;
      Buffer          *buf;
      unsigned int     num_bufs;
+     enum v4l2_memory memory;   /* V4L2_MEMORY_MMAP or V4L2_MEMORY_USERPTR */
+     unsigned char  **pool;     /* buffers of V4L2_MEMORY_USERPTR */
+     k4w2_t           ctx;
+     CHANNEL          ch;
+     int              error;    /* errno of the failure of the stream, or 0 */
+     unsigned         hold:1;   /* K4W2_HOLD_BUFFERS */
+     unsigned         streaming:1;
+     unsigned int     num_held;
+     MUTEX_T          mutex;    /* guards the members above and buf[].held */
 } Camera;
 
 static int open_camera(Camera *cam, const char *dev_name)
@@ -78,14 +89,36 @@ static int xioctl(int fh, int request, void *arg)
 }
 
 
-static int read_frame(Camera *cam, k4w2_callback_t callback, void *userdata)
+static int queue_buffer(Camera *cam, unsigned int index)
 {
     struct v4l2_buffer buf;
 
+    CLEAR(buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = cam->memory;
+    buf.index = index;
+    if (V4L2_MEMORY_USERPTR == cam->memory) {
+	buf.m.userptr = (unsigned long)cam->buf[index].start;
+	buf.length = cam->buf[index].length;
+    }
+    return xioctl(cam->fd, VIDIOC_QBUF, &buf);
+}
+
+/**
+ * Dequeues a frame and passes it to the callback of the channel.
+ *
+ * @return 1 if a frame was read, 0 if no frame was ready, or -1 if the
+ *         stream failed; cam->error holds the errno.
+ */
+static int read_frame(Camera *cam)
+{
+    struct v4l2_buffer buf;
+    k4w2_callback_t callback;
+
     CLEAR(buf);
 
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
+    buf.memory = cam->memory;
 
     if (-1 == xioctl(cam->fd, VIDIOC_DQBUF, &buf)) {
 	switch (errno) {
@@ -93,33 +126,66 @@ static int read_frame(Camera *cam, k4w2_callback_t callback, void *userdata)
 	    return 0;
 
 	case EIO:
-	    /* Could ignore EIO, see spec. */
-
-	    /* fall through */
+	    /* temporary problems such as signal loss; see the spec. */
+	    VERBOSE("VIDIOC_DQBUF; %s", strerror(errno));
+	    return 0;
 
 	default:
-	    ABORT("VIDIOC_DQBUF");
+	    cam->error = errno;
+	    VERBOSE("VIDIOC_DQBUF failed; %s", strerror(errno));
+	    return -1;
 	}
     }
 
     assert(buf.index < cam->num_bufs);
 
-    if (callback)
-	callback(cam->buf[buf.index].start, buf.bytesused, userdata);
+    callback = cam->ctx->callback[cam->ch];
+    if (callback && cam->hold) {
+	/* keep one buffer queued; the stream stalls if none is */
+	int held = 0;
+	MUTEX_LOCK(&cam->mutex);
+	if (cam->num_held + 1 < cam->num_bufs) {
+	    cam->buf[buf.index].held = 1;
+	    ++cam->num_held;
+	    held = 1;
+	}
+	MUTEX_UNLOCK(&cam->mutex);
+	if (held) {
+	    callback(cam->buf[buf.index].start, buf.bytesused,
+		     cam->ctx->userdata[cam->ch]);
+	    return 1;
+	}
+	VERBOSE("all buffers are held; a frame is dropped");
+    } else if (callback) {
+	callback(cam->buf[buf.index].start, buf.bytesused,
+		 cam->ctx->userdata[cam->ch]);
+    }
 
-    if (-1 == xioctl(cam->fd, VIDIOC_QBUF, &buf))
-	ABORT("VIDIOC_QBUF");
+    if (-1 == xioctl(cam->fd, VIDIOC_QBUF, &buf)) {
+	cam->error = errno;
+	VERBOSE("VIDIOC_QBUF failed; %s", strerror(errno));
+	return -1;
+    }
 
     return 1;
 }
 
-static void stop_camera(Camera *cam)
+static int stop_camera(Camera *cam)
 {
     enum v4l2_buf_type type;
 
+    int res = K4W2_SUCCESS;
+
+    /* STREAMOFF returns all buffers, including the held ones */
+    MUTEX_LOCK(&cam->mutex);
     type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (-1 == xioctl(cam->fd, VIDIOC_STREAMOFF, &type))
-	ABORT("VIDIOC_STREAMOFF");
+    if (-1 == xioctl(cam->fd, VIDIOC_STREAMOFF, &type)) {
+	VERBOSE("VIDIOC_STREAMOFF failed; %s", strerror(errno));
+	res = K4W2_ERROR;
+    }
+    cam->streaming = 0;
+    MUTEX_UNLOCK(&cam->mutex);
+    return res;
 }
 
 static int start_camera(Camera *cam)
@@ -127,36 +193,48 @@ static int start_camera(Camera *cam)
     unsigned int i;
     enum v4l2_buf_type type;
 
-    for (i = 0; i < cam->num_bufs; ++i) {
-	struct v4l2_buffer buf;
-
-	CLEAR(buf);
-	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf.memory = V4L2_MEMORY_MMAP;
-	buf.index = i;
+    MUTEX_LOCK(&cam->mutex);
+    for (i = 0; i < cam->num_bufs; ++i)
+	cam->buf[i].held = 0;
+    cam->num_held = 0;
+    MUTEX_UNLOCK(&cam->mutex);
 
-	if (-1 == xioctl(cam->fd, VIDIOC_QBUF, &buf)) {
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for (i = 0; i < cam->num_bufs; ++i) {
+	if (-1 == queue_buffer(cam, i)) {
 	    VERBOSE("VIDIOC_QBUF");
-	    return K4W2_ERROR;
+	    goto err;
 	}
     }
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     if (-1 == xioctl(cam->fd, VIDIOC_STREAMON, &type)) {
 	VERBOSE("VIDIOC_STREAMON");
-	return K4W2_ERROR;
+	goto err;
     }
+    cam->streaming = 1;
     return K4W2_SUCCESS;
+err:
+    /* returns the buffers queued so far */
+    xioctl(cam->fd, VIDIOC_STREAMOFF, &type);
+    return K4W2_ERROR;
 }
 
 static void unmap_camera(Camera *cam)
 {
+    if (cam->pool) {
+	free_bufs(cam->pool);
+	cam->pool = NULL;
+	free(cam->buf);
+	cam->buf = NULL;
+    }
     if (cam->buf) {
 	unsigned int i;
 	for (i = 0; i < cam->num_bufs; ++i) {
+	    if (0 <= cam->buf[i].dmabuf)
+		close(cam->buf[i].dmabuf);
 	    if (MAP_FAILED == cam->buf[i].start)
 		continue;
 	    if (-1 == munmap(cam->buf[i].start, cam->buf[i].length))
-		ABORT("munmap");
+		VERBOSE("munmap failed; %s", strerror(errno));
 	}
 	free(cam->buf);
 	cam->buf = NULL;
@@ -173,7 +251,7 @@ static int mmap_camera(Camera *cam, int num_buf)
 
     req.count = cam->num_bufs = num_buf;
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+    req.memory = cam->memory = V4L2_MEMORY_MMAP;
 
     if (-1 == xioctl(cam->fd, VIDIOC_REQBUFS, &req)) {
 	VERBOSE("ioctl(VIDIOC_REQBUFS) failed");
@@ -194,6 +272,7 @@ static int mmap_camera(Camera *cam, int num_buf)
 
     for (i = 0; i < cam->num_bufs; ++i) {
 	cam->buf[i].start = MAP_FAILED;
+	cam->buf[i].dmabuf = -1;
     }
      
     for (i = 0; i < cam->num_bufs; ++i) {
@@ -229,6 +308,65 @@ err:
     return K4W2_ERROR;
 }
 
+/**
+ * Prepares #num_buf buffers of the library for V4L2_MEMORY_USERPTR.
+ * The buffers are big enough for the largest frame of the channel, and
+ * are allocated by k4w2_alloc() as one page-aligned block.
+ */
+static int userptr_camera(Camera *cam, int num_buf, size_t max_frame_size)
+{
+    unsigned int i;
+    struct v4l2_requestbuffers req;
+    struct v4l2_format fmt;
+    size_t size = max_frame_size;
+
+    CLEAR(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (0 == xioctl(cam->fd, VIDIOC_G_FMT, &fmt) &&
+	size < fmt.fmt.pix.sizeimage)
+	size = fmt.fmt.pix.sizeimage;
+    size = (size + 4095) & ~(size_t)4095;
+
+    CLEAR(req);
+    req.count = num_buf;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_USERPTR;
+
+    if (-1 == xioctl(cam->fd, VIDIOC_REQBUFS, &req)) {
+	VERBOSE("V4L2_MEMORY_USERPTR is not supported; %s", strerror(errno));
+	return K4W2_ERROR;
+    }
+    if (req.count < 2) {
+	VERBOSE("Insufficient buffer memory");
+	goto err;
+    }
+
+    cam->memory = V4L2_MEMORY_USERPTR;
+    cam->num_bufs = req.count;
+    cam->buf = (Buffer*)calloc(req.count, sizeof(*cam->buf));
+    cam->pool = allocate_bufs(req.count, size);
+    if (!cam->buf || !cam->pool) {
+	VERBOSE("Out of memory");
+	goto err;
+    }
+    for (i = 0; i < cam->num_bufs; ++i) {
+	cam->buf[i].start = cam->pool[i];
+	cam->buf[i].length = size;
+	cam->buf[i].dmabuf = -1;
+    }
+    return K4W2_SUCCESS;
+
+err:
+    free(cam->buf);
+    cam->buf = NULL;
+    free_bufs(cam->pool);
+    cam->pool = NULL;
+    /* release the queue, so that V4L2_MEMORY_MMAP can be tried */
+    req.count = 0;
+    xioctl(cam->fd, VIDIOC_REQBUFS, &req);
+    return K4W2_ERROR;
+}
+
 static void close_camera(Camera *cam)
 {
     unmap_camera(cam);
@@ -237,11 +375,321 @@ static void close_camera(Camera *cam)
     cam->fd = -1;
 }
 
+#define MAX_VIDEO_NODES 64
+
+/* a pair of video nodes created by gspca/kinect2 for a sensor */
+typedef struct {
+    int node[2];        /* N of /dev/videoN; 0:color, 1:depth */
+    char bus_info[32];  /* v4l2_capability.bus_info */
+    int busnum;         /* USB bus number */
+    int port[8];        /* port path, e.g. {1, 3} for "...-1.3" */
+    int num_ports;
+} Sensor;
+
+/* orders sensors by their bus number and port path, as libusb does */
+static int compare_topology(const void *a, const void *b)
+{
+    const Sensor *sa = (const Sensor*)a;
+    const Sensor *sb = (const Sensor*)b;
+    int i;
+
+    if (sa->busnum != sb->busnum)
+	return sa->busnum - sb->busnum;
+    for (i = 0; i < sa->num_ports && i < sb->num_ports; ++i) {
+	if (sa->port[i] != sb->port[i])
+	    return sa->port[i] - sb->port[i];
+    }
+    return sa->num_ports - sb->num_ports;
+}
+
+static void read_sysfs(const char *filename, char *buf, size_t size);
+
+/* fills the bus number and port path of #sensor found at /dev/video#node */
+static void parse_topology(Sensor *sensor, int node)
+{
+    char filename[FILENAME_MAX];
+    char buf[32];
+    const char *p;
+
+    snprintf(filename, sizeof(filename),
+	     "/sys/class/video4linux/video%d/device/../busnum", node);
+    read_sysfs(filename, buf, sizeof(buf));
+    sensor->busnum = atoi(buf);
+
+    /* bus_info is "usb-<controller>-<port path>" */
+    sensor->num_ports = 0;
+    p = strrchr(sensor->bus_info, '-');
+    while (p && sensor->num_ports < (int)ARRAY_SIZE(sensor->port)) {
+	sensor->port[sensor->num_ports++] = atoi(p + 1);
+	p = strchr(p + 1, '.');
+    }
+}
+
+/**
+ * Lists the sensors handled by gspca/kinect2, ordered by their USB
+ * topology. Video nodes are paired by bus_info; the lower-numbered node
+ * is color.
+ *
+ * @return the number of sensors stored in sensor[]
+ */
+static int find_sensors(Sensor sensor[], int max_sensors)
+{
+    int num = 0;
+    int i, j;
+
+    for (i = 0; i < MAX_VIDEO_NODES; ++i) {
+	char devfile[FILENAME_MAX];
+	struct v4l2_capability cap;
+	int fd, r;
+
+	snprintf(devfile, sizeof(devfile), "/dev/video%d", i);
+	fd = open(devfile, O_RDWR | O_NONBLOCK, 0);
+	if (-1 == fd)
+	    continue;
+	CLEAR(cap);
+	r = xioctl(fd, VIDIOC_QUERYCAP, &cap);
+	close(fd);
+	if (-1 == r || strcmp((const char*)cap.driver, "kinect2"))
+	    continue;
+
+	for (j = 0; j < num; ++j) {
+	    if (0 == strcmp(sensor[j].bus_info, (const char*)cap.bus_info))
+		break;
+	}
+	if (j < num) {
+	    if (sensor[j].node[1] < 0)
+		sensor[j].node[1] = i;
+	} else if (num < max_sensors) {
+	    snprintf(sensor[num].bus_info, sizeof(sensor[num].bus_info),
+		     "%s", (const char*)cap.bus_info);
+	    sensor[num].node[0] = i;
+	    sensor[num].node[1] = -1;
+	    parse_topology(&sensor[num], i);
+	    ++num;
+	}
+    }
+    qsort(sensor, num, sizeof(sensor[0]), compare_topology);
+    return num;
+}
+
+/* reads the first line of a sysfs file */
+static void read_sysfs(const char *filename, char *buf, size_t size)
+{
+    FILE *fp = fopen(filename, "r");
+    buf[0] = 0;
+    if (!fp)
+	return;
+    if (fgets(buf, size, fp))
+	buf[strcspn(buf, "\n")] = 0;
+    fclose(fp);
+}
+
+static int k4w2_v4l2_enumerate(struct k4w2_device_info info[], int max_devices)
+{
+    Sensor sensor[MAX_VIDEO_NODES/2];
+    const int num = find_sensors(sensor, ARRAY_SIZE(sensor));
+    int i;
+
+    for (i = 0; i < num && i < max_devices; ++i) {
+	char filename[FILENAME_MAX];
+	char link[FILENAME_MAX];
+	ssize_t len;
+
+	info[i].deviceid = i;
+
+	snprintf(filename, sizeof(filename),
+		 "/sys/class/video4linux/video%d/device/../serial",
+		 sensor[i].node[0]);
+	read_sysfs(filename, info[i].serial, sizeof(info[i].serial));
+
+	/* "device" links to the usb interface, e.g. ".../2-1.3:1.0" */
+	snprintf(filename, sizeof(filename),
+		 "/sys/class/video4linux/video%d/device", sensor[i].node[0]);
+	len = readlink(filename, link, sizeof(link) - 1);
+	if (0 < len) {
+	    char *p;
+	    link[len] = 0;
+	    p = strrchr(link, '/');
+	    p = (p)?p + 1:link;
+	    p[strcspn(p, ":")] = 0;
+	    strncpy(info[i].path, p, sizeof(info[i].path) - 1);
+	}
+    }
+    return num;
+}
+
+/*
+ * An event loop waits on the video nodes of one or more sensors with
+ * epoll, and dispatches frames to their callbacks in a single thread.
+ * Each device runs its own loop by default; see
+ * k4w2_set_num_event_threads() for sharing one loop among all devices.
+ *
+ * Cameras are registered in slots, and epoll reports the slot number
+ * rather than the camera itself; a stale event of a camera which has
+ * been removed meanwhile finds an empty slot under the lock.
+ */
+typedef struct {
+    int epfd;
+    THREAD_T thread;
+    volatile unsigned shutdown:1;
+    MUTEX_T mutex;	/* guards cam[] and dispatching */
+    Camera *cam[MAX_VIDEO_NODES];
+    int refcount;	/* used by the shared loop only */
+} EventLoop;
+
+static void *
+event_loop_thread(void *arg)
+{
+    EventLoop *loop = (EventLoop *)arg;
+    struct epoll_event ev[MAX_VIDEO_NODES];
+
+    while (!loop->shutdown) {
+	int i;
+	const int r = epoll_wait(loop->epfd, ev, ARRAY_SIZE(ev), 1000);
+	if (-1 == r) {
+	    if (EINTR == errno)
+		continue;
+	    VERBOSE("epoll_wait() failed; %s", strerror(errno));
+	    break;
+	}
+	if (0 == r) {
+	    VERBOSE("epoll_wait() timeout");
+	    continue;
+	}
+
+	MUTEX_LOCK(&loop->mutex);
+	for (i = 0; i < r; ++i) {
+	    const unsigned slot = ev[i].data.u32;
+	    Camera *cam = loop->cam[slot];
+	    if (!cam)
+		continue;
+	    if (ev[i].events & (EPOLLERR|EPOLLHUP) && !(ev[i].events & EPOLLIN)) {
+		cam->error = EIO;
+		VERBOSE("the stream of fd %d was disconnected", cam->fd);
+	    } else if (0 <= read_frame(cam)) {
+		continue;
+	    }
+	    /* stop watching the failed stream; k4w2_stop() reports it */
+	    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, cam->fd, NULL);
+	    loop->cam[slot] = NULL;
+	}
+	MUTEX_UNLOCK(&loop->mutex);
+    }
+    return 0;
+}
+
+static int
+event_loop_open(EventLoop *loop)
+{
+    memset(loop->cam, 0, sizeof(loop->cam));
+    loop->shutdown = 0;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == loop->epfd) {
+	VERBOSE("epoll_create1() failed; %s", strerror(errno));
+	return K4W2_ERROR;
+    }
+    MUTEX_INIT(&loop->mutex);
+    if (THREAD_CREATE(&loop->thread, event_loop_thread, loop)) {
+	VERBOSE("THREAD_CREATE() failed.");
+	MUTEX_DESTROY(&loop->mutex);
+	close(loop->epfd);
+	loop->epfd = -1;
+	return K4W2_ERROR;
+    }
+    return K4W2_SUCCESS;
+}
+
+static void
+event_loop_close(EventLoop *loop)
+{
+    loop->shutdown = 1;
+    THREAD_JOIN(loop->thread);
+    MUTEX_DESTROY(&loop->mutex);
+    close(loop->epfd);
+    loop->epfd = -1;
+}
+
+static int
+event_loop_add(EventLoop *loop, Camera *cam)
+{
+    struct epoll_event ev;
+    unsigned slot;
+    int res = K4W2_ERROR;
+
+    MUTEX_LOCK(&loop->mutex);
+    for (slot = 0; slot < ARRAY_SIZE(loop->cam); ++slot) {
+	if (!loop->cam[slot])
+	    break;
+    }
+    if (ARRAY_SIZE(loop->cam) <= slot) {
+	VERBOSE("too many streams in the event loop");
+	goto exit;
+    }
+
+    CLEAR(ev);
+    ev.events = EPOLLIN;
+    ev.data.u32 = slot;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, cam->fd, &ev)) {
+	VERBOSE("epoll_ctl() failed; %s", strerror(errno));
+	goto exit;
+    }
+    loop->cam[slot] = cam;
+    res = K4W2_SUCCESS;
+exit:
+    MUTEX_UNLOCK(&loop->mutex);
+    return res;
+}
+
+/* once this returns, the loop never touches #cam */
+static void
+event_loop_remove(EventLoop *loop, Camera *cam)
+{
+    unsigned slot;
+
+    MUTEX_LOCK(&loop->mutex);
+    for (slot = 0; slot < ARRAY_SIZE(loop->cam); ++slot) {
+	if (loop->cam[slot] == cam) {
+	    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, cam->fd, NULL);
+	    loop->cam[slot] = NULL;
+	}
+    }
+    MUTEX_UNLOCK(&loop->mutex);
+}
+
+static EventLoop shared_loop;
+static MUTEX_T shared_loop_mutex = MUTEX_INITIALIZER;
+
+static EventLoop *
+acquire_shared_loop(void)
+{
+    EventLoop *loop = &shared_loop;
+
+    MUTEX_LOCK(&shared_loop_mutex);
+    if (0 == shared_loop.refcount &&
+	K4W2_SUCCESS != event_loop_open(&shared_loop)) {
+	loop = NULL;
+    } else {
+	++shared_loop.refcount;
+    }
+    MUTEX_UNLOCK(&shared_loop_mutex);
+    return loop;
+}
+
+static void
+release_shared_loop(void)
+{
+    MUTEX_LOCK(&shared_loop_mutex);
+    assert(0 < shared_loop.refcount);
+    if (0 == --shared_loop.refcount)
+	event_loop_close(&shared_loop);
+    MUTEX_UNLOCK(&shared_loop_mutex);
+}
+
 typedef struct {
      struct k4w2_driver_ctx k4w2; /* !! must be the first item */
      Camera cam[2];
-     THREAD_T thread;
-     volatile unsigned shutdown:1;
+     EventLoop own_loop;
+     EventLoop *loop;    /* &own_loop, &shared_loop, or NULL if stopped */
 } k4w2_v4l2;
 
 static int
@@ -250,16 +698,32 @@ k4w2_v4l2_open(k4w2_t ctx, unsigned int deviceid, unsigned int flags)
     k4w2_v4l2 * v4l2 = (k4w2_v4l2 *)ctx;
     CHANNEL ch;
     int res = K4W2_ERROR;
+    Sensor sensor[MAX_VIDEO_NODES/2];
+    const int num = find_sensors(sensor, ARRAY_SIZE(sensor));
 
     for (ch = COLOR_CH; ch <= DEPTH_CH; ++ch) {
 	v4l2->cam[ch].fd = -1;
+	v4l2->cam[ch].ctx = ctx;
+	v4l2->cam[ch].ch = ch;
+	v4l2->cam[ch].hold = (flags & K4W2_HOLD_BUFFERS)?1:0;
+	MUTEX_INIT(&v4l2->cam[ch].mutex);
     }
 
     for (ch = ctx->begin; ch <= ctx->end; ++ch) {
 
 	char devfile[FILENAME_MAX];
-	snprintf(devfile, sizeof(devfile), "/dev/video%d",
-		 deviceid*2 + ch);
+	if (0 == num) {
+	    /* no sensor reported itself; assume the default numbering */
+	    snprintf(devfile, sizeof(devfile), "/dev/video%d",
+		     deviceid*2 + ch);
+	} else if (deviceid < num && 0 <= sensor[deviceid].node[ch]) {
+	    snprintf(devfile, sizeof(devfile), "/dev/video%d",
+		     sensor[deviceid].node[ch]);
+	} else {
+	    VERBOSE("kinect2 #%u not found; %d sensor(s) found.", deviceid, num);
+	    res = K4W2_ERROR;
+	    break;
+	}
 
 	res = open_camera(&v4l2->cam[ch], devfile);
 	if (K4W2_SUCCESS != res) {
@@ -267,7 +731,14 @@ k4w2_v4l2_open(k4w2_t ctx, unsigned int deviceid, unsigned int flags)
 	    break;
 	}
 
-	res = mmap_camera(&v4l2->cam[ch], 8);
+	if (ctx->options.v4l2_userptr &&
+	    K4W2_SUCCESS == userptr_camera(&v4l2->cam[ch],
+					   ctx->options.num_v4l2_buffers,
+					   (COLOR_CH == ch)?
+					   COLOR_FRAME_MAX_SIZE:DEPTH_FRAME_MAX_SIZE))
+	    continue;
+
+	res = mmap_camera(&v4l2->cam[ch], ctx->options.num_v4l2_buffers);
 	if (K4W2_SUCCESS != res) {
 	    VERBOSE("mmap_camera(%d) failed", ch);
 	    break;
@@ -277,42 +748,14 @@ k4w2_v4l2_open(k4w2_t ctx, unsigned int deviceid, unsigned int flags)
     return res;
 }
 
-static void *
-k4w2_v4l2_thread_loop(void *arg)
+static void
+release_loop(k4w2_v4l2 *v4l2)
 {
-    k4w2_v4l2 * v4l2 = (k4w2_v4l2*) arg;
-    k4w2_t ctx = (k4w2_t) arg;
-    const int num_fds = ctx->end - ctx->begin + 1;
-    struct pollfd fds[2];
-    CHANNEL ch;
-    for (ch = ctx->begin; ch <= ctx->end; ++ch) {
-	fds[ch].fd = v4l2->cam[ch].fd;
-    }
-    assert(num_fds == 2 || num_fds == 1);
-
-    while (!v4l2->shutdown) {
-	int r;
-	for (ch = ctx->begin; ch <= ctx->end; ++ch) {
-	    fds[ch].events = POLLIN;
-	}
-
-	r = poll(&fds[ctx->begin], num_fds, 1000);
-	switch (r) {
-	case -1:
-	    VERBOSE("select failed");
-	    break;
-	case 0:
-	    VERBOSE("select timeout");
-	    break;
-	}
-	for (ch = ctx->begin; ch <= ctx->end; ++ch) {
-	    if (fds[ch].revents)
-		read_frame(&v4l2->cam[ch],
-			   ctx->callback[ch],
-			   ctx->userdata[ch]);
-	}
-    }
-    return 0;
+    if (v4l2->loop == &shared_loop)
+	release_shared_loop();
+    else
+	event_loop_close(v4l2->loop);
+    v4l2->loop = NULL;
 }
 
 static int
@@ -321,38 +764,75 @@ k4w2_v4l2_start(k4w2_t ctx)
     k4w2_v4l2 * v4l2 = (k4w2_v4l2 *)ctx;
     CHANNEL ch;
 
-    if (v4l2->thread)
+    if (v4l2->loop)
 	return K4W2_ERROR;
 
-    v4l2->shutdown = 0;
-    if (THREAD_CREATE(&v4l2->thread, k4w2_v4l2_thread_loop, ctx)) {
-	VERBOSE("THREAD_CREATE() failed.");
-	return K4W2_ERROR;
+    if (0 < k4w2_num_event_threads) {
+	v4l2->loop = acquire_shared_loop();
+	if (!v4l2->loop)
+	    return K4W2_ERROR;
+    } else {
+	if (K4W2_SUCCESS != event_loop_open(&v4l2->own_loop))
+	    return K4W2_ERROR;
+	v4l2->loop = &v4l2->own_loop;
+	if (ctx->num_cpus)
+	    k4w2_thread_set_affinity(v4l2->loop->thread,
+				     ctx->cpus, ctx->num_cpus);
     }
 
     for (ch = ctx->begin; ch <= ctx->end; ++ch) {
-	start_camera(&v4l2->cam[ch]);
+	Camera *cam = &v4l2->cam[ch];
+	cam->error = 0;
+	if (K4W2_SUCCESS != start_camera(cam)) {
+	    VERBOSE("failed to start channel %d", ch);
+	    goto err;
+	}
+	if (K4W2_SUCCESS != event_loop_add(v4l2->loop, cam)) {
+	    VERBOSE("failed to watch channel %d", ch);
+	    stop_camera(cam);
+	    goto err;
+	}
     }
     return K4W2_SUCCESS;
+
+err:
+    /* the channels before #ch are running */
+    while (ch-- > ctx->begin) {
+	event_loop_remove(v4l2->loop, &v4l2->cam[ch]);
+	stop_camera(&v4l2->cam[ch]);
+    }
+    release_loop(v4l2);
+    return K4W2_ERROR;
 }
 
+/**
+ * @return K4W2_ERROR if any stream has failed while running
+ */
 static int
 k4w2_v4l2_stop(k4w2_t ctx)
 {
     k4w2_v4l2 * v4l2 = (k4w2_v4l2 *)ctx;
     CHANNEL ch;
+    int res = K4W2_SUCCESS;
 
-    if (0== v4l2->thread)
+    if (!v4l2->loop)
 	return K4W2_ERROR;
 
-    v4l2->shutdown = 1;
-    THREAD_JOIN(v4l2->thread);
-    v4l2->thread = 0;
+    for (ch = ctx->begin; ch <= ctx->end; ++ch) {
+	event_loop_remove(v4l2->loop, &v4l2->cam[ch]);
+    }
+    release_loop(v4l2);
 
     for (ch = ctx->begin; ch <= ctx->end; ++ch) {
-	stop_camera(&v4l2->cam[ch]);
+	Camera *cam = &v4l2->cam[ch];
+	if (cam->error) {
+	    VERBOSE("channel %d had stopped; %s", ch, strerror(cam->error));
+	    res = K4W2_ERROR;
+	}
+	if (K4W2_SUCCESS != stop_camera(cam))
+	    res = K4W2_ERROR;
     }
-    return K4W2_SUCCESS;
+    return res;
 }
 
 static int
@@ -361,14 +841,120 @@ k4w2_v4l2_close(k4w2_t ctx)
     k4w2_v4l2 * v4l2 = (k4w2_v4l2 *)ctx;
     CHANNEL ch;
 
-    k4w2_v4l2_stop(ctx);
+    if (v4l2->loop)
+	k4w2_v4l2_stop(ctx);
     
     for (ch = ctx->begin; ch <= ctx->end; ++ch) {
 	close_camera(&v4l2->cam[ch]);
     }
+    for (ch = COLOR_CH; ch <= DEPTH_CH; ++ch) {
+	MUTEX_DESTROY(&v4l2->cam[ch].mutex);
+    }
     return K4W2_SUCCESS;
 }
 
+static int
+k4w2_v4l2_set_affinity(k4w2_t ctx)
+{
+    k4w2_v4l2 * v4l2 = (k4w2_v4l2 *)ctx;
+
+    /* the affinity will be applied in k4w2_v4l2_start() */
+    if (!v4l2->loop)
+	return K4W2_SUCCESS;
+
+    /* the shared loop serves other devices as well */
+    if (v4l2->loop == &shared_loop)
+	return K4W2_NOT_SUPPORTED;
+
+    return k4w2_thread_set_affinity(v4l2->loop->thread,
+				    ctx->cpus, ctx->num_cpus);
+}
+
+/* finds the camera and the index of the buffer starting at #ptr */
+static Camera *
+find_buffer(k4w2_t ctx, const void *ptr, unsigned int *index)
+{
+    k4w2_v4l2 * v4l2 = (k4w2_v4l2 *)ctx;
+    CHANNEL ch;
+
+    for (ch = ctx->begin; ch <= ctx->end; ++ch) {
+	Camera *cam = &v4l2->cam[ch];
+	unsigned int i;
+	if (!cam->buf)
+	    continue;
+	for (i = 0; i < cam->num_bufs; ++i) {
+	    if (cam->buf[i].start == ptr) {
+		*index = i;
+		return cam;
+	    }
+	}
+    }
+    VERBOSE("%p is not a buffer of this device", ptr);
+    return NULL;
+}
+
+static int
+k4w2_v4l2_release_buffer(k4w2_t ctx, const void *buffer)
+{
+    unsigned int index;
+    Camera *cam = find_buffer(ctx, buffer, &index);
+    int res = K4W2_SUCCESS;
+
+    if (!cam)
+	return K4W2_ERROR;
+
+    MUTEX_LOCK(&cam->mutex);
+    if (!cam->buf[index].held) {
+	VERBOSE("buffer %u is not held", index);
+	res = K4W2_ERROR;
+    } else {
+	cam->buf[index].held = 0;
+	--cam->num_held;
+	/* stopped streams get all buffers back on start */
+	if (cam->streaming && -1 == queue_buffer(cam, index)) {
+	    VERBOSE("VIDIOC_QBUF failed; %s", strerror(errno));
+	    res = K4W2_ERROR;
+	}
+    }
+    MUTEX_UNLOCK(&cam->mutex);
+    return res;
+}
+
+static int
+k4w2_v4l2_export_buffer(k4w2_t ctx, const void *buffer)
+{
+    unsigned int index;
+    Camera *cam = find_buffer(ctx, buffer, &index);
+    int res;
+
+    if (!cam)
+	return K4W2_ERROR;
+
+    /* buffers of the library are not backed by dmabufs */
+    if (V4L2_MEMORY_MMAP != cam->memory)
+	return K4W2_NOT_SUPPORTED;
+
+    MUTEX_LOCK(&cam->mutex);
+    if (cam->buf[index].dmabuf < 0) {
+	struct v4l2_exportbuffer exp;
+	CLEAR(exp);
+	exp.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	exp.index = index;
+	exp.flags = O_RDONLY | O_CLOEXEC;
+	if (-1 == xioctl(cam->fd, VIDIOC_EXPBUF, &exp)) {
+	    VERBOSE("VIDIOC_EXPBUF failed; %s", strerror(errno));
+	    res = (ENOTTY == errno || EINVAL == errno)?
+		K4W2_NOT_SUPPORTED:K4W2_ERROR;
+	    goto exit;
+	}
+	cam->buf[index].dmabuf = exp.fd;
+    }
+    res = cam->buf[index].dmabuf;
+exit:
+    MUTEX_UNLOCK(&cam->mutex);
+    return res;
+}
+
 static int
 k4w2_v4l2_read_param(k4w2_t ctx, PARAM_ID id, void *param, int length)
 {
@@ -405,6 +991,10 @@ static const k4w2_driver_ops ops =
     .stop	= k4w2_v4l2_stop,
     .close	= k4w2_v4l2_close,
     .read_param = k4w2_v4l2_read_param,
+    .set_affinity = k4w2_v4l2_set_affinity,
+    .enumerate  = k4w2_v4l2_enumerate,
+    .release_buffer = k4w2_v4l2_release_buffer,
+    .export_buffer  = k4w2_v4l2_export_buffer,
 };
 
 REGISTER_MODULE(k4w2_driver_v4l2_init)
@@ -139,17 +139,23 @@ k4w2_create_xz_table(const struct kinect2_depth_camera_param *p,
     const double scaling_factor = 8192;
     const double unambigious_dist = 6250.0/3;
     size_t divergence = 0;
-    size_t i;
-    for (i = 0; i < 512*424; i++)
+    int yi;
+    /* undistort() needs double precision to converge */
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:divergence) schedule(dynamic, 8)
+#endif
+    for (yi = 0; yi < 424; yi++)
     {
-	size_t xi = i % 512;
-	size_t yi = i / 512;
-	double xd = (xi + 0.5 - p->cx)/p->fx;
-	double yd = (yi + 0.5 - p->cy)/p->fy;
-	double xu, yu;
-	divergence += !undistort(p, xd, yd, &xu, &yu);
-	xtable[i] = scaling_factor*xu;
-	ztable[i] = unambigious_dist/sqrt(xu*xu + yu*yu + 1);
+	int xi;
+	for (xi = 0; xi < 512; xi++) {
+	    const size_t i = yi*512 + xi;
+	    double xd = (xi + 0.5 - p->cx)/p->fx;
+	    double yd = (yi + 0.5 - p->cy)/p->fy;
+	    double xu, yu;
+	    divergence += !undistort(p, xd, yd, &xu, &yu);
+	    xtable[i] = scaling_factor*xu;
+	    ztable[i] = unambigious_dist/sqrt(xu*xu + yu*yu + 1);
+	}
     }
     if (divergence > 0) {
 	VERBOSE("%zd pixels in x/ztable have incorrect undistortion.", divergence);
@@ -158,6 +164,47 @@ k4w2_create_xz_table(const struct kinect2_depth_camera_param *p,
     return K4W2_SUCCESS;
 }
 
+/**
+ * Creates the table of cos() and sin() of the phases of one modulation
+ * frequency, which is used by the CPU depth decoder.
+ *
+ * @param phase_in_rad  phase offsets of the three measurements
+ * @param p0table       one of the P0 tables of struct kinect2_p0table
+ * @param trig_table    cos of the three phases followed by -sin of them
+ *
+ * @return K4W2_SUCCESS
+ */
+int
+k4w2_create_trig_table(const float phase_in_rad[3], const uint16_t *p0table,
+		       float trig_table[512*424][6])
+{
+    int y;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (y=0;y<424;++y) {
+	int x;
+	for (x=0;x<512;++x) {
+	    float p0 = -0.000031 * M_PI * p0table[(423-y)*512 + x];
+	    int i = y*512 + x;
+
+	    float tmp0 = p0 + phase_in_rad[0];
+	    float tmp1 = p0 + phase_in_rad[1];
+	    float tmp2 = p0 + phase_in_rad[2];
+
+	    /* the arguments are float, so float versions are accurate enough */
+	    trig_table[i][0] = cosf(tmp0);
+	    trig_table[i][1] = cosf(tmp1);
+	    trig_table[i][2] = cosf(tmp2);
+
+	    trig_table[i][3] = sinf(-tmp0);
+	    trig_table[i][4] = sinf(-tmp1);
+	    trig_table[i][5] = sinf(-tmp2);
+	}
+    }
+    return K4W2_SUCCESS;
+}
+
 /*
  * Local Variables:
  * mode: c
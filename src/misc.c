@@ -8,10 +8,13 @@
  * 
  */
 
+#define _GNU_SOURCE /* for pthread_setaffinity_np() */
 #include "module.h"
 
 #include <stdlib.h> /* malloc(), free() */
+#include <sched.h>  /* for CPU_SET() */
 
+#include <sys/mman.h> /* for mmap() */
 #include <sys/stat.h> /* for open() */
 #include <fcntl.h>
 #include <unistd.h> /* for read() */
@@ -20,6 +23,191 @@
 #include <errno.h> 
 #include <stdio.h>  /* for snprintf() */
 
+/** 
+ * Pins the thread #th to the CPUs listed in #cpus[].
+ *
+ * @param th        thread
+ * @param cpus      an array of CPU numbers
+ * @param num_cpus  the number of elements in cpus[]; 0 makes the thread
+ *                  runnable on all CPUs
+ *
+ * @return K4W2_SUCCESS, K4W2_ERROR or K4W2_NOT_SUPPORTED
+ */
+int
+k4w2_thread_set_affinity(THREAD_T th, const int cpus[], int num_cpus)
+{
+#if defined __linux__
+    cpu_set_t set;
+    int i;
+    int r;
+
+    CPU_ZERO(&set);
+    if (0 == num_cpus) {
+	for (i = 0; i < CPU_SETSIZE; ++i)
+	    CPU_SET(i, &set);
+    }
+    for (i = 0; i < num_cpus; ++i) {
+	if (cpus[i] < 0 || CPU_SETSIZE <= cpus[i]) {
+	    VERBOSE("wrong cpu number; %d", cpus[i]);
+	    return K4W2_ERROR;
+	}
+	CPU_SET(cpus[i], &set);
+    }
+    r = pthread_setaffinity_np(th, sizeof(set), &set);
+    if (r) {
+	VERBOSE("pthread_setaffinity_np() failed; %s", strerror(r));
+	return K4W2_ERROR;
+    }
+    return K4W2_SUCCESS;
+#else
+    return K4W2_NOT_SUPPORTED;
+#endif
+}
+
+/* === memory allocator === */
+
+#define HUGEPAGE_SIZE (2*1024*1024)
+/* smaller blocks are not worth rounding up to HUGEPAGE_SIZE */
+#define HUGEPAGE_THRESHOLD (1024*1024)
+
+static void *
+default_alloc(size_t size, unsigned int flags, void *userdata)
+{
+    const int prot = PROT_READ | PROT_WRITE;
+    void *ptr = MAP_FAILED;
+
+#if defined MAP_HUGETLB
+    if (flags & K4W2_ALLOC_HUGEPAGE) {
+	/* needs pages reserved in /proc/sys/vm/nr_hugepages */
+	ptr = mmap(NULL, size, prot,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+		   ((flags & K4W2_ALLOC_PREFAULT)?MAP_POPULATE:0),
+		   -1, 0);
+	if (MAP_FAILED != ptr)
+	    return ptr;
+	TRACE("MAP_HUGETLB failed; %s", strerror(errno));
+    }
+#endif
+    ptr = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == ptr) {
+	VERBOSE("mmap() failed; %s", strerror(errno));
+	return NULL;
+    }
+#if defined MADV_HUGEPAGE
+    /* fall back on transparent hugepages */
+    if (flags & K4W2_ALLOC_HUGEPAGE)
+	madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    if (flags & K4W2_ALLOC_PREFAULT) {
+	/* the pages are placed on the NUMA node of the calling thread */
+	size_t i;
+	for (i = 0; i < size; i += 4096)
+	    ((volatile unsigned char *)ptr)[i] = 0;
+    }
+    return ptr;
+}
+
+static void
+default_free(void *ptr, size_t size, void *userdata)
+{
+    munmap(ptr, size);
+}
+
+static struct k4w2_allocator allocator = {default_alloc, default_free, NULL};
+static unsigned int allocator_flags = 0;
+static MUTEX_T allocator_mutex = MUTEX_INITIALIZER;
+
+/* stored in front of each block; a page is reserved for this to keep the
+ * returned pointer page-aligned */
+typedef struct {
+    struct k4w2_allocator allocator; /* allocator of this block */
+    size_t size;                     /* size of this block */
+} alloc_header;
+#define ALLOC_HEADER_SIZE 4096
+
+/** 
+ * Replaces the allocator used for large buffers, such as ring buffers
+ * of drivers, decoder contexts and registration maps. This affects
+ * buffers allocated after this call.
+ *
+ * K4W2_ALLOC_HUGEPAGE applies only to blocks of 1MB or more; it is
+ * cleared from the flags passed to allocator->alloc() for smaller ones.
+ *
+ * With K4W2_ALLOC_PREFAULT, pages are touched by the thread which opens
+ * the device or decoder. Linux places them on the NUMA node of that
+ * thread, so pin it first with k4w2_set_current_thread_affinity().
+ *
+ * @param allocator  an allocator, or NULL to use the default one
+ * @param flags      K4W2_ALLOC_*; passed to allocator->alloc()
+ *
+ * @return K4W2_SUCCESS or K4W2_ERROR
+ */
+int
+k4w2_set_allocator(const struct k4w2_allocator *new_allocator,
+		   unsigned int flags)
+{
+    static const struct k4w2_allocator defaults = {default_alloc, default_free, NULL};
+
+    if (new_allocator && (!new_allocator->alloc || !new_allocator->free))
+	return K4W2_ERROR;
+
+    MUTEX_LOCK(&allocator_mutex);
+    allocator = (new_allocator)?*new_allocator:defaults;
+    allocator_flags = flags;
+    MUTEX_UNLOCK(&allocator_mutex);
+    return K4W2_SUCCESS;
+}
+
+/** 
+ * Allocates #size bytes of page-aligned memory with the allocator
+ * set by k4w2_set_allocator(). The memory is not initialized.
+ *
+ * @param size 
+ * 
+ * @return a pointer to the memory, or NULL
+ */
+void *
+k4w2_alloc(size_t size)
+{
+    alloc_header h;
+    unsigned int flags;
+    unsigned char *ptr;
+
+    MUTEX_LOCK(&allocator_mutex);
+    h.allocator = allocator;
+    flags = allocator_flags;
+    MUTEX_UNLOCK(&allocator_mutex);
+
+    h.size = ALLOC_HEADER_SIZE + size;
+    if (h.size < HUGEPAGE_THRESHOLD)
+	flags &= ~K4W2_ALLOC_HUGEPAGE;
+    if (flags & K4W2_ALLOC_HUGEPAGE)
+	h.size = (h.size + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+
+    ptr = (unsigned char *)h.allocator.alloc(h.size, flags, h.allocator.userdata);
+    if (!ptr)
+	return NULL;
+    memcpy(ptr, &h, sizeof(h));
+    return ptr + ALLOC_HEADER_SIZE;
+}
+
+/** 
+ * Releases memory allocated by k4w2_alloc()
+ *
+ * @param ptr 
+ */
+void
+k4w2_free(void *ptr)
+{
+    alloc_header h;
+
+    if (!ptr)
+	return;
+    ptr = (unsigned char *)ptr - ALLOC_HEADER_SIZE;
+    memcpy(&h, ptr, sizeof(h));
+    h.allocator.free(ptr, h.size, h.allocator.userdata);
+}
+
 /** 
  * Allocates an array of #num elements of #size bytes each
  * and returns an array of pointers to the allocated memories.
@@ -37,9 +225,11 @@ allocate_bufs(int num, int size)
     buf = (unsigned char**)malloc(num * sizeof(char*));
     if (!buf)
 	goto err;
-    buf[0] = (unsigned char*)malloc( size * num );
-    if (!buf[0])
+    buf[0] = (unsigned char*)k4w2_alloc( (size_t)size * num );
+    if (!buf[0]) {
+	free(buf);
 	goto err;
+    }
     for (i = 1; i < num; ++i) {
 	buf[i] = buf[i-1] + size;
     }
@@ -57,11 +247,92 @@ void
 free_bufs(unsigned char **buf)
 {
     if (buf) {
-	free(buf[0]);
+	k4w2_free(buf[0]);
 	free(buf);
     }
 }
 
+/** 
+ * Returns the size in bytes of a pixel of #format.
+ * 
+ * @param format  K4W2_PIXELFORMAT_*
+ * 
+ * @return the size, or 0 if the format is unknown
+ */
+int
+k4w2_pixelformat_size(int format)
+{
+    switch (format) {
+    case K4W2_PIXELFORMAT_FLOAT:  return sizeof(float);
+    case K4W2_PIXELFORMAT_UINT16: return sizeof(uint16_t);
+    case K4W2_PIXELFORMAT_HALF:   return sizeof(uint16_t);
+    }
+    return 0;
+}
+
+/** 
+ * Converts a float to IEEE 754 half precision with round-to-nearest-even,
+ * as vstore_half_rte() of OpenCL does.
+ * 
+ * @param f 
+ * 
+ * @return the bit pattern of the half
+ */
+uint16_t
+k4w2_float_to_half(float f)
+{
+    union { float f; uint32_t u; } v;
+    v.f = f;
+    const uint32_t sign = (v.u >> 16) & 0x8000;
+    const int32_t exp = (int32_t)((v.u >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = v.u & 0x7fffff;
+
+    if (((v.u >> 23) & 0xff) == 0xff) /* inf or nan */
+	return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if (exp >= 31) /* overflow */
+	return sign | 0x7c00;
+    if (exp <= 0) {
+	if (exp < -10) /* underflow */
+	    return sign;
+	/* subnormal */
+	mant |= 0x800000;
+	const int shift = 14 - exp;
+	uint32_t h = mant >> shift;
+	const uint32_t rem = mant & ((1u << shift) - 1);
+	const uint32_t halfway = 1u << (shift - 1);
+	if (rem > halfway || (rem == halfway && (h & 1)))
+	    ++h;
+	return sign | h;
+    }
+
+    uint32_t h = sign | ((uint32_t)exp << 10) | (mant >> 13);
+    const uint32_t rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+	++h; /* a carry into the exponent is still correct */
+    return h;
+}
+
+/** 
+ * Stores #v into the #idx-th element of #dst in #format.
+ * Integer formats are rounded and saturated.
+ */
+void
+k4w2_store_pixel(void *dst, int format, size_t idx, float v)
+{
+    switch (format) {
+    case K4W2_PIXELFORMAT_UINT16:
+	((uint16_t *)dst)[idx] =
+	    (v <= 0.0f) ? 0 : ((v >= 65535.0f) ? 65535 : (uint16_t)(v + 0.5f));
+	break;
+    case K4W2_PIXELFORMAT_HALF:
+	((uint16_t *)dst)[idx] = k4w2_float_to_half(v);
+	break;
+    default:
+	((float *)dst)[idx] = v;
+	break;
+    }
+}
+
 /** 
  * Loads file. This function searchs for a #filename in #searchpath, and
  * reads first one in the #searchpath.
@@ -194,14 +465,14 @@ k4w2_camera_params_load(const char *dirname,
     return K4W2_SUCCESS;
 }
 
-static int
+int
 k4w2_mkdir_p(const char *dirname)
 {
     char path[FILENAME_MAX];
     char *cur;
     strncpy(path, dirname, sizeof(path));
     for (cur = path; *cur; ++cur) {
-	if ('/'==*cur || '\0'==*(cur+1)) {
+	if (cur != path && ('/'==*cur || '\0'==*(cur+1))) {
 	    if ('/'==*cur)
 		*cur = '\0';
 	    if ( mkdir(path, 0744) ) {
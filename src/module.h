@@ -17,6 +17,7 @@
 #include <stdio.h>  /* for fprintf() */
 #include <string.h> /* for memset() */
 #include <stdlib.h> /* for exit() */
+#include <stdint.h> /* for uint16_t */
 
 #ifdef __cplusplus
 #  define EXTERN_C_BEGIN extern "C" {
@@ -28,6 +29,29 @@
 
 EXTERN_C_BEGIN
 
+/* === thread === */
+#include <pthread.h>
+#define THREAD_T   pthread_t
+#define THREAD_CREATE(th,func,arg)  pthread_create(th, NULL, func, arg)
+#define THREAD_JOIN(th)             pthread_join(th, NULL)
+#define THREAD_SELF()               pthread_self()
+
+#define MUTEX_T    pthread_mutex_t
+#define MUTEX_INIT(mu)              pthread_mutex_init(mu, NULL)
+#define MUTEX_INITIALIZER           PTHREAD_MUTEX_INITIALIZER
+#define MUTEX_LOCK(mu)              pthread_mutex_lock(mu)
+#define MUTEX_UNLOCK(mu)            pthread_mutex_unlock(mu)
+#define MUTEX_DESTROY(mu)           pthread_mutex_destroy(mu)
+
+#define COND_T     pthread_cond_t
+#define COND_INIT(cond)             pthread_cond_init(cond, NULL)
+#define COND_TIMEDWAIT(cond,mutex,abstime) pthread_cond_timedwait(cond, mutex, abstime)
+#define COND_SIGNAL(cond)       pthread_cond_signal(cond)
+#define COND_BROADCAST(cond)	pthread_cond_broadcast(cond)
+#define COND_DESTROY(mu)	pthread_cond_destroy(mu)
+
+int k4w2_thread_set_affinity(THREAD_T th, const int cpus[], int num_cpus);
+
 /* === internal structure for kinect2 driver === */
 
 typedef enum {
@@ -46,13 +70,36 @@ typedef struct {
     int (*stop)(k4w2_t ctx);
     int (*close)(k4w2_t ctx);
     int (*read_param)(k4w2_t ctx, PARAM_ID id, void *param, int length);
+    /* applies ctx->cpus[] to the running threads; may be NULL */
+    int (*set_affinity)(k4w2_t ctx);
+    /* lists sensors in the order of deviceid, and returns the number of
+     * sensors found; may be NULL */
+    int (*enumerate)(struct k4w2_device_info info[], int max_devices);
+    /* requeues a buffer held by K4W2_HOLD_BUFFERS; may be NULL */
+    int (*release_buffer)(k4w2_t ctx, const void *buffer);
+    /* returns a dmabuf fd of a buffer passed to a callback; may be NULL */
+    int (*export_buffer)(k4w2_t ctx, const void *buffer);
+    /* assembles depth frames into the user's buffers, or into the
+     * driver's own if buffers is NULL; may be NULL */
+    int (*set_depth_buffers)(k4w2_t ctx, void *const buffers[],
+			     int num_buffers, int size);
 } k4w2_driver_ops;
 
+#define K4W2_MAX_AFFINITY_CPUS 64
+
+/* the number of event threads shared by all devices;
+ * see k4w2_set_num_event_threads() */
+extern int k4w2_num_event_threads;
+
 typedef enum {
     COLOR_CH = 0,
     DEPTH_CH = 1,
 } CHANNEL;
 
+/* the largest frames of each channel; a JPEG image and 10 depth images */
+#define COLOR_FRAME_MAX_SIZE (64*0x4000)
+#define DEPTH_FRAME_MAX_SIZE (KINECT2_DEPTH_FRAME_SIZE*10)
+
 /**
  * @struct k4w2_driver_ctx
  *
@@ -65,6 +112,18 @@ struct k4w2_driver_ctx {
 
     CHANNEL begin; /* COLOR_CH or DEPTH_CH */
     CHANNEL end;   /* COLOR_CH or DEPTH_CH */
+
+    /* options given to k4w2_open_ex() */
+    struct k4w2_open_options options;
+
+    /* camera parameters read once from the device; see read_param() */
+    void *param[NUM_PARAMS];
+    MUTEX_T param_mutex;
+
+    /* CPUs that the threads of this device run on; see
+     * k4w2_set_thread_affinity() */
+    int cpus[K4W2_MAX_AFFINITY_CPUS];
+    int num_cpus;  /* 0 means no affinity */
 };
 
 #define COLOR_ENABLED(ctx) (COLOR_CH == (ctx)->begin)
@@ -84,10 +143,15 @@ typedef struct {
 		      struct kinect2_p0table * p0table);
     int (*set_colorspace)(k4w2_decoder_t decoder, int colorspace);
     int (*get_colorspace)(k4w2_decoder_t decoder);
+    int (*set_pixelformat)(k4w2_decoder_t decoder, unsigned int plane, int format);
+    int (*get_pixelformat)(k4w2_decoder_t decoder, unsigned int plane);
     int (*get_gl_texture)(k4w2_decoder_t decoder, int slot, unsigned int options, unsigned int *texturename);
     int (*request)(k4w2_decoder_t ctx, int slot, const void *src, int src_length);
     int (*wait)(k4w2_decoder_t ctx, int slot);
     int (*fetch)(k4w2_decoder_t ctx, int slot, void *dst, int dst_length);
+    int (*map)(k4w2_decoder_t ctx, int slot, unsigned int option, const void **ptr);
+    int (*unmap)(k4w2_decoder_t ctx, int slot, unsigned int option);
+    int (*get_input_buffer)(k4w2_decoder_t ctx, int slot, void **ptr);
     int (*close)(k4w2_decoder_t ctx);
 } k4w2_decoder_ops;
 
@@ -111,26 +175,6 @@ void k4w2_register_decoder(const char *name,
 			   const k4w2_decoder_ops *ops,
 			   int ctx_size);
 
-/* === thread === */
-#include <pthread.h>
-#define THREAD_T   pthread_t
-#define THREAD_CREATE(th,func,arg)  pthread_create(th, NULL, func, arg)
-#define THREAD_JOIN(th)             pthread_join(th, NULL)
-
-#define MUTEX_T    pthread_mutex_t
-#define MUTEX_INIT(mu)              pthread_mutex_init(mu, NULL)
-#define MUTEX_INITIALIZER           PTHREAD_MUTEX_INITIALIZER
-#define MUTEX_LOCK(mu)              pthread_mutex_lock(mu)
-#define MUTEX_UNLOCK(mu)            pthread_mutex_unlock(mu)
-#define MUTEX_DESTROY(mu)           pthread_mutex_destroy(mu)
-
-#define COND_T     pthread_cond_t
-#define COND_INIT(cond)             pthread_cond_init(cond, NULL)
-#define COND_TIMEDWAIT(cond,mutex,abstime) pthread_cond_timedwait(cond, mutex, abstime)
-#define COND_SIGNAL(cond)       pthread_cond_signal(cond)
-#define COND_BROADCAST(cond)	pthread_cond_broadcast(cond)
-#define COND_DESTROY(mu)	pthread_cond_destroy(mu)
-
 /* === misc === */
 
 extern int k4w2_debug_level;
@@ -149,9 +193,27 @@ extern int k4w2_debug_level;
 #define STR(x)  #x
 
 
+void *k4w2_alloc(size_t size);
+void k4w2_free(void *ptr);
 unsigned char ** allocate_bufs(int num, int size);
 void free_bufs(unsigned char **buf);
 
+int k4w2_pixelformat_size(int format);
+uint16_t k4w2_float_to_half(float f);
+void k4w2_store_pixel(void *dst, int format, size_t idx, float v);
+
+/* === calibration tables === */
+#define K4W2_HASH_INIT 0xcbf29ce484222325ULL
+uint64_t k4w2_hash64(uint64_t h, const void *data, size_t len);
+
+int k4w2_create_trig_table(const float phase_in_rad[3], const uint16_t *p0table,
+			   float trig_table[512*424][6]);
+
+typedef int (*k4w2_calibration_build_t)(void *table, void *userdata);
+const void *k4w2_calibration_acquire(const char *name, uint64_t key, size_t size,
+				     k4w2_calibration_build_t build, void *userdata);
+void k4w2_calibration_release(const void *table);
+
 /* === file i/o === */
 int k4w2_search_and_load(const char *searchpath[], size_t num_searchpath,
 			 const char *filename,
@@ -161,6 +223,7 @@ int k4w2_load(const char *dirname, const char *filename,
 	      void *buf, size_t max_bufsize, size_t *actual_size);
 int k4w2_save(void *buf, size_t size, const char *dirname,
 	      const char *filename);
+int k4w2_mkdir_p(const char *dirname);
 
 
 EXTERN_C_END
@@ -23,12 +23,17 @@
 static const float depth_q = 0.01;
 static const float color_q = 0.002199;
 
+/* maps shared by registrations; see k4w2_calibration_acquire() */
+struct registration_maps {
+    float undistort_map[512][424][2];
+    float depth_to_color_map[512][424][2];
+};
+
 struct k4w2_registration {
     struct kinect2_depth_camera_param depth;
     struct kinect2_color_camera_param color;
 
-    float undistort_map[512][424][2];
-    float depth_to_color_map[512][424][2];
+    const struct registration_maps *maps;
 };
 
 
@@ -74,8 +79,8 @@ k4w2_registration_depth_to_color(k4w2_registration_t reg,
 				 int dx, int dy, float dz,
 				 float *cx, float *cy)
 {
-    float rx = reg->depth_to_color_map[dx][dy][0];
-    *cy = reg->depth_to_color_map[dx][dy][1];
+    float rx = reg->maps->depth_to_color_map[dx][dy][0];
+    *cy = reg->maps->depth_to_color_map[dx][dy][1];
 
     rx += reg->color.shift_m / dz;
     *cx = rx * reg->color.f + reg->color.cx;
@@ -120,34 +125,65 @@ k4w2_registration_create_from_ctx(k4w2_t ctx)
 				    &depth_param);
 }
 
-k4w2_registration_t
-k4w2_registration_create(struct kinect2_color_camera_param *color,
-			 struct kinect2_depth_camera_param *depth)
+static int
+build_maps(void *table, void *userdata)
 {
-    int mx, my;
-    
-    k4w2_registration_t reg = (k4w2_registration_t)malloc(sizeof(*reg));
-    memcpy(&reg->depth, depth, sizeof(reg->depth));
-    memcpy(&reg->color, color, sizeof(reg->color));
-
-
-    for (mx = 0; mx < 512; mx++)
+    struct registration_maps *maps = (struct registration_maps *)table;
+    k4w2_registration_t reg = (k4w2_registration_t)userdata;
+    int mx;
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (mx = 0; mx < 512; mx++) {
+	int my;
 	for (my = 0; my < 424; my++) {
 	    float x, y;
 	    distort_depth(reg, mx,my, &x, &y);
-	    reg->undistort_map[mx][my][0] = x;
-	    reg->undistort_map[mx][my][1] = y;
+	    maps->undistort_map[mx][my][0] = x;
+	    maps->undistort_map[mx][my][1] = y;
 	}
+    }
 
-    for (mx = 0; mx < 512; mx++)
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (mx = 0; mx < 512; mx++) {
+	int my;
 	for (my = 0; my < 424; my++) {
 	    float rx, ry;
 	    depth_to_color(reg,
-			   reg->undistort_map[mx][my][0],
-			   reg->undistort_map[mx][my][1], &rx, &ry);
-	    reg->depth_to_color_map[mx][my][0] = rx;
-	    reg->depth_to_color_map[mx][my][1] = ry;
+			   maps->undistort_map[mx][my][0],
+			   maps->undistort_map[mx][my][1], &rx, &ry);
+	    maps->depth_to_color_map[mx][my][0] = rx;
+	    maps->depth_to_color_map[mx][my][1] = ry;
 	}
+    }
+    return K4W2_SUCCESS;
+}
+
+k4w2_registration_t
+k4w2_registration_create(struct kinect2_color_camera_param *color,
+			 struct kinect2_depth_camera_param *depth)
+{
+    uint64_t key;
+    
+    k4w2_registration_t reg = (k4w2_registration_t)malloc(sizeof(*reg));
+    if (!reg)
+	return NULL;
+    memcpy(&reg->depth, depth, sizeof(reg->depth));
+    memcpy(&reg->color, color, sizeof(reg->color));
+
+    key = k4w2_hash64(K4W2_HASH_INIT, depth, sizeof(*depth));
+    key = k4w2_hash64(key, color, sizeof(*color));
+    reg->maps = (const struct registration_maps *)
+	k4w2_calibration_acquire("registration", key,
+				 sizeof(struct registration_maps),
+				 build_maps, reg);
+    if (!reg->maps) {
+	free(reg);
+	return NULL;
+    }
 
     return reg;
 }
@@ -156,6 +192,8 @@ void
 k4w2_registration_release(k4w2_registration_t *registration)
 {
     if (registration) {
+	if (*registration)
+	    k4w2_calibration_release((*registration)->maps);
 	free(*registration);
 	*registration = 0;
     }
@@ -0,0 +1,202 @@
+/**
+ * @file   check_tables.c
+ *
+ * @brief  checks the calibration tables built in parallel
+ *
+ * The tables are built from synthetic camera parameters. The trig table,
+ * which is computed with cosf()/sinf(), is compared with the same
+ * formula evaluated serially in double precision; the x/z table and the
+ * registration maps are compared with the ones built by a single
+ * thread, which must be identical.
+ */
+
+#include "libk4w2/libk4w2.h"
+#include "libk4w2/registration.h"
+#include "module.h"
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* cosf()/sinf() are within a few ulps of the correctly rounded value */
+#define MAX_TRIG_ERROR 1e-6
+/* threads of the parallel builds, even on a single core */
+#define NUM_THREADS 4
+
+static void
+set_num_threads(int n)
+{
+#ifdef _OPENMP
+    omp_set_num_threads(n);
+#else
+    (void)n;
+#endif
+}
+
+static void
+make_params(struct kinect2_color_camera_param *color,
+	    struct kinect2_depth_camera_param *depth)
+{
+    memset(color, 0, sizeof(*color));
+    memset(depth, 0, sizeof(*depth));
+
+    depth->fx = 365.5f;
+    depth->fy = 365.5f;
+    depth->cx = 257.3f;
+    depth->cy = 205.6f;
+    depth->k1 = 0.0925f;
+    depth->k2 = -0.2720f;
+    depth->k3 = 0.0946f;
+
+    color->table_id = 1;
+    color->f = 1081.37f;
+    color->cx = 959.5f;
+    color->cy = 539.5f;
+    color->shift_d = 863.0f;
+    color->shift_m = 52.0f;
+    color->mx_x3y0 = 0.000449f;
+    color->mx_x0y3 = 0.000001f;
+    color->mx_x2y1 = 0.000043f;
+    color->mx_x1y2 = 0.000468f;
+    color->mx_x2y0 = -0.000180f;
+    color->mx_x0y2 = -0.000015f;
+    color->mx_x1y1 = 0.000003f;
+    color->mx_x1y0 = 0.640535f;
+    color->mx_x0y1 = -0.000002f;
+    color->mx_x0y0 = 0.139452f;
+    color->my_x3y0 = 0.000004f;
+    color->my_x0y3 = 0.000454f;
+    color->my_x2y1 = 0.000471f;
+    color->my_x1y2 = 0.000003f;
+    color->my_x2y0 = 0.000001f;
+    color->my_x0y2 = -0.000129f;
+    color->my_x1y1 = -0.000224f;
+    color->my_x1y0 = 0.000003f;
+    color->my_x0y1 = 0.640960f;
+    color->my_x0y0 = 0.000870f;
+}
+
+static int
+check_trig_table(void)
+{
+    static const float phase_in_rad[3] = { 0.0f, 2.094395f, 4.18879f };
+    uint16_t *p0table = (uint16_t *)malloc(512*424 * sizeof(uint16_t));
+    float (*table)[6] = (float (*)[6])malloc(512*424 * sizeof(*table));
+    double max_error = 0;
+    int i;
+
+    if (!p0table || !table)
+	return K4W2_ERROR;
+    for (i = 0; i < 512*424; ++i)
+	p0table[i] = (uint16_t)(i * 2654435761u >> 16);
+
+    set_num_threads(NUM_THREADS);
+    k4w2_create_trig_table(phase_in_rad, p0table, table);
+
+    for (i = 0; i < 512*424; ++i) {
+	const int x = i % 512;
+	const int y = i / 512;
+	const float p0 = -0.000031 * M_PI * p0table[(423-y)*512 + x];
+	int k;
+	for (k = 0; k < 3; ++k) {
+	    const float tmp = p0 + phase_in_rad[k];
+	    max_error = fmax(max_error, fabs(table[i][k] - cos(tmp)));
+	    max_error = fmax(max_error, fabs(table[i][3+k] - sin(-tmp)));
+	}
+    }
+    free(p0table);
+    free(table);
+
+    printf("trig table: max error %g\n", max_error);
+    return (max_error <= MAX_TRIG_ERROR) ? K4W2_SUCCESS : K4W2_ERROR;
+}
+
+static int
+check_xz_table(const struct kinect2_depth_camera_param *depth)
+{
+    const size_t size = 512*424 * sizeof(float);
+    float *x[2], *z[2];
+    size_t mismatch = 0;
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+	x[i] = (float *)malloc(size);
+	z[i] = (float *)malloc(size);
+	if (!x[i] || !z[i])
+	    return K4W2_ERROR;
+	set_num_threads((0 == i) ? 1 : NUM_THREADS);
+	if (K4W2_SUCCESS != k4w2_create_xz_table(depth, x[i], size, z[i], size))
+	    return K4W2_ERROR;
+    }
+    for (i = 0; i < 512*424; ++i)
+	mismatch += (x[0][i] != x[1][i] || z[0][i] != z[1][i]);
+    for (i = 0; i < 2; ++i) {
+	free(x[i]);
+	free(z[i]);
+    }
+
+    printf("x/z table: %zd mismatches\n", mismatch);
+    return (0 == mismatch) ? K4W2_SUCCESS : K4W2_ERROR;
+}
+
+static int
+check_registration(struct kinect2_color_camera_param *color,
+		   struct kinect2_depth_camera_param *depth)
+{
+    float *map[2];
+    size_t mismatch = 0;
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+	k4w2_registration_t reg;
+	int x, y;
+	map[i] = (float *)malloc(512*424*2 * sizeof(float));
+	if (!map[i])
+	    return K4W2_ERROR;
+	/* the maps are rebuilt since the first ones have been released */
+	set_num_threads((0 == i) ? 1 : NUM_THREADS);
+	reg = k4w2_registration_create(color, depth);
+	if (!reg)
+	    return K4W2_ERROR;
+	for (y = 0; y < 424; ++y) {
+	    for (x = 0; x < 512; ++x) {
+		float *m = &map[i][(y*512 + x) * 2];
+		k4w2_registration_depth_to_color(reg, x, y, 1000.0f, &m[0], &m[1]);
+	    }
+	}
+	k4w2_registration_release(&reg);
+    }
+    for (i = 0; i < 512*424*2; ++i)
+	mismatch += (map[0][i] != map[1][i]);
+    free(map[0]);
+    free(map[1]);
+
+    printf("registration: %zd mismatches\n", mismatch);
+    return (0 == mismatch) ? K4W2_SUCCESS : K4W2_ERROR;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct kinect2_color_camera_param color;
+    struct kinect2_depth_camera_param depth;
+    int failed = 0;
+
+    /* tables must be built, not loaded */
+    k4w2_set_calibration_cache(NULL);
+    make_params(&color, &depth);
+
+    failed |= (K4W2_SUCCESS != check_trig_table());
+    failed |= (K4W2_SUCCESS != check_xz_table(&depth));
+    failed |= (K4W2_SUCCESS != check_registration(&color, &depth));
+
+    return failed ? 1 : 0;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset:  4
+ * End:
+ */